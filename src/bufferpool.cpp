@@ -0,0 +1,103 @@
+// Buffer Pool - recycle frame-sized allocations across import stages.
+#include "bufferpool.h"
+#include "exception.h"
+
+#include <algorithm>
+#include <new>
+
+using namespace std;
+
+BufferPool::BufferPool(size_t capacity): capacity(capacity)
+{
+}
+
+BufferPool::~BufferPool()
+{
+    for (auto& [size, blocks] : freeBlocks) {
+        for (uchar* data : blocks) {
+            operator delete(data, align_val_t(kAlignment));
+        }
+    }
+}
+
+size_t BufferPool::GetSizeClass(size_t size)
+{
+    size = max(size, kAlignment);
+    // Split each power of two into eight classes
+    size_t octave = 1;
+    while (octave * 2 <= size) {
+        octave *= 2;
+    }
+    const size_t step = max(octave / 8, kAlignment);
+    return (size + step - 1) / step * step;
+}
+
+uchar* BufferPool::Acquire(size_t size)
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        auto it = freeBlocks.find(size);
+        if (it != freeBlocks.end() && !it->second.empty()) {
+            uchar* data = it->second.back();
+            it->second.pop_back();
+            stats.hits++;
+            stats.freeBytes -= size;
+            stats.usedBytes += size;
+            return data;
+        }
+        stats.misses++;
+        stats.usedBytes += size;
+        stats.peakBytes = max(stats.peakBytes, stats.usedBytes + stats.freeBytes);
+    }
+    return static_cast<uchar*>(operator new(size, align_val_t(kAlignment)));
+}
+
+void BufferPool::Release(uchar* data, size_t size)
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        stats.usedBytes -= size;
+        if (stats.freeBytes + size <= capacity) {
+            freeBlocks[size].push_back(data);
+            stats.freeBytes += size;
+            return;
+        }
+    }
+    operator delete(data, align_val_t(kAlignment));
+}
+
+void BufferPool::ReleaseImage(void* info)
+{
+    Block* block = static_cast<Block*>(info);
+    block->pool->Release(block->data, block->size);
+    delete block;
+}
+
+QImage BufferPool::AllocateImage(int width, int height, QImage::Format format)
+{
+    Allocator replacement;
+    {
+        lock_guard<mutex> lock(mtx);
+        replacement = allocator;
+    }
+    if (replacement) {
+        return replacement(width, height, format);
+    }
+    const int depth = QImage::toPixelFormat(format).bitsPerPixel();
+    const int bytesPerLine = (width * depth / 8 + 15) / 16 * 16;
+    const size_t size = GetSizeClass(static_cast<size_t>(bytesPerLine) * height);
+    Block* block = new Block { this, Acquire(size), size };
+    return QImage(block->data, width, height, bytesPerLine, format, &BufferPool::ReleaseImage, block);
+}
+
+void BufferPool::SetAllocator(Allocator allocator)
+{
+    lock_guard<mutex> lock(mtx);
+    this->allocator = move(allocator);
+}
+
+BufferPool::Stats BufferPool::GetStats()
+{
+    lock_guard<mutex> lock(mtx);
+    return stats;
+}
@@ -0,0 +1,78 @@
+// Buffer Pool - recycle frame-sized allocations across import stages. Sizes
+// are rounded up to one of eight classes per power of two, so a recycled
+// buffer wastes at most 12.5%. Free buffers are kept up to a memory cap.
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <QImage>
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+
+class BufferPool
+{
+public:
+    using Allocator = std::function<QImage(int width, int height, QImage::Format format)>;
+
+    struct Stats
+    {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t usedBytes = 0;       // held by images
+        size_t freeBytes = 0;       // cached for reuse
+        size_t peakBytes = 0;       // the peak of used plus free bytes
+
+        double GetHitRate() const { return hits + misses ? static_cast<double>(hits) / (hits + misses) : 0; }
+    };
+
+private:
+    static constexpr size_t kDefaultCapacity = 256 << 20;
+    static constexpr size_t kAlignment = 64;
+
+    struct Block
+    {
+        BufferPool* pool;
+        uchar* data;
+        size_t size;
+    };
+
+    std::mutex mtx;
+    size_t capacity;
+    std::map<size_t, std::vector<uchar*>> freeBlocks;
+    Stats stats;
+    Allocator allocator;    // replaces pooled buffers while set
+
+    static size_t GetSizeClass(size_t size);
+    static void ReleaseImage(void* info);
+
+    uchar* Acquire(size_t size);
+    void Release(uchar* data, size_t size);
+
+    explicit BufferPool(size_t capacity);
+    ~BufferPool();
+    BufferPool(const BufferPool& pool) = delete;
+    BufferPool(BufferPool&& pool) = delete;
+
+public:
+
+    static BufferPool& getInstance()
+    {
+        static BufferPool instance(kDefaultCapacity);
+        return instance;
+    }
+
+    // Allocate an uninitialized image backed by a pooled buffer. The buffer
+    // returns to the pool when the last copy of the image is destroyed.
+    QImage AllocateImage(int width, int height, QImage::Format format);
+
+    // Allocate images by allocator instead of pooled buffers, null restores
+    // pooling. Decode workers allocate frames in shared memory this way.
+    void SetAllocator(Allocator allocator);
+
+    Stats GetStats();
+};
+
+#endif // BUFFERPOOL_H
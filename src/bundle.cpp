@@ -0,0 +1,152 @@
+// Bundle - processed cache entries packaged for other machines.
+#include "bundle.h"
+#include "exception.h"
+#include "hash.h"
+#include "schema.h"
+
+#include <QDataStream>
+
+using namespace std;
+
+constexpr quint32 kBundleMagic = 0x53444442;    // "SDDB"
+constexpr quint32 kBundleVersion = 1;
+
+void WriteFiles(QDataStream& stream, const QMap<QString, QByteArray>& files)
+{
+    stream << static_cast<quint32>(files.size());
+    for (auto it = files.begin(); it != files.end(); ++it) {
+        const QByteArray& data = it.value();
+        stream << it.key() << static_cast<quint64>(Xxh64(data.constData(), data.size(), 0)) << qCompress(data);
+    }
+}
+
+QMap<QString, QByteArray> ReadFiles(QDataStream& stream, const QString& checksum)
+{
+    QMap<QString, QByteArray> files;
+    quint32 count = 0;
+    stream >> count;
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++) {
+        QString name;
+        quint64 hash = 0;
+        QByteArray compressed;
+        stream >> name >> hash >> compressed;
+        const QByteArray& data = qUncompress(compressed);
+        if (stream.status() != QDataStream::Ok || Xxh64(data.constData(), data.size(), 0) != hash) {
+            throw Exception(
+                        Exception::ParseBundleError,
+                        "corrupt file " + name.toStdString() + " of " + checksum.toStdString());
+        }
+        files.insert(name, data);
+    }
+    return files;
+}
+
+BundleWriter::BundleWriter(const QString& path): file(path)
+{
+    if (!file.open(QIODevice::WriteOnly)) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "can't write file " + path.toStdString());
+    }
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << kBundleMagic << kBundleVersion << static_cast<qint32>(kSchemaVersion);
+}
+
+void BundleWriter::Add(const BundleEntry& entry)
+{
+    // Records are length-prefixed, so readers index entries by skipping them
+    QByteArray record;
+    {
+        QDataStream stream(&record, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_5_0);
+        WriteFiles(stream, entry.files);
+        stream << static_cast<quint32>(entry.blobs.size());
+        for (auto it = entry.blobs.begin(); it != entry.blobs.end(); ++it) {
+            stream << it.key();
+            WriteFiles(stream, it.value());
+        }
+    }
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << entry.checksum << record;
+    if (stream.status() != QDataStream::Ok) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "can't write file " + file.fileName().toStdString());
+    }
+}
+
+void BundleWriter::Commit()
+{
+    if (!file.commit()) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "can't write file " + file.fileName().toStdString());
+    }
+}
+
+BundleReader::BundleReader(const QString& path): file(path)
+{
+    if (!file.open(QFile::ReadOnly)) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "can't open file " + path.toStdString());
+    }
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    quint32 magic = 0, version = 0;
+    qint32 schemaVersion = 0;
+    stream >> magic >> version >> schemaVersion;
+    if (magic != kBundleMagic || version != kBundleVersion) {
+        throw Exception(
+                    Exception::ParseBundleError,
+                    "unsupported bundle " + path.toStdString());
+    }
+    if (schemaVersion != kSchemaVersion) {
+        throw Exception(
+                    Exception::ParseBundleError,
+                    "bundle " + path.toStdString() + " has schema version " + to_string(schemaVersion));
+    }
+    while (!stream.atEnd()) {
+        QString checksum;
+        quint32 size = 0;
+        stream >> checksum;
+        const qint64 offset = file.pos();
+        stream >> size;
+        if (stream.status() != QDataStream::Ok || stream.skipRawData(size) != static_cast<int>(size)) {
+            throw Exception(
+                        Exception::ParseBundleError,
+                        "truncated bundle " + path.toStdString());
+        }
+        offsets.insert(checksum, offset);
+    }
+}
+
+BundleEntry BundleReader::Read(const QString& checksum)
+{
+    BundleEntry entry;
+    entry.checksum = checksum;
+    QByteArray record;
+    if (file.seek(offsets.value(checksum, -1))) {
+        QDataStream stream(&file);
+        stream.setVersion(QDataStream::Qt_5_0);
+        stream >> record;
+    }
+    QDataStream stream(record);
+    stream.setVersion(QDataStream::Qt_5_0);
+    entry.files = ReadFiles(stream, checksum);
+    quint32 count = 0;
+    stream >> count;
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++) {
+        QString hash;
+        stream >> hash;
+        entry.blobs.insert(hash, ReadFiles(stream, checksum));
+    }
+    if (record.isEmpty() || stream.status() != QDataStream::Ok) {
+        throw Exception(
+                    Exception::ParseBundleError,
+                    "corrupt entry " + checksum.toStdString());
+    }
+    return entry;
+}
@@ -0,0 +1,59 @@
+// Bundle - processed cache entries packaged for other machines. A machine
+// with the same source HEIC installs an entry by a verified copy of its
+// files, instead of decoding and encoding every frame again.
+// Layout, in QDataStream format:
+//   magic, format version, schema version
+//   per entry: content hash of the source file, then a record of the files
+//   of the entry and the blobs of its frames. Each file is stored as name,
+//   XXH64 of its content and qCompress'ed content.
+// Bundles of another schema version are rejected, their entries would be
+// migrated or imported again anyway.
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QMap>
+#include <QSaveFile>
+#include <QString>
+#include <QStringList>
+
+struct BundleEntry
+{
+    QString checksum;                                   // content hash of the source HEIC file
+    QMap<QString, QByteArray> files;                    // files of the cache entry by name
+    QMap<QString, QMap<QString, QByteArray>> blobs;     // blobs by hash, see FrameStore::Export
+};
+
+class BundleWriter
+{
+    QSaveFile file;
+
+public:
+    // Create a bundle, it replaces path once committed.
+    explicit BundleWriter(const QString& path);
+
+    void Add(const BundleEntry& entry);
+
+    void Commit();
+};
+
+class BundleReader
+{
+    QFile file;
+    QMap<QString, qint64> offsets;  // records by checksum
+
+public:
+    // Open a bundle and index its entries. Throws if it is not a bundle of
+    // the current schema version.
+    explicit BundleReader(const QString& path);
+
+    QStringList GetChecksums() const { return offsets.keys(); }
+
+    bool Contains(const QString& checksum) const { return offsets.contains(checksum); }
+
+    // Read an entry, decompress and verify each file against its checksum.
+    BundleEntry Read(const QString& checksum);
+};
+
+#endif // BUNDLE_H
@@ -1,22 +1,35 @@
 // Cache - designed for:
 // 1. Update location by IP.
 // 2. Update wallpaper cache.
+#include "bufferpool.h"
+#include "bundle.h"
 #include "cache.h"
+#include "delta.h"
+#include "download.h"
 #include "exception.h"
+#include "hash.h"
 #include "heic.h"
+#include "log.h"
+#include "metrics.h"
+#include "scale.h"
+#include "schema.h"
+#include "transfer.h"
+#include "writeback.h"
 
 #include <QDir>
 #include <QSet>
 #include <QDirIterator>
+#include <QElapsedTimer>
+#include <QFileInfo>
 #include <QStandardPaths>
-#include <QCryptographicHash>
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QMap>
 #include <QSettings>
+#include <QUrl>
 
 #include <httplib.h>
-#include <spdlog/spdlog.h>
 
 #include <algorithm>
 #include <cmath>
@@ -24,18 +37,46 @@
 
 using namespace std;
 
-QString Checksum(const QString &fileName)
+// Parse a manifest, map frame index to blob hash. A trailing line without
+// newline is a torn write and is ignored.
+QMap<int, QString> ParseManifest(const QByteArray& data)
 {
-    QFile f(fileName);
-    if (f.open(QFile::ReadOnly)) {
-        QCryptographicHash hash(QCryptographicHash::Md5);
-        if (hash.addData(&f)) {
-            return hash.result().toHex();
+    QMap<int, QString> manifest;
+    const QList<QByteArray>& lines = data.split('\n');
+    for (int i = 0; i + 1 < lines.size(); i++) {
+        const QStringList& fields = QString::fromUtf8(lines.at(i)).trimmed().split(' ');
+        if (fields.size() == 2) {
+            manifest.insert(fields.at(0).toInt(), fields.at(1));
         }
     }
-    throw Exception(
-                Exception::OpenFileError,
-                "can't open file " + fileName.toStdString());
+    return manifest;
+}
+
+// Read manifest of a cache entry.
+QMap<int, QString> LoadManifest(const QString& path)
+{
+    QFile manifestFile(path + "/manifest");
+    if (!manifestFile.open(QFile::ReadOnly)) {
+        return QMap<int, QString>();
+    }
+    return ParseManifest(manifestFile.readAll());
+}
+
+// Files of a cache entry in commit order, the manifest marks it complete.
+const QStringList& GetEntryFiles()
+{
+    static const QStringList files { "config.json", "cover_icon.jpg", "cover.jpg", "schema.json", "manifest" };
+    return files;
+}
+
+// Entries without manifest are written by older versions in one pass.
+bool IsImportComplete(const QString& path)
+{
+    QFile manifestFile(path + "/manifest");
+    if (!manifestFile.open(QFile::ReadOnly)) {
+        return !manifestFile.exists();
+    }
+    return manifestFile.readAll().endsWith("end\n");
 }
 
 CachedLocation GetLocationFromIP()
@@ -63,53 +104,54 @@ CachedLocation GetLocationFromIP()
                 "failed to get location from IP");
 }
 
-Position GetSolarPosition(double lat, double lon, const Time& tm)
+CachedFrame CachedPicture::GetFrame(const CachedLocation& location) const
 {
-    // Create location
-    Location loc;
-    loc.longitude = lon;
-    loc.latitude = lat;
-    loc.pressure = 101.325;
-    loc.temperature = 288;
-
-    // Compute positions
-    Position pos;
-    SolTrack(tm, loc, &pos, 1, 1, 0, 0);
-    return pos;
+    return GetFrame(location, ToTime(chrono::system_clock::now()));
 }
 
-double CachedFrame::GetDistance(const CachedLocation& location, const Time& tm) const
+FrameSelection CachedPicture::Select(const CachedLocation& location, const Time& tm) const
 {
-    const Position& position = GetSolarPosition(location.latitude, location.longitude, tm);
-    double distance = acos(
-                cos(position.altitude*PI/180) * cos(altitude*PI/180) * cos(azimuth*PI/180 - position.azimuthRefract*PI/180)
-                + sin(position.altitude*PI/180) * sin(altitude*PI/180));
-    spdlog::info("distance between ({},{}) and ({},{}) is {}",
-                 position.azimuthRefract, position.altitudeRefract,
-                 azimuth, altitude, distance);
-    return distance;
+    return selector.Select(GetSolarPosition(location.latitude, location.longitude, tm));
 }
 
-CachedFrame CachedPicture::GetFrame(const CachedLocation& location) const
+CachedFrame CachedPicture::GetFrame(const CachedLocation& location, const Time& tm) const
 {
-    auto currentTime = chrono::system_clock::now();
-    time_t tt = chrono::system_clock::to_time_t(currentTime);
-    tm local_tm = *gmtime(&tt);
-    Time time;
-    time.year = local_tm.tm_year + 1900;
-    time.month = local_tm.tm_mon + 1;
-    time.day = local_tm.tm_mday;
-    time.hour = local_tm.tm_hour;
-    time.minute = local_tm.tm_min;
-    time.second = local_tm.tm_sec;
-    return GetFrame(location, time);
+    const FrameSelection& selection = Select(location, tm);
+    if (selection.best < 0) {
+        throw Exception(Exception::PictureNotExistsError, "picture " + name.toStdString() + " has no frame");
+    }
+    return frames[selection.best];
 }
 
-CachedFrame CachedPicture::GetFrame(const CachedLocation& location, const Time& tm) const
+// Order frames not imported yet by the time they are next due during the
+// next day. Frames never due and imported frames are appended at the end.
+QVector<int> GetImportOrder(const CachedPicture& picture, const CachedLocation& location, int frameCount)
 {
-    return *min_element(frames.begin(), frames.end(), [&](const CachedFrame& lhs, const CachedFrame& rhs)->bool{
-        return lhs.GetDistance(location, tm) < rhs.GetDistance(location, tm);
-    });
+    static constexpr int kStepMinutes = 10;
+    // Imported frames would win every selection, select among the rest
+    FrameSelector pending;
+    QVector<int> pendingIndices;
+    for (const CachedFrame& frame : picture.frames) {
+        if (!frame.ready) {
+            pending.Add(frame.altitude, frame.azimuth, true);
+            pendingIndices.push_back(frame.index);
+        }
+    }
+    QVector<int> order;
+    const auto now = chrono::system_clock::now();
+    for (int step = 0; pending.GetSize() > 0 && step < 24 * 60 / kStepMinutes; step++) {
+        const Time& tm = ToTime(now + chrono::minutes(step * kStepMinutes));
+        const int index = pendingIndices[pending.Select(GetSolarPosition(location.latitude, location.longitude, tm)).best];
+        if (!order.contains(index)) {
+            order.push_back(index);
+        }
+    }
+    for (int i = 0; i < frameCount; i++) {
+        if (!order.contains(i)) {
+            order.push_back(i);
+        }
+    }
+    return order;
 }
 
 Cache::Cache()
@@ -117,103 +159,801 @@ Cache::Cache()
     // Find home path
     const QStringList& homePaths = QStandardPaths::standardLocations(QStandardPaths::HomeLocation);
     if (homePaths.empty()) {
-        spdlog::critical("home directory not found");
+        GetLogger(CacheLog).critical("home directory not found");
         exit(-1);
     }
     homePath = homePaths.front();
-    spdlog::info("find home directory: {}", homePath.toStdString());
+    GetLogger(CacheLog).info("find home directory: {}", homePath.toStdString());
 
     // Create directories if not exist
     const QDir& rootDir = QDir::root();
     rootDir.mkpath(GetCacheDir());
     rootDir.mkpath(GetPictureDir());
+    rootDir.mkpath(GetStoreDir());
+    rootDir.mkpath(GetStagingDir());
+    rootDir.mkpath(GetDownloadDir());
+    store = FrameStore(GetStoreDir());
 
-    // Create sync thread
-    pictureSyncThread = thread(&Cache::SyncPictureCache, this);
-    locationSyncThread = thread(&Cache::SyncLocationCache, this);
+    // Schedule sync jobs. Hashing the library competes with startup, defer
+    // the first picture sync unless nothing is imported yet.
+    ScheduleSync(pictureSyncJob, ListCaches().empty() ? chrono::milliseconds(0) : kStartupSyncDelay);
+    ScheduleSync(locationSyncJob, chrono::milliseconds(0));
 }
 
 Cache::~Cache()
+{
+    // Background jobs refer to the cache, wait for them before destruction.
+    Terminate();
+}
+
+void Cache::Terminate()
 {
     isTerminated = true;
-    NotifyLocationSyncer();
-    NotifyCacheSyncer();
-    pictureSyncThread.join();
-    locationSyncThread.join();
+    Scheduler::getInstance().Shutdown();
+}
+
+void Cache::ScheduleSync(SyncJob& job, chrono::milliseconds delay)
+{
+    if (!syncsEnabled) {
+        return;
+    }
+    lock_guard<mutex> lock(job.tokenMutex);
+    job.token.Cancel();
+    job.token = CancellationToken();
+    Scheduler::getInstance().PostDelayed(Scheduler::Normal, delay, [this, &job](){ RunSync(job); }, job.token);
+}
+
+void Cache::RunSync(SyncJob& job)
+{
+    unique_lock<mutex> lock(job.runMutex, try_to_lock);
+    if (!lock.owns_lock()) {
+        // Running on another worker, it will run again once done.
+        job.pending = true;
+        return;
+    }
+    job.pending = false;
+    try {
+        (this->*job.sync)();
+    } catch (const Exception& e) {
+        GetLogger(CacheLog).error("sync failed: {}", e.what());
+    }
+    if (!isTerminated) {
+        ScheduleSync(job, job.pending ? chrono::milliseconds(0) : job.period);
+    }
 }
 
 void Cache::SyncPictureCache()
 {
-    while (!isTerminated) {
-        bool changed = false;
-
-        // List caches
-        const QVector<QString> caches = ListCaches();
-        QSet<QString> cacheSet;
-        for (const QString& cache : caches) {
-            cacheSet.insert(cache);
-        }
-
-        // List pictures
-        const QVector<QString> pictures = ListPictures();
-        for (const QString& picture : pictures) {
-            const QString& path = GetPictureDir() + "/" + picture;
-            const QString& checksum = Checksum(path);
-            if (!cacheSet.contains(checksum)) {
-                spdlog::info("add cache for {}", path.toStdString());
-                Heic heic = Heic::Load(path);
-                const QString cachePath = GetCacheDir() + "/" + checksum;
-                QDir(cachePath).mkpath(".");
-                heic.Save(cachePath);
-                changed = true;
-            } else {
-                cacheSet.remove(checksum);
+    bool changed = false;
+
+    // List caches
+    const QVector<QString> caches = ListCaches();
+    QSet<QString> cacheSet;
+    for (const QString& cache : caches) {
+        cacheSet.insert(cache);
+    }
+
+    // List staging entries
+    QSet<QString> stagingSet;
+    for (const QString& staging : QDir(GetStagingDir()).entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+        stagingSet.insert(staging);
+    }
+
+    // Entries of earlier versions are keyed by MD5
+    bool hasLegacyKeys = any_of(cacheSet.begin(), cacheSet.end(), IsLegacyKey)
+            || any_of(stagingSet.begin(), stagingSet.end(), IsLegacyKey);
+
+    // List pictures
+    const QVector<QString> pictures = ListPictures();
+    QSet<QString> checksumSet;
+    for (const QString& picture : pictures) {
+        if (isTerminated) {
+            return;
+        }
+        const QString& path = GetPictureDir() + "/" + picture;
+        const QString& checksum = GetChecksum(path);
+        if (hasLegacyKeys && !cacheSet.contains(checksum) && !stagingSet.contains(checksum)) {
+            MigrateLegacyEntry(path, checksum, cacheSet, stagingSet);
+        }
+        if (checksumSet.contains(checksum)) {
+            continue;
+        }
+        checksumSet.insert(checksum);
+        stagingSet.remove(checksum);
+        const bool isCached = cacheSet.remove(checksum);
+        if (brokenPictures.contains(checksum)
+                || (isCached && (completeCaches.contains(checksum)
+                                 || IsImportComplete(GetCacheDir() + "/" + checksum)))) {
+            if (isCached) {
+                completeCaches.insert(checksum);
             }
+            continue;
+        }
+        if (isCached) {
+            GetLogger(CacheLog).info("resume cache for {}", path.toStdString());
+        } else {
+            GetLogger(CacheLog).info("add cache for {}", path.toStdString());
         }
+        if (!isCached && InstallBundledPicture(checksum)) {
+            completeCaches.insert(checksum);
+            changed = true;
+            continue;
+        }
+        try {
+            ImportPicture(Heic::Probe(path), checksum);
+        } catch (const Exception& e) {
+            if (e.code != Exception::ParseHEICError) {
+                throw;
+            }
+            // A malformed file must not block other pictures, it is retried once changed
+            GetLogger(CacheLog).error("import of {} failed: {}", path.toStdString(), e.what());
+            brokenPictures.insert(checksum);
+            continue;
+        }
+        completeCaches.insert(checksum);
+        changed = true;
+    }
 
-        // Remove orphan
-        for (const QString& cache : cacheSet) {
-            spdlog::info("orphan {}", cache.toStdString());
-            QDir dir(GetCacheDir() + "/" + cache);
-            if (dir.removeRecursively()) {
-                spdlog::info("remove orphan sucess");
-                changed = true;
+    // Forget checksums of removed pictures
+    QSet<QString> pathSet;
+    for (const QString& picture : pictures) {
+        pathSet.insert(GetPictureDir() + "/" + picture);
+    }
+    {
+        lock_guard<mutex> lock(checksumMutex);
+        for (auto it = checksums.begin(); it != checksums.end();) {
+            if (pathSet.contains(it.key())) {
+                ++it;
             } else {
-                spdlog::info("remove orphan failed");
+                it = checksums.erase(it);
             }
         }
+    }
+
+    // Remove orphans in background, except entries being imported from URLs
+    {
+        lock_guard<mutex> lock(pinnedMutex);
+        for (const QString& key : pinnedKeys) {
+            cacheSet.remove(key);
+            stagingSet.remove(key);
+        }
+    }
+    for (const QString& cache : cacheSet) {
+        completeCaches.remove(cache);
+    }
+    if ((!cacheSet.empty() || !stagingSet.empty()) && !orphanRemovalPending.exchange(true)) {
+        Scheduler::getInstance().Post(Scheduler::Idle, [this, cacheSet, stagingSet](){
+            RemoveOrphans(cacheSet, stagingSet);
+        });
+    }
+
+    if (!migrationScheduled.exchange(true)) {
+        Scheduler::getInstance().Post(Scheduler::Idle, [this](){
+            MigrateEntries();
+        });
+    }
+    if (QSettings().value("store/deltaFrames", false).toBool() && !compactionPending.exchange(true)) {
+        Scheduler::getInstance().Post(Scheduler::Idle, [this](){
+            CompactEntries();
+        });
+    }
 
-        if (changed && pictureSyncCallback != nullptr) {
-            pictureSyncCallback();
+    if (changed) {
+        CallCacheChangeCallback();
+    }
+    Metrics::getInstance().MarkPhase("sync");
+}
+
+void Cache::RemoveOrphans(const QSet<QString>& orphans, const QSet<QString>& stagingOrphans)
+{
+    bool changed = false;
+    for (const QString& staging : stagingOrphans) {
+        if (IsPinned(staging)) {
+            continue;
+        }
+        GetLogger(CacheLog).info("orphan staging {}", staging.toStdString());
+        QDir(GetStagingDir() + "/" + staging).removeRecursively();
+    }
+    for (const QString& cache : orphans) {
+        if (IsPinned(cache)) {
+            continue;
         }
+        GetLogger(CacheLog).info("orphan {}", cache.toStdString());
+        QDir dir(GetCacheDir() + "/" + cache);
+        if (dir.removeRecursively()) {
+            GetLogger(CacheLog).info("remove orphan sucess");
+            changed = true;
+        } else {
+            GetLogger(CacheLog).info("remove orphan failed");
+        }
+    }
+    {
+        unique_lock<shared_mutex> lock(storeMutex);
+        int removed = store.Collect(ListReferencedBlobs());
+        GetLogger(CacheLog).info("remove {} unreferenced blobs", removed);
+    }
+    orphanRemovalPending = false;
+    if (changed) {
+        CallCacheChangeCallback();
+    }
+}
 
-        // Sleep
-        {
-            chrono::seconds timespan(10);
-            unique_lock<mutex> lk(pictureSyncMutex);
-            pictureSyncCond.wait_for(lk, timespan);
+void Cache::MigrateEntries()
+{
+    QElapsedTimer timer;
+    timer.start();
+    QSet<QString> migratedBlobs;    // blobs are shared by entries
+    int migrated = 0;
+    for (const QString& cache : ListCaches()) {
+        if (isTerminated) {
+            return;
+        }
+        if (IsPinned(cache)) {
+            continue;
         }
+        try {
+            if (MigrateEntry(GetCacheDir() + "/" + cache, migratedBlobs)) {
+                migrated++;
+            }
+        } catch (const Exception& e) {
+            GetLogger(CacheLog).error("migrate {} failed: {}", cache.toStdString(), e.what());
+        }
+    }
+    if (migrated > 0) {
+        GetLogger(CacheLog).info("migrated {} entries and {} blobs in {} ms", migrated, migratedBlobs.size(), timer.elapsed());
+        CallCacheChangeCallback();
     }
-    spdlog::info("picture cache sync thread exit");
 }
 
-void Cache::SyncLocationCache()
+bool Cache::MigrateEntry(const QString& path, QSet<QString>& migratedBlobs)
+{
+    EntrySchema schema = LoadSchema(path);
+    if (schema.version > kSchemaVersion) {
+        GetLogger(CacheLog).info("keep {}, written by a newer version", path.toStdString());
+        return false;
+    }
+    const QStringList& stale = schema.GetStaleArtifacts();
+    if (stale.empty() && schema.version == kSchemaVersion) {
+        return false;
+    }
+    GetLogger(CacheLog).info("migrate {}, stale: {}", path.toStdString(), stale.join(", ").toStdString());
+
+    // Frames and config are built from the HEIC, import the picture again
+    if (stale.contains(kFrameArtifact) || stale.contains(kConfigArtifact)) {
+        if (!QDir(path).removeRecursively()) {
+            throw Exception(
+                        Exception::OpenFileError,
+                        "can't remove " + path.toStdString());
+        }
+        NotifyCacheSyncer();
+        return true;
+    }
+
+    // Regenerate renditions from cached full frames, like Heic::SaveFrame
+    const QMap<int, QString>& manifest = LoadManifest(path);
+    if (stale.contains(kThumbArtifact) || stale.contains(kPreviewArtifact)) {
+        for (const QString& hash : manifest) {
+            if (isTerminated) {
+                return false;
+            }
+            if (migratedBlobs.contains(hash)) {
+                continue;
+            }
+            shared_lock<shared_mutex> lock(storeMutex);
+            const QImage& frame = store.LoadFrame(hash);
+            if (frame.isNull()) {
+                throw Exception(
+                            Exception::OpenFileError,
+                            "can't read blob " + hash.toStdString());
+            }
+            const QImage& thumb = CropImage(frame, Heic::kThumbWidth, Heic::kThumbHeight);
+            store.PutRenditions(hash, thumb, CropImage(thumb, Heic::kPreviewWidth, Heic::kPreviewHeight));
+            migratedBlobs.insert(hash);
+        }
+        schema.Update(kThumbArtifact);
+        schema.Update(kPreviewArtifact);
+    }
+
+    // Regenerate cover and icon from thumbnails of the light and dark frame,
+    // they stay stale until both frames are imported
+    WriteBatch batch;
+    if (stale.contains(kThumbArtifact) || stale.contains(kCoverArtifact) || stale.contains(kIconArtifact)) {
+        const CachedPicture& picture = LoadCachedPicture(path, false);
+        const QImage lightThumb(store.GetThumbPath(manifest.value(picture.lightFrame.index)));
+        const QImage darkThumb(store.GetThumbPath(manifest.value(picture.darkFrame.index)));
+        if (!lightThumb.isNull() && !darkThumb.isNull()) {
+            Heic::WriteCover(batch, path, lightThumb, darkThumb);
+            schema.Update(kCoverArtifact);
+            schema.Update(kIconArtifact);
+        }
+    }
+
+    // Cover and schema are synced together, schema last
+    schema.version = kSchemaVersion;
+    batch.Write(path + "/schema.json", SerializeSchema(schema));
+    batch.Commit();
+    return true;
+}
+
+void Cache::CompactEntries()
+{
+    qint64 plainBytes = 0, deltaBytes = 0;
+    for (const QString& cache : ListCaches()) {
+        if (isTerminated) {
+            break;
+        }
+        const QString& path = GetCacheDir() + "/" + cache;
+        if (IsPinned(cache) || !IsImportComplete(path)) {
+            continue;
+        }
+        try {
+            CompactEntry(path, plainBytes, deltaBytes);
+        } catch (const Exception& e) {
+            GetLogger(CacheLog).error("compact {} failed: {}", cache.toStdString(), e.what());
+        }
+    }
+    if (plainBytes > 0) {
+        GetLogger(CacheLog).info("compacted frames from {} MB to {} MB", plainBytes >> 20, deltaBytes >> 20);
+    }
+    compactionPending = false;
+}
+
+void Cache::CompactEntry(const QString& path, qint64& plainBytes, qint64& deltaBytes)
+{
+    // Keep the keyframe of an earlier run, otherwise prefer the light frame
+    const QMap<int, QString>& manifest = LoadManifest(path);
+    const CachedPicture& picture = LoadCachedPicture(path, false);
+    QString key;
+    for (const QString& hash : manifest) {
+        if (store.IsKey(hash) && !store.IsDelta(hash)) {
+            key = hash;
+            break;
+        }
+    }
+    if (key.isEmpty()) {
+        key = manifest.value(picture.lightFrame.index);
+        if (key.isEmpty() || store.IsDelta(key)) {
+            return;
+        }
+    }
+
+    // Keyframes of other entries stay in full
+    QVector<QString> candidates;
+    for (const QString& hash : manifest) {
+        if (hash != key && !compactedBlobs.contains(hash) && !store.IsDelta(hash) && !store.IsKey(hash)) {
+            candidates.push_back(hash);
+        }
+    }
+    if (candidates.isEmpty()) {
+        return;
+    }
+
+    shared_lock<shared_mutex> lock(storeMutex);
+    const QImage& keyImage = store.LoadFrame(key).convertToFormat(QImage::Format_RGB32);
+    if (keyImage.isNull()) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "can't read keyframe " + key.toStdString());
+    }
+    for (const QString& hash : candidates) {
+        if (isTerminated) {
+            return;
+        }
+        if (store.GetPath(hash) == QSettings().value("lastWallpaper").toString()) {
+            // The desktop shows the plain file, compact it once another frame is applied
+            continue;
+        }
+        compactedBlobs.insert(hash);
+        QElapsedTimer timer;
+        timer.start();
+        const qint64 plainSize = QFileInfo(store.GetPath(hash)).size();
+        const QImage& frame = store.LoadFrame(hash).convertToFormat(QImage::Format_RGB32);
+        const optional<DeltaFrame>& delta = EncodeDelta(keyImage, frame, key, plainSize);
+        if (!delta.has_value()) {
+            GetLogger(CacheLog).info("\tframe {} kept in full", hash.toStdString());
+            continue;
+        }
+        const QByteArray& data = delta->Serialize();
+        store.MarkKey(key);
+        store.PutDelta(hash, data);
+        plainBytes += plainSize;
+        deltaBytes += data.size();
+        GetLogger(CacheLog).info("\tframe {} stored as delta{}, {} KB to {} KB in {} ms", hash.toStdString(),
+                     delta->residual.isEmpty() ? " (lighting only)" : "",
+                     plainSize / 1024, data.size() / 1024, timer.elapsed());
+    }
+}
+
+void Cache::MigrateLegacyEntry(const QString& path, const QString& checksum,
+                               QSet<QString>& cacheSet, QSet<QString>& stagingSet)
+{
+    const QString& legacy = LegacyHashFile(path);
+    if (cacheSet.contains(legacy)) {
+        if (!QDir().rename(GetCacheDir() + "/" + legacy, GetCacheDir() + "/" + checksum)) {
+            GetLogger(CacheLog).info("migrate cache {} failed", legacy.toStdString());
+            return;
+        }
+        cacheSet.remove(legacy);
+        cacheSet.insert(checksum);
+        if (completeCaches.remove(legacy)) {
+            completeCaches.insert(checksum);
+        }
+        GetLogger(CacheLog).info("migrate cache {} to {}", legacy.toStdString(), checksum.toStdString());
+    } else if (stagingSet.contains(legacy)) {
+        if (!QDir().rename(GetStagingDir() + "/" + legacy, GetStagingDir() + "/" + checksum)) {
+            GetLogger(CacheLog).info("migrate staging {} failed", legacy.toStdString());
+            return;
+        }
+        stagingSet.remove(legacy);
+        stagingSet.insert(checksum);
+        GetLogger(CacheLog).info("migrate staging {} to {}", legacy.toStdString(), checksum.toStdString());
+    }
+}
+
+bool Cache::IsPinned(const QString& key)
+{
+    lock_guard<mutex> lock(pinnedMutex);
+    return pinnedKeys.contains(key);
+}
+
+void Cache::SetPinned(const QString& key, bool pinned)
+{
+    lock_guard<mutex> lock(pinnedMutex);
+    if (pinned) {
+        pinnedKeys.insert(key);
+    } else {
+        pinnedKeys.remove(key);
+    }
+}
+
+void Cache::ImportUrl(const QString& url)
+{
+    const QString& fileName = QUrl(url).fileName();
+    if (!fileName.endsWith(".heic", Qt::CaseInsensitive)) {
+        throw Exception(
+                    Exception::NetworkError,
+                    "not a HEIC file: " + url.toStdString());
+    }
+    const QString& picturePath = GetPictureDir() + "/" + fileName;
+    if (QFile::exists(picturePath)) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "picture exists: " + picturePath.toStdString());
+    }
+
+    // Entries are keyed by content hash, which is known once the download
+    // completes. Import under a key of the URL, pinned against orphan
+    // removal, and rename the entry at the end.
+    const QByteArray& urlBytes = url.toUtf8();
+    const QString& key = QString("url-%1").arg(Xxh64(urlBytes.constData(), urlBytes.size(), 0), 16, 16, QChar('0'));
+    const QString& downloadPath = GetDownloadDir() + "/" + key;
+    QDir(downloadPath).mkpath(".");
+    const QString& partPath = downloadPath + "/" + fileName + ".part";
+    SetPinned(key, true);
+    try {
+        auto download = make_shared<Download>(url, partPath);
+        GetLogger(CacheLog).info("import {} while downloading", url.toStdString());
+        try {
+            ImportPicture(Heic::Probe(download), key);
+        } catch (const heif::Error& e) {
+            // A broken download makes the file look truncated, report the download error first
+            download->Finish();
+            throw Exception(
+                        Exception::ParseHEICError,
+                        e.get_message());
+        } catch (const Exception&) {
+            // Decoding reports libheif errors as exceptions as well
+            download->Finish();
+            throw;
+        }
+        const QString& checksum = download->Finish();
+        if (isTerminated) {
+            SetPinned(key, false);
+            return;
+        }
+
+        // Publish under the content hash, unless the file is imported already
+        const QString& keyPath = GetCacheDir() + "/" + key;
+        const QString& cachePath = GetCacheDir() + "/" + checksum;
+        if (QDir(cachePath).exists()) {
+            QDir(keyPath).removeRecursively();
+        } else if (!QDir().rename(keyPath, cachePath)) {
+            throw Exception(
+                        Exception::OpenFileError,
+                        "can't publish " + cachePath.toStdString());
+        }
+        if (!QFile::rename(partPath, picturePath)) {
+            throw Exception(
+                        Exception::OpenFileError,
+                        "can't move download to " + picturePath.toStdString());
+        }
+        QDir(downloadPath).removeRecursively();
+        GetLogger(CacheLog).info("imported {} as {}", url.toStdString(), checksum.toStdString());
+    } catch (const Exception& e) {
+        // The next import resumes a partial download, a file that does not
+        // parse or publish is fetched again
+        if (e.code != Exception::NetworkError) {
+            QDir(downloadPath).removeRecursively();
+        }
+        SetPinned(key, false);
+        throw;
+    } catch (...) {
+        QDir(downloadPath).removeRecursively();
+        SetPinned(key, false);
+        throw;
+    }
+    SetPinned(key, false);
+    CallCacheChangeCallback();
+    NotifyCacheSyncer();
+}
+
+void Cache::ImportPicture(const Heic& heic, const QString& checksum)
+{
+    // Entries are built in the staging directory and published by an atomic
+    // rename once config, cover and the first frame are written. Later frames
+    // are appended to the manifest of the published entry. An interrupted
+    // import continues from the frames recorded in the manifest.
+    const QString cachePath = GetCacheDir() + "/" + checksum;
+    const QString stagingPath = GetStagingDir() + "/" + checksum;
+    bool published = QDir(cachePath).exists();
+    QString entryPath = published ? cachePath : stagingPath;
+
+    if (!published && !QFile::exists(stagingPath + "/manifest")) {
+        QDir(stagingPath).removeRecursively();
+        QDir(stagingPath).mkpath(".");
+        heic.SaveConfig(stagingPath);
+    }
+    const QMap<int, QString>& imported = LoadManifest(entryPath);
+    if (!imported.empty()) {
+        GetLogger(CacheLog).info("resume import of {} from {} frames", heic.name, imported.size());
+    }
+
+    // Decode the frame currently due first, then the rest nearest-in-time first
+    const QVector<int>& order = GetImportOrder(LoadCachedPicture(entryPath, false), GetCachedLocation(), heic.GetFrameCount());
+    auto saveFrame = [&](const Heic& source, int index) {
+        if (!imported.contains(index) && !isTerminated) {
+            shared_lock<shared_mutex> lock(storeMutex);
+            source.SaveFrame(entryPath, index, store);
+        }
+    };
+    if (!order.empty() && !isTerminated) {
+        saveFrame(heic, order.front());
+        if (!published) {
+            if (!QDir().rename(stagingPath, cachePath)) {
+                throw Exception(
+                            Exception::OpenFileError,
+                            "can't publish " + cachePath.toStdString());
+            }
+            published = true;
+            entryPath = cachePath;
+            CallCacheChangeCallback();
+            CallDesktopChangeCallback();
+        }
+    }
+    if (heic.useWorkers) {
+        // Decode several frames at once, each in its own worker
+        Scheduler::getInstance().ParallelFor(Scheduler::Normal, order.size() - 1, [&](int i) {
+            saveFrame(heic, order[i + 1]);
+        }, kParallelFrames - 1);
+    } else if (heic.IsTileDecodingSupported()) {
+        // Tiles of each frame are decoded in parallel
+        for (int i = 1; i < order.size() && !isTerminated; i++) {
+            saveFrame(heic, order[i]);
+        }
+    } else {
+        // Decode several frames at once instead, each with its own context
+        Scheduler::getInstance().ParallelFor(Scheduler::Normal, order.size() - 1, [&](int i) {
+            saveFrame(heic.Fork(), order[i + 1]);
+        }, kParallelFrames - 1);
+    }
+    if (isTerminated || !published) {
+        return;
+    }
+
+    // Generate cover from decoded frames if thumbnails are not embedded
+    if (!QFile::exists(cachePath + "/cover.jpg")) {
+        const QMap<int, QString>& manifest = LoadManifest(cachePath);
+        const QImage lightThumb(store.GetThumbPath(manifest.value(heic.lightFrameId)));
+        const QImage darkThumb(store.GetThumbPath(manifest.value(heic.darkFrameId)));
+        if (!lightThumb.isNull() && !darkThumb.isNull()) {
+            WriteBatch batch;
+            Heic::WriteCover(batch, cachePath, lightThumb, darkThumb);
+            batch.Commit();
+        }
+    }
+    Heic::FinishManifest(cachePath);
+
+    const BufferPool::Stats& stats = BufferPool::getInstance().GetStats();
+    GetLogger(CacheLog).info("buffer pool hit rate {:.1f}%, peak {} MB",
+                 stats.GetHitRate() * 100, stats.peakBytes >> 20);
+}
+
+optional<BundleEntry> Cache::ExportEntry(const QString& checksum)
+{
+    // Entries of downloads and earlier versions are not keyed by content hash
+    const QString& path = GetCacheDir() + "/" + checksum;
+    if (!checksum.startsWith("xxh-") || IsPinned(checksum)
+            || !QFile::exists(path + "/manifest") || !IsImportComplete(path)) {
+        return nullopt;
+    }
+    const EntrySchema& schema = LoadSchema(path);
+    if (schema.version != kSchemaVersion || !schema.GetStaleArtifacts().isEmpty()) {
+        return nullopt;
+    }
+
+    BundleEntry entry;
+    entry.checksum = checksum;
+    for (const QString& name : GetEntryFiles()) {
+        QFile file(path + "/" + name);
+        if (file.open(QFile::ReadOnly)) {
+            entry.files.insert(name, file.readAll());
+        }
+    }
+    shared_lock<shared_mutex> lock(storeMutex);
+    QVector<QString> hashes = LoadManifest(path).values().toVector();
+    for (int i = 0; i < hashes.size(); i++) {
+        const QString hash = hashes[i];
+        if (entry.blobs.contains(hash)) {
+            continue;
+        }
+        if (!store.Contains(hash)) {
+            return nullopt;
+        }
+        const QMap<QString, QByteArray>& files = store.Export(hash);
+        entry.blobs.insert(hash, files);
+        // Deltas need their keyframe
+        if (files.contains(hash + ".delta")) {
+            hashes.push_back(DeltaFrame::Parse(files.value(hash + ".delta")).key);
+        }
+    }
+    return entry;
+}
+
+void Cache::InstallEntry(const BundleEntry& entry)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    // Only entries built the way this version builds them are installed
+    const EntrySchema& schema = ParseSchema(entry.files.value("schema.json"));
+    const QByteArray& manifestData = entry.files.value("manifest");
+    if (schema.version != kSchemaVersion || !schema.GetStaleArtifacts().isEmpty()) {
+        throw Exception(
+                    Exception::ParseBundleError,
+                    "stale entry " + entry.checksum.toStdString());
+    }
+    if (!entry.files.contains("config.json") || !manifestData.endsWith("end\n")) {
+        throw Exception(
+                    Exception::ParseBundleError,
+                    "incomplete entry " + entry.checksum.toStdString());
+    }
+    for (const QString& name : entry.files.keys()) {
+        if (!GetEntryFiles().contains(name)) {
+            throw Exception(
+                        Exception::ParseBundleError,
+                        "unexpected file " + name.toStdString() + " in entry " + entry.checksum.toStdString());
+        }
+    }
+
+    // Blobs first, they are kept from collection by the lock until the
+    // manifest references them
+    shared_lock<shared_mutex> lock(storeMutex);
+    int copiedBlobs = 0;
+    for (auto it = entry.blobs.begin(); it != entry.blobs.end(); ++it) {
+        if (!store.Contains(it.key())) {
+            store.Import(it.key(), it.value());
+            copiedBlobs++;
+        }
+    }
+    for (const QString& hash : ParseManifest(manifestData)) {
+        if (!store.Contains(hash)) {
+            throw Exception(
+                        Exception::ParseBundleError,
+                        "missing frame " + hash.toStdString() + " of entry " + entry.checksum.toStdString());
+        }
+    }
+
+    // Build the entry in staging and publish it like an import
+    const QString& stagingPath = GetStagingDir() + "/" + entry.checksum;
+    const QString& cachePath = GetCacheDir() + "/" + entry.checksum;
+    QDir(stagingPath).removeRecursively();
+    QDir(stagingPath).mkpath(".");
+    WriteBatch batch;
+    for (const QString& name : GetEntryFiles()) {
+        if (entry.files.contains(name) && name != "manifest") {
+            batch.Write(stagingPath + "/" + name, entry.files.value(name));
+        }
+    }
+    batch.Commit();
+    SaveData(manifestData, stagingPath + "/manifest");
+    if (!QDir().rename(stagingPath, cachePath)) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "can't publish " + cachePath.toStdString());
+    }
+    lock.unlock();
+
+    Metrics& metrics = Metrics::getInstance();
+    metrics.Add("bundle.entries_installed", 1);
+    metrics.Add("bundle.install_ms_total", timer.elapsed());
+    GetLogger(CacheLog).info("installed {} from bundle, {} of {} blobs copied in {} ms", entry.checksum.toStdString(),
+                 copiedBlobs, entry.blobs.size(), timer.elapsed());
+    CallCacheChangeCallback();
+    CallDesktopChangeCallback();
+}
+
+bool Cache::InstallBundledPicture(const QString& checksum)
 {
-    while (!isTerminated) {
-        CachedLocation location = GetLocationFromIP();
-        spdlog::info("get location from IP, lon = {}, lat = {}", location.longitude, location.latitude);
-        QSettings settings;
-        settings.setValue("longitude", location.longitude);
-        settings.setValue("latitude", location.latitude);
+    const QDir bundleDir(GetBundleDir());
+    for (const QString& name : bundleDir.entryList(QStringList() << "*.bundle", QDir::Files)) {
+        try {
+            BundleReader reader(bundleDir.filePath(name));
+            if (reader.Contains(checksum)) {
+                InstallEntry(reader.Read(checksum));
+                return true;
+            }
+        } catch (const Exception& e) {
+            // Fall back to importing the picture
+            GetLogger(CacheLog).error("install {} from bundle {} failed: {}", checksum.toStdString(),
+                          name.toStdString(), e.what());
+        }
+    }
+    return false;
+}
+
+int Cache::ExportBundle(const QString& path)
+{
+    BundleWriter writer(path);
+    int count = 0;
+    for (const QString& cache : ListCaches()) {
+        const optional<BundleEntry>& entry = ExportEntry(cache);
+        if (!entry.has_value()) {
+            GetLogger(CacheLog).info("\tskip {}, incomplete or stale", cache.toStdString());
+            continue;
+        }
+        writer.Add(*entry);
+        count++;
+        GetLogger(CacheLog).info("\texported {} with {} blobs", cache.toStdString(), entry->blobs.size());
+    }
+    writer.Commit();
+    GetLogger(CacheLog).info("exported {} entries to {}", count, path.toStdString());
+    return count;
+}
 
-        // Sleep
-        {
-            chrono::hours timespan(kLocationCacheLease);
-            unique_lock<mutex> lk(locationSyncMutex);
-            locationSyncCond.wait_for(lk, timespan);
+int Cache::ImportBundle(const QString& path)
+{
+    BundleReader reader(path);
+    int installed = 0;
+    {
+        // Syncs stage and publish the same entries, install in between
+        lock_guard<mutex> lock(pictureSyncJob.runMutex);
+        for (const QString& picture : ListPictures()) {
+            const QString& checksum = GetChecksum(GetPictureDir() + "/" + picture);
+            if (reader.Contains(checksum) && !QDir(GetCacheDir() + "/" + checksum).exists()) {
+                InstallEntry(reader.Read(checksum));
+                installed++;
+            }
         }
     }
-    spdlog::info("location cache sync thread exit");
+    if (pictureSyncJob.pending) {
+        // A sync skipped while installing runs now
+        ScheduleSync(pictureSyncJob, chrono::milliseconds(0));
+    }
+    GetLogger(CacheLog).info("installed {} of {} entries from {}", installed, reader.GetChecksums().size(), path.toStdString());
+    return installed;
+}
+
+void Cache::SyncLocationCache()
+{
+    // A location set by hand is kept if location/auto is off
+    QSettings settings;
+    if (!settings.value("location/auto", true).toBool()) {
+        return;
+    }
+    CachedLocation location = GetLocationFromIP();
+    GetLogger(CacheLog).info("get location from IP, lon = {}, lat = {}", location.longitude, location.latitude);
+    settings.setValue("longitude", location.longitude);
+    settings.setValue("latitude", location.latitude);
 }
 
 QVector<QString> Cache::ListPictures() const
@@ -238,48 +978,235 @@ QString Cache::GetPictureDir() const
     return homePath + "/ddesktop/pictures";
 }
 
-// Get latest pictures from cache.
-QVector<CachedPicture> Cache::GetCachedPictures() const
+QString Cache::GetStoreDir() const
 {
-    QVector<CachedPicture> pictures;
+    return homePath + "/ddesktop/store";
+}
+
+QString Cache::GetStagingDir() const
+{
+    return homePath + "/ddesktop/staging";
+}
+
+QString Cache::GetDownloadDir() const
+{
+    return homePath + "/ddesktop/downloads";
+}
+
+QString Cache::GetBundleDir() const
+{
+    return homePath + "/ddesktop/bundles";
+}
+
+QSet<QString> Cache::ListReferencedBlobs() const
+{
+    QSet<QString> referenced;
     const QVector<QString>& caches = ListCaches();
     for (const QString& cache : caches) {
-        const QString& path = GetCacheDir() + "/" + cache;
-        CachedPicture picture;
+        for (const QString& hash : LoadManifest(GetCacheDir() + "/" + cache)) {
+            referenced.insert(hash);
+        }
+    }
+    const QStringList& stagings = QDir(GetStagingDir()).entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+    for (const QString& staging : stagings) {
+        for (const QString& hash : LoadManifest(GetStagingDir() + "/" + staging)) {
+            referenced.insert(hash);
+        }
+    }
+    return referenced;
+}
 
-        // Load cover
-        picture.cover = QPixmap(path + "/cover.jpg");
+QString Cache::GetChecksum(const QString& path)
+{
+    const QFileInfo fileInfo(path);
+    {
+        lock_guard<mutex> lock(checksumMutex);
+        const auto& it = checksums.constFind(path);
+        if (it != checksums.constEnd() && it->size == fileInfo.size() && it->modified == fileInfo.lastModified()) {
+            return it->checksum;
+        }
+    }
+    const QString& checksum = HashFile(path);
+    lock_guard<mutex> lock(checksumMutex);
+    checksums.insert(path, FileChecksum { fileInfo.size(), fileInfo.lastModified(), checksum });
+    return checksum;
+}
 
-        // Load config
-        QFile configFile(path + "/config.json");
-        if (!configFile.open(QFile::ReadOnly)) {
-            throw Exception(
-                        Exception::OpenFileError,
-                        "can't open file " + (path + "/config.json").toStdString());
-        }
-        const QJsonDocument& configDoc = QJsonDocument::fromJson(configFile.readAll());
-        const QJsonObject& rootObject = configDoc.object();
-        // Load name
-        picture.name = rootObject.value("name").toString();
-        // Load dark and light frame
-        const QJsonObject& apObject = rootObject.value("ap").toObject();
-        int l = apObject.value("l").toInt();
-        int d = apObject.value("d").toInt();
-        // Load frames
-        const QJsonArray& siArray = rootObject.value("si").toArray();
-        for (int i = 0; i < siArray.size(); i++) {
-            const QJsonObject& frameObject = siArray.at(i).toObject();
-            CachedFrame frame;
-            int index = frameObject.value("i").toInt();
-            frame.azimuth = frameObject.value("z").toDouble();
-            frame.altitude = frameObject.value("a").toDouble();
+void Cache::RememberChecksum(const QString& path, const QFileInfo& fileInfo, const QString& checksum)
+{
+    lock_guard<mutex> lock(checksumMutex);
+    checksums.insert(path, FileChecksum { fileInfo.size(), fileInfo.lastModified(), checksum });
+}
+
+void Cache::AddPictures(const QStringList& paths)
+{
+    {
+        lock_guard<mutex> lock(addMutex);
+        for (const QString& path : paths) {
+            if (!addedBytes.contains(path)) {
+                pendingAdds.push_back(path);
+                addedBytes.insert(path, qMakePair(qint64(0), QFileInfo(path).size()));
+            }
+        }
+    }
+    CallAddProgressCallback();
+    StartAdds();
+}
+
+void Cache::StartAdds()
+{
+    lock_guard<mutex> lock(addMutex);
+    while (activeAdds < kParallelAdds && !pendingAdds.empty()) {
+        const QString source = pendingAdds.front();
+        pendingAdds.pop_front();
+        activeAdds++;
+        Scheduler::getInstance().Post(Scheduler::Normal, [this, source](){
+            AddPicture(source);
+        });
+    }
+}
+
+void Cache::AddPicture(const QString& source)
+{
+    const QString& dest = GetPictureDir() + "/" + QFileInfo(source).fileName();
+    const LinkMode linkMode = ParseLinkMode(QSettings().value("import/linkMode", "copy").toString());
+    try {
+        QElapsedTimer timer;
+        timer.start();
+        const TransferResult& result = TransferFile(source, dest, linkMode, [this, &source](int64_t done, int64_t total) {
+            {
+                lock_guard<mutex> lock(addMutex);
+                addedBytes.insert(source, qMakePair(qint64(done), qint64(total)));
+            }
+            CallAddProgressCallback();
+            return !isTerminated;
+        }, [this, &dest](const TransferResult& result, const QString& staged) {
+            // Sync finds the checksum instead of reading the file again, even
+            // if it runs right after the rename
+            RememberChecksum(dest, QFileInfo(staged), result.checksum);
+        });
+        GetLogger(CacheLog).info("added {} by {} in {} ms", dest.toStdString(), result.method.toStdString(),
+                                 timer.elapsed());
+    } catch (const Exception& e) {
+        GetLogger(CacheLog).error("add {} failed: {}", source.toStdString(), e.what());
+        // Drop the placeholder of the settings window
+        CallCacheChangeCallback();
+    }
+    {
+        lock_guard<mutex> lock(addMutex);
+        addedBytes.remove(source);
+        activeAdds--;
+    }
+    CallAddProgressCallback();
+    if (!isTerminated) {
+        NotifyCacheSyncer();
+        StartAdds();
+    }
+}
+
+// Load a rendition, or generate it from a larger image if it was stored
+// before renditions of this size existed.
+QImage LoadRendition(const QString& path, const QString& sourcePath, int width, int height)
+{
+    const QImage rendition(path);
+    if (!rendition.isNull()) {
+        return rendition;
+    }
+    const QImage source(sourcePath);
+    return source.isNull() ? source : CropImage(source, width, height);
+}
+
+CachedPicture Cache::LoadCachedPicture(const QString& path, bool loadImages) const
+{
+    CachedPicture picture;
+
+    // Load gallery icon
+    if (loadImages) {
+        picture.icon = LoadRendition(path + "/cover_icon.jpg", path + "/cover.jpg",
+                                     Heic::kIconWidth, Heic::kIconHeight);
+    }
+
+    // Load config
+    QFile configFile(path + "/config.json");
+    if (!configFile.open(QFile::ReadOnly)) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "can't open file " + (path + "/config.json").toStdString());
+    }
+    const QJsonDocument& configDoc = QJsonDocument::fromJson(configFile.readAll());
+    const QJsonObject& rootObject = configDoc.object();
+    // Load name
+    picture.name = rootObject.value("name").toString();
+    // Load dark and light frame
+    const QJsonObject& apObject = rootObject.value("ap").toObject();
+    int l = apObject.value("l").toInt();
+    int d = apObject.value("d").toInt();
+    // Load frames, entries without manifest keep frames in place
+    const bool hasManifest = QFile::exists(path + "/manifest");
+    const QMap<int, QString>& manifest = LoadManifest(path);
+    const QJsonArray& siArray = rootObject.value("si").toArray();
+    for (int i = 0; i < siArray.size(); i++) {
+        const QJsonObject& frameObject = siArray.at(i).toObject();
+        CachedFrame frame;
+        int index = frameObject.value("i").toInt();
+        frame.index = index;
+        frame.azimuth = frameObject.value("z").toDouble();
+        frame.altitude = frameObject.value("a").toDouble();
+        if (manifest.contains(index)) {
+            const QString& hash = manifest.value(index);
+            frame.hash = hash;
+            frame.path = store.IsDelta(hash) ? store.GetMaterializedPath(hash) : store.GetPath(hash);
+            if (loadImages) {
+                frame.preview = LoadRendition(store.GetPreviewPath(hash), store.GetThumbPath(hash),
+                                              Heic::kPreviewWidth, Heic::kPreviewHeight);
+            }
+        } else if (!hasManifest) {
             frame.path = path + '/' + QString::number(index) + ".jpg";
-            frame.thumb = QPixmap(path + "/thumb_" + QString::number(index) + ".jpg");
-            if (l == index) picture.lightFrame = frame;
-            if (d == index) picture.darkFrame = frame;
-            picture.frames.push_back(frame);
+            if (loadImages) {
+                const QImage thumb(path + "/thumb_" + QString::number(index) + ".jpg");
+                frame.preview = thumb.isNull() ? thumb : CropImage(thumb, Heic::kPreviewWidth, Heic::kPreviewHeight);
+            }
+        } else {
+            frame.ready = false;
         }
-        pictures.push_back(picture);
+        if (l == index) picture.lightFrame = frame;
+        if (d == index) picture.darkFrame = frame;
+        picture.frames.push_back(frame);
+        picture.selector.Add(frame.altitude, frame.azimuth, frame.ready);
+    }
+    return picture;
+}
+
+// Frames of legacy entries are plain files, stored frames are materialized.
+QString Cache::GetFramePath(const CachedFrame& frame) const
+{
+    return frame.hash.isEmpty() ? frame.path : MaterializeFrame(frame.hash);
+}
+
+QString Cache::MaterializeFrame(const QString& hash) const
+{
+    return store.Materialize(hash, QSettings().value("lastWallpaper").toString());
+}
+
+QString Cache::FindCache(const QString& name) const
+{
+    for (const QString& cache : ListCaches()) {
+        const QString& path = GetCacheDir() + "/" + cache;
+        QFile configFile(path + "/config.json");
+        if (configFile.open(QFile::ReadOnly)
+                && QJsonDocument::fromJson(configFile.readAll()).object().value("name").toString() == name) {
+            return path;
+        }
+    }
+    return QString();
+}
+
+QVector<CachedPicture> Cache::GetCachedPictures(bool loadImages) const
+{
+    QVector<CachedPicture> pictures;
+    const QVector<QString>& caches = ListCaches();
+    for (const QString& cache : caches) {
+        pictures.push_back(LoadCachedPicture(GetCacheDir() + "/" + cache, loadImages));
     }
     return pictures;
 }
@@ -291,62 +1218,62 @@ CachedLocation Cache::GetCachedLocation() const
     CachedLocation location;
     location.longitude = settings.value("longitude", 120.94).toDouble();
     location.latitude = settings.value("latitude", 28.14).toDouble();
-    spdlog::info("get cached location, lon = {}, lat = {}", location.longitude, location.latitude);
+    SPDLOG_LOGGER_TRACE(&GetLogger(CacheLog), "get cached location, lon = {}, lat = {}",
+                        location.longitude, location.latitude);
     return location;
 }
 
 // Notify location cache syncer to wake up.
 void Cache::NotifyLocationSyncer()
 {
-    locationSyncCond.notify_all();
+    locationSyncJob.pending = true;
+    ScheduleSync(locationSyncJob, chrono::milliseconds(0));
 }
 
 // Notify picture cache syncer to wake up.
 void Cache::NotifyCacheSyncer()
 {
-    pictureSyncCond.notify_all();
+    pictureSyncJob.pending = true;
+    ScheduleSync(pictureSyncJob, chrono::milliseconds(0));
+}
+
+void Cache::SyncPictures()
+{
+    lock_guard<mutex> lock(pictureSyncJob.runMutex);
+    SyncPictureCache();
 }
 
 // Set current desktop
 void Cache::SetCurrentDesktop(const QString& name)
 {
-    spdlog::info("set current desktop {}", name.toStdString());
+    GetLogger(CacheLog).info("set current desktop {}", name.toStdString());
     // Validate
-    const auto& pictures = GetCachedPictures();
-    if (!any_of(pictures.begin(), pictures.end(), [&](const CachedPicture& picture){ return picture.name == name; })) {
+    if (FindCache(name).isEmpty()) {
         throw Exception(Exception::PictureNotExistsError, "picture not exists");
     }
     // Save
     QSettings settings;
     settings.setValue("wallpaper", name);
     // Notify
-    {
-        lock_guard<mutex> lock(desktopChangeCallbackMtx);
-        if (desktopChangeCallback) {
-            desktopChangeCallback();
-        }
-    }
+    CallDesktopChangeCallback();
 }
 
 // Get current desktop
 std::optional<CachedPicture> Cache::GetCurrentDesktop() const
 {
-    spdlog::info("get current desktop");
+    SPDLOG_LOGGER_TRACE(&GetLogger(CacheLog), "get current desktop");
     // Load
     QSettings settings;
     const auto& name = settings.value("wallpaper", "").toString();
     if (name.isEmpty()) {
         return nullopt;
     }
-    // Fetch
-    const auto& pictures = GetCachedPictures();
-    for (const auto& picture : pictures) {
-        if (picture.name == name) {
-            spdlog::info("{} {}", name.toStdString(), picture.name.toStdString());
-            return picture;
-        }
+    // Fetch frames of the entry only, without thumbnails
+    const QString& path = FindCache(name);
+    if (path.isEmpty()) {
+        throw Exception(Exception::PictureNotExistsError, "picture " + name.toStdString() + " not exists");
     }
-    throw Exception(Exception::PictureNotExistsError, "picture " + name.toStdString() + " not exists");
+    return LoadCachedPicture(path, false);
 }
 
 
@@ -362,3 +1289,42 @@ void Cache::ListenOnDesktopChange(std::function<void(void)> desktopChangeCallbac
     lock_guard<mutex> lock(desktopChangeCallbackMtx);
     this->desktopChangeCallback = desktopChangeCallback;
 }
+
+void Cache::ListenOnAddProgress(std::function<void(const AddProgress&)> addProgressCallback)
+{
+    lock_guard<mutex> lock(callbackMutex);
+    this->addProgressCallback = addProgressCallback;
+}
+
+void Cache::CallCacheChangeCallback()
+{
+    lock_guard<mutex> lock(callbackMutex);
+    if (pictureSyncCallback) {
+        pictureSyncCallback();
+    }
+}
+
+void Cache::CallDesktopChangeCallback()
+{
+    lock_guard<mutex> lock(desktopChangeCallbackMtx);
+    if (desktopChangeCallback) {
+        desktopChangeCallback();
+    }
+}
+
+void Cache::CallAddProgressCallback()
+{
+    AddProgress progress;
+    {
+        lock_guard<mutex> lock(addMutex);
+        progress.files = addedBytes.size();
+        for (const QPair<qint64, qint64>& bytes : addedBytes) {
+            progress.bytesDone += bytes.first;
+            progress.bytesTotal += bytes.second;
+        }
+    }
+    lock_guard<mutex> lock(callbackMutex);
+    if (addProgressCallback) {
+        addProgressCallback(progress);
+    }
+}
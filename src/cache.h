@@ -4,19 +4,31 @@
 #ifndef CACHE_H
 #define CACHE_H
 
+#include "bundle.h"
+#include "scheduler.h"
+#include "solar.h"
+#include "store.h"
+
+#include <QDateTime>
+#include <QFileInfo>
+#include <QHash>
 #include <QString>
+#include <QStringList>
 #include <QImage>
+#include <QMap>
+#include <QSet>
 #include <QVector>
-#include <QPixmap>
-
-#include <SolTrack.h>
 
 #include <atomic>
-#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <deque>
 #include <functional>
-#include <thread>
 #include <mutex>
 #include <optional>
+#include <shared_mutex>
+
+struct Heic;
 
 struct CachedLocation
 {
@@ -24,38 +36,62 @@ struct CachedLocation
     double latitude;
 };
 
+// Images are QImage, the catalog is loaded outside the GUI thread. They
+// are renditions in the exact size shown by the settings window.
 struct CachedFrame
 {
-    QPixmap thumb;
-    QString path;
+    QImage preview;     // Heic::kPreviewWidth x Heic::kPreviewHeight
+    QString hash;       // blob in the frame store, empty for entries without manifest
+    QString path;       // full frame, delta frames exist there once materialized
+    int index = -1;
+    bool ready = true;  // false while the frame is being imported
     double altitude;
     double azimuth;
-    double GetDistance(const CachedLocation& location, const Time& tm) const;
 };
 
 struct CachedPicture
 {
     QString name;
-    QPixmap cover;
+    QImage icon;        // Heic::kIconWidth x Heic::kIconHeight
     CachedFrame lightFrame;
     CachedFrame darkFrame;
     QVector<CachedFrame> frames;
+    FrameSelector selector;     // built from frames
+
+    // Select nearest frames, computing the sun position once.
+    FrameSelection Select(const CachedLocation& location, const Time& tm) const;
 
     CachedFrame GetFrame(const CachedLocation& location) const;
     CachedFrame GetFrame(const CachedLocation& location, const Time& tm) const;
 };
 
+// Progress of pictures being added, see Cache::AddPictures.
+struct AddProgress
+{
+    int files = 0;          // queued or being copied, 0 once all are added
+    int64_t bytesDone = 0;
+    int64_t bytesTotal = 0;
+};
+
 class Cache
 {
     static constexpr int kLocationCacheLease = 1;
     static constexpr int kPictureCacheLease = 5;
+    static constexpr std::chrono::seconds kStartupSyncDelay { 30 };
+    static constexpr int kParallelFrames = 2;   // frames decoded at once in workers or without tile decoding
+    static constexpr int kParallelAdds = 2;     // pictures copied at once
 
     QString homePath;
 
+    FrameStore store;
+
     std::function<void(void)> pictureSyncCallback;
 
     std::atomic<bool> isTerminated = false;
 
+    // Sync jobs are scheduled unless turned off before the first getInstance
+    static inline std::atomic<bool> syncsEnabled = true;
+
     std::function<void(void)> desktopChangeCallback;
     std::mutex desktopChangeCallbackMtx;
 
@@ -65,19 +101,111 @@ class Cache
     std::mutex pictureMutex;
 
     std::mutex callbackMutex;
-    std::mutex pictureSyncMutex;
-    std::mutex locationSyncMutex;
-    std::condition_variable pictureSyncCond;
-    std::condition_variable locationSyncCond;
-    std::thread pictureSyncThread;
-    std::thread locationSyncThread;
+
+    // Blobs are written under a shared lock and collected under an exclusive lock.
+    std::shared_mutex storeMutex;
+    std::atomic<bool> orphanRemovalPending = false;
+
+    // Entries are migrated once after the first sync, later ones are current.
+    std::atomic<bool> migrationScheduled = false;
+
+    // Frames are compacted to deltas if store/deltaFrames is set.
+    std::atomic<bool> compactionPending = false;
+    QSet<QString> compactedBlobs;   // blobs tried, only accessed by compaction
+
+    // Entries known to be completely imported, only accessed by picture sync.
+    QSet<QString> completeCaches;
+
+    // Pictures that failed to decode, skipped until their content changes.
+    // Only accessed by picture sync.
+    QSet<QString> brokenPictures;
+
+    // Content hashes of pictures by path, valid while size and modification
+    // time are unchanged. Filled by adds and sync, pruned by sync.
+    struct FileChecksum
+    {
+        qint64 size;
+        QDateTime modified;
+        QString checksum;
+    };
+    std::mutex checksumMutex;
+    QHash<QString, FileChecksum> checksums;
+
+    // Pictures being added, copied by at most kParallelAdds workers.
+    std::mutex addMutex;
+    std::deque<QString> pendingAdds;
+    int activeAdds = 0;
+    QMap<QString, QPair<qint64, qint64>> addedBytes;    // done and total by source, while queued or copying
+    std::function<void(const AddProgress&)> addProgressCallback;
+
+    // Entries being imported from URLs, they have no picture yet.
+    std::mutex pinnedMutex;
+    QSet<QString> pinnedKeys;
+
+    // Periodic sync job running on the scheduler, woken up early by Notify*.
+    struct SyncJob
+    {
+        void (Cache::*sync)();
+        std::chrono::milliseconds period;
+        std::mutex tokenMutex;
+        std::mutex runMutex;        // held while running
+        std::atomic<bool> pending = false;
+        CancellationToken token;
+    };
+    SyncJob pictureSyncJob { &Cache::SyncPictureCache, std::chrono::seconds(10) };
+    SyncJob locationSyncJob { &Cache::SyncLocationCache, std::chrono::hours(kLocationCacheLease) };
 
     QString GetCacheDir() const;
+    QString GetStoreDir() const;
+    QString GetStagingDir() const;
+    QString GetDownloadDir() const;
+    QString GetBundleDir() const;
 
+    // Load an entry, previews and icon are skipped unless loadImages is set.
+    CachedPicture LoadCachedPicture(const QString& path, bool loadImages = true) const;
+    // Find the entry of a picture by name, return empty string if absent.
+    QString FindCache(const QString& name) const;
     QVector<QString> ListPictures() const;
     QVector<QString> ListCaches() const;
+    QSet<QString> ListReferencedBlobs() const;
+    // Content hash of a picture, read from the memo unless the file changed.
+    QString GetChecksum(const QString& path);
+    // Remember the hash of a file at path, by the size and time of file.
+    void RememberChecksum(const QString& path, const QFileInfo& file, const QString& checksum);
+    // Start queued adds up to kParallelAdds.
+    void StartAdds();
+    void AddPicture(const QString& source);
+    void ImportPicture(const Heic& heic, const QString& checksum);
+    bool IsPinned(const QString& key);
+    void SetPinned(const QString& key, bool pinned);
+    // Rename the entry of a picture keyed by MD5 to its content hash.
+    void MigrateLegacyEntry(const QString& path, const QString& checksum,
+                            QSet<QString>& cacheSet, QSet<QString>& stagingSet);
+    void RemoveOrphans(const QSet<QString>& orphans, const QSet<QString>& stagingOrphans);
+    // Regenerate artifacts whose build parameters changed, see schema.h.
+    void MigrateEntries();
+    // Migrate an entry, blobs in migratedBlobs are already regenerated.
+    // Return whether the entry changed.
+    bool MigrateEntry(const QString& path, QSet<QString>& migratedBlobs);
+    // Store frames of complete entries as deltas of a keyframe, see delta.h.
+    void CompactEntries();
+    void CompactEntry(const QString& path, qint64& plainBytes, qint64& deltaBytes);
+    // Read a complete entry with the blobs of its frames, none if it is
+    // incomplete or has stale artifacts.
+    std::optional<BundleEntry> ExportEntry(const QString& checksum);
+    // Install an entry of a bundle, blobs first and the manifest last.
+    void InstallEntry(const BundleEntry& entry);
+    // Install a picture from bundles in the bundle directory, return whether found.
+    bool InstallBundledPicture(const QString& checksum);
     void SyncPictureCache();
     void SyncLocationCache();
+    void ScheduleSync(SyncJob& job, std::chrono::milliseconds delay);
+    void RunSync(SyncJob& job);
+
+    void CallCacheChangeCallback();
+    void CallDesktopChangeCallback();
+
+    void CallAddProgressCallback();
 
     Cache();
     ~Cache();
@@ -86,6 +214,13 @@ class Cache
 
 public:
 
+    // Build the cache without background syncs, for command line modes that
+    // exit once done. Called before the first getInstance.
+    static void DisableSyncs()
+    {
+        syncsEnabled = false;
+    }
+
     static Cache& getInstance()
     {
         // TODO: Is it thread-safe?
@@ -100,8 +235,20 @@ public:
 
         QString GetPictureDir() const;
 
-    // Get latest pictures from cache.
-    QVector<CachedPicture> GetCachedPictures() const;
+    // Get latest pictures from cache, previews and icons are skipped unless loadImages is set.
+    QVector<CachedPicture> GetCachedPictures(bool loadImages = true) const;
+
+    const FrameStore& GetStore() const
+    {
+        return store;
+    }
+
+    // Return the path of a JPEG file of a frame, reconstructing delta frames.
+    QString GetFramePath(const CachedFrame& frame) const;
+
+    // Return the path of a JPEG file of a stored frame. The applied wallpaper
+    // stays materialized while other delta frames are reconstructed.
+    QString MaterializeFrame(const QString& hash) const;
 
     // Get latest location from cache.
     CachedLocation GetCachedLocation() const;
@@ -109,19 +256,46 @@ public:
     // Set current desktop
     void SetCurrentDesktop(const QString& name);
 
-    // Get current desktop
+    // Get current desktop, without previews and icon.
     std::optional<CachedPicture> GetCurrentDesktop() const;
 
+    // Add HEIC files to the picture directory in the background, see
+    // transfer.h, and sync once each is added. Files are queued and copied
+    // at most kParallelAdds at once.
+    void AddPictures(const QStringList& paths);
+
+    // Download a HEIC file and import it while downloading. Frames are
+    // decoded as soon as their bytes arrive. Blocks until done.
+    void ImportUrl(const QString& url);
+
+    // Package complete entries into a bundle, see bundle.h. Return the
+    // number of entries.
+    int ExportBundle(const QString& path);
+
+    // Install entries of a bundle whose source is in the picture directory
+    // and not cached yet. Return the number of installed entries.
+    int ImportBundle(const QString& path);
+
     // Notify location cache syncer to wake up.
     void NotifyLocationSyncer();
 
     // Notify picture cache syncer to wake up.
     void NotifyCacheSyncer();
 
+    // Sync pictures on the calling thread, after the running sync if any.
+    void SyncPictures();
+
+    // Stop imports and syncs and wait for background jobs. Called before
+    // static destruction, jobs use singletons destroyed before the cache.
+    void Terminate();
+
     void ListenOnCacheChange(std::function<void(void)> cacheChangeCallback);
 
     void ListenOnDesktopChange(std::function<void(void)> pictureChangeCallback);
 
+    // Listen on progress of adds, called by background jobs.
+    void ListenOnAddProgress(std::function<void(const AddProgress&)> addProgressCallback);
+
 };
 
 #endif // CACHE_H
@@ -0,0 +1,52 @@
+// Clock - source of the current time. The daemon reads time through a clock
+// so its schedule can be fast-forwarded by a simulated clock.
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <chrono>
+#include <mutex>
+
+class Clock
+{
+public:
+    virtual ~Clock() = default;
+    virtual std::chrono::system_clock::time_point Now() const = 0;
+};
+
+class SystemClock : public Clock
+{
+public:
+    std::chrono::system_clock::time_point Now() const override
+    {
+        return std::chrono::system_clock::now();
+    }
+
+    static SystemClock& getInstance()
+    {
+        static SystemClock instance;
+        return instance;
+    }
+};
+
+class SimulatedClock : public Clock
+{
+    mutable std::mutex mtx;
+    std::chrono::system_clock::time_point now;
+
+public:
+    explicit SimulatedClock(std::chrono::system_clock::time_point now): now(now) {}
+
+    std::chrono::system_clock::time_point Now() const override
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return now;
+    }
+
+    void Advance(std::chrono::system_clock::duration duration)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        now += duration;
+    }
+};
+
+#endif // CLOCK_H
@@ -2,21 +2,61 @@
 #include "exception.h"
 #include "desktop.h"
 #include "cache.h"
+#include "log.h"
+#include "metrics.h"
+#include "scheduler.h"
 
 #include <QApplication>
+#include <QFile>
 #include <QMenu>
+#include <QPointer>
+#include <QSettings>
 #include <QtDebug>
-#include <QTimer>
 
-#include <spdlog/spdlog.h>
+#include <algorithm>
 
 using namespace std;
 
-Daemon::Daemon()
+// Milliseconds until the frame shown changes, at most maxDelay.
+int GetNextChange(const CachedPicture& picture, const CachedLocation& location,
+                  chrono::system_clock::time_point now, int maxDelay)
+{
+    const auto& schedule = SimulateSchedule(picture.selector, location.latitude, location.longitude,
+                                            now, now + chrono::milliseconds(maxDelay), kKeeperStep);
+    if (schedule.size() > 1) {
+        const auto delay = chrono::duration_cast<chrono::milliseconds>(schedule[1].time - now);
+        return max(static_cast<int>(delay.count()), 1000);
+    }
+    return maxDelay;
+}
+
+int Daemon::SelectWallpaper(const Cache& cache, chrono::system_clock::time_point now, QString& path)
+{
+    const optional<CachedPicture>& picture = cache.GetCurrentDesktop();
+    if (!picture.has_value()) {
+        return kKeeperInterval;
+    }
+    const CachedLocation& location = cache.GetCachedLocation();
+    const CachedFrame& frame = picture.value().GetFrame(location, ToTime(now));
+    if (frame.ready) {
+        path = cache.GetFramePath(frame);
+    } else {
+        // Repeated every keeper interval until the import catches up
+        static LogThrottle throttle(chrono::minutes(1));
+        int dropped = 0;
+        if (throttle.Allow(dropped)) {
+            GetLogger(DesktopLog).info("no frame of {} is imported yet ({} repeats suppressed)",
+                                       picture.value().name.toStdString(), dropped);
+        }
+    }
+    return GetNextChange(picture.value(), location, now, kKeeperInterval);
+}
+
+Daemon::Daemon(const Clock& clock): clock(clock)
 {    
     // Create actions
     QAction* settingAction = new QAction("Setting", this);
-    connect(settingAction, &QAction::triggered, [this](){ mainWindow.show(); });
+    connect(settingAction, &QAction::triggered, this, &Daemon::ShowSettings);
     QAction* exitAction = new QAction("Exit", this);
     connect(exitAction, &QAction::triggered, [](){ QApplication::quit(); });
 
@@ -25,36 +65,99 @@ Daemon::Daemon()
     menu->addAction(settingAction);
     menu->addAction(exitAction);
 
+    // The daemon lives in the tray, closing the settings window must not quit
+    QApplication::setQuitOnLastWindowClosed(false);
+
     // Create system tray
     QPixmap pixmap("../assets/icon.png");
     trayIcon = new QSystemTrayIcon(QIcon(pixmap));
     trayIcon->setContextMenu(menu);
     trayIcon->setVisible(true);
+    Metrics::getInstance().MarkPhase("tray");
 
-    // Keeper timer
-    DesktopKeeper();
-    QTimer *keeperTimer = new QTimer(this);
+    // Apply the wallpaper of last run before the catalog is loaded
+    QSettings settings;
+    const QString& lastPath = settings.value("lastWallpaper").toString();
+    if (!lastPath.isEmpty() && QFile::exists(lastPath)) {
+        ApplyWallpaper(lastPath);
+    }
+
+    // Keeper timer, restarted by the keeper to fire at the next frame change
+    keeperTimer = new QTimer(this);
+    keeperTimer->setSingleShot(true);
     connect(keeperTimer, &QTimer::timeout, this, &Daemon::DesktopKeeper);
-    keeperTimer->start(1000*60*10);
+    DesktopKeeper();
+
+    // Control server for local agents, opt-in
+    if (settings.value("server/enabled", false).toBool()) {
+        server.Start(settings.value("server/port", kDefaultServerPort).toInt());
+    }
 
     // Register callback
     Cache& cache = Cache::getInstance();
-    cache.ListenOnDesktopChange([this](){ DesktopKeeper(); });
+    // Callbacks are called by background jobs, run the keeper on the GUI thread
+    cache.ListenOnDesktopChange([this](){
+        QMetaObject::invokeMethod(this, [this](){ DesktopKeeper(); }, Qt::QueuedConnection);
+    });
+}
+
+Daemon::~Daemon()
+{
+    delete mainWindow;
+    // Imports running at quit stop before singletons are destroyed
+    Cache::getInstance().Terminate();
+}
+
+void Daemon::ShowSettings()
+{
+    if (!mainWindow) {
+        mainWindow = new MainWindow();
+        mainWindow->setAttribute(Qt::WA_DeleteOnClose);
+    }
+    mainWindow->show();
+    mainWindow->raise();
+    mainWindow->activateWindow();
+}
+
+void Daemon::ApplyWallpaper(const QString& path)
+{
+    if (path == appliedPath) {
+        return;
+    }
+    GetLogger(DesktopLog).info("set wallpaper {}", path.toStdString());
+    appliedPath = path;
+    QSettings settings;
+    settings.setValue("lastWallpaper", path);
+    Scheduler::getInstance().Post(Scheduler::Interactive, [path](){
+        SetDesktop(path);
+        Metrics::getInstance().MarkPhase("wallpaper");
+    });
 }
 
 void Daemon::DesktopKeeper()
 {
-    Cache& cache = Cache::getInstance();
-    try {
-        const optional<CachedPicture>& picture = cache.GetCurrentDesktop();
-        if (picture.has_value()) {
-            const CachedFrame& frame = picture.value().GetFrame(cache.GetCachedLocation());
-            spdlog::info("set wallpaper {}", frame.path.toStdString());
-            setDesktopTask = async(launch::async, [=](){
-                SetDesktop(frame.path);
-            });
+    // Finding the entry scans the cache and a delta frame may be rebuilt, keep it off the GUI thread
+    QPointer<Daemon> self(this);
+    const auto now = clock.Now();
+    Scheduler::getInstance().Post(Scheduler::Interactive, [self, now](){
+        int delay = kKeeperInterval;
+        QString path, error;
+        try {
+            delay = SelectWallpaper(Cache::getInstance(), now, path);
+        } catch (const Exception& e) {
+            error = QString::fromStdString(e.what());
         }
-    } catch (const Exception& e) {
-        trayIcon->showMessage("Exception", QString::fromStdString(e.what()), QSystemTrayIcon::Critical);
-    }
+        QMetaObject::invokeMethod(qApp, [self, delay, path, error](){
+            if (!self) {
+                return;
+            }
+            if (!error.isEmpty()) {
+                self->trayIcon->showMessage("Exception", error, QSystemTrayIcon::Critical);
+            }
+            if (!path.isEmpty()) {
+                self->ApplyWallpaper(path);
+            }
+            self->keeperTimer->start(delay);
+        }, Qt::QueuedConnection);
+    });
 }
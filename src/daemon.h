@@ -1,20 +1,50 @@
 #ifndef DAEMON_H
 #define DAEMON_H
 
+#include "cache.h"
+#include "clock.h"
 #include "mainwindow.h"
+#include "server.h"
 
 #include <QObject>
+#include <QPointer>
+#include <QString>
 #include <QSystemTrayIcon>
+#include <QTimer>
 
-#include <future>
+#include <chrono>
+
+// Sampling step of frame changes, the keeper wakes up at most this late.
+constexpr std::chrono::seconds kKeeperStep { 60 };
+
+// Milliseconds until the frame shown changes, at most maxDelay.
+int GetNextChange(const CachedPicture& picture, const CachedLocation& location,
+                  std::chrono::system_clock::time_point now, int maxDelay);
 
 class Daemon : public QObject
 {
-    MainWindow mainWindow;
+    static constexpr int kDefaultServerPort = 8760;
+
+    QPointer<MainWindow> mainWindow;    // only exists while the settings window is open
     QSystemTrayIcon *trayIcon;
-    std::future<void> setDesktopTask;
+    QTimer *keeperTimer;
+    const Clock& clock;
+    QString appliedPath;    // the wallpaper set last
+    ControlServer server;
+
+    void ApplyWallpaper(const QString& path);
+    void ShowSettings();
 public:
-    Daemon();
+    static constexpr int kKeeperInterval = 1000*60*10;  // the longest interval between keepers (ms)
+
+    // Select the frame of the current picture at now. Set path to the frame
+    // to apply, left empty if none is ready, and return milliseconds until
+    // the next change. Throws if the cache can't be read.
+    static int SelectWallpaper(const Cache& cache, std::chrono::system_clock::time_point now, QString& path);
+
+    Daemon(const Clock& clock = SystemClock::getInstance());
+    ~Daemon();
+    // Select the frame in the background, apply it and restart the keeper timer.
     void DesktopKeeper();
 };
 
@@ -0,0 +1,584 @@
+// Decoder - decode HEIC frames in worker processes.
+#include "bufferpool.h"
+#include "decoder.h"
+#include "exception.h"
+#include "heic.h"
+#include "log.h"
+#include "metrics.h"
+#include "scheduler.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QSettings>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+constexpr int kWorkerFd = 3;                // the socket of a worker to the daemon
+constexpr size_t kMaxPathSize = 4096;
+constexpr size_t kMaxMessageSize = 1024;    // error messages of workers
+constexpr size_t kPlaneAlignment = 64;
+constexpr size_t kMaxPlanes = 4;            // YCbCr planes and an RGB image
+
+enum RequestKind : uint32_t {
+    FrameRequest,
+    ThumbnailRequest,
+};
+
+struct RequestHeader
+{
+    uint32_t kind;
+    uint32_t index;
+    // followed by the path in UTF-8
+};
+
+struct PlaneHeader
+{
+    int32_t format;     // QImage::Format
+    int32_t width;
+    int32_t height;
+    int32_t stride;
+    uint64_t offset;    // in the memfd
+};
+
+struct ResponseHeader
+{
+    int32_t failed;
+    uint32_t planeCount;    // 0 for a null image, 1 for an image, 3 for YCbCr planes, 4 for both
+    PlaneHeader planes[kMaxPlanes];
+    // followed by the error message if failed, planes are passed as a memfd otherwise
+};
+
+size_t Align(size_t size)
+{
+    return (size + kPlaneAlignment - 1) / kPlaneAlignment * kPlaneAlignment;
+}
+
+// Send a message in one packet, passing fd along unless it is negative.
+bool SendMessage(int socket, const QByteArray& message, int fd)
+{
+    iovec iov { const_cast<char*>(message.constData()), static_cast<size_t>(message.size()) };
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    if (fd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    ssize_t result;
+    do {
+        result = sendmsg(socket, &msg, MSG_NOSIGNAL);
+    } while (result < 0 && errno == EINTR);
+    return result == message.size();
+}
+
+// Receive a packet into message, resized to its length. A passed descriptor
+// is stored in fd, -1 otherwise. Return false once the peer is gone.
+bool ReceiveMessage(int socket, QByteArray& message, int& fd)
+{
+    fd = -1;
+    iovec iov { message.data(), static_cast<size_t>(message.size()) };
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t result;
+    do {
+        result = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+    } while (result < 0 && errno == EINTR);
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); result >= 0 && cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (result <= 0) {
+        return false;
+    }
+    message.resize(result);
+    return true;
+}
+
+// Describe how a stopped worker exited.
+string GetExitStatus(int status)
+{
+    if (WIFSIGNALED(status)) {
+        return "killed by signal " + to_string(WTERMSIG(status)) + " (" + strsignal(WTERMSIG(status)) + ")";
+    }
+    return "exited with status " + to_string(WEXITSTATUS(status));
+}
+
+// A read-only mapping of a memfd, unmapped with the last plane referring to it.
+struct Mapping
+{
+    const uchar* data;
+    size_t size;
+
+    Mapping(const uchar* data, size_t size): data(data), size(size) {}
+    ~Mapping() { munmap(const_cast<uchar*>(data), size); }
+    Mapping(const Mapping& mapping) = delete;
+};
+
+// Map planes of a response without copying them.
+vector<QImage> MapPlanes(const ResponseHeader& header, int fd)
+{
+    struct stat info;
+    if (fstat(fd, &info) < 0 || info.st_size <= 0) {
+        throw Exception(
+                    Exception::ParseHEICError,
+                    "invalid frame buffer of decode worker");
+    }
+    const size_t size = info.st_size;
+    void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        throw Exception(
+                    Exception::ParseHEICError,
+                    string("can't map frame buffer: ") + strerror(errno));
+    }
+    const auto mapping = make_shared<Mapping>(static_cast<const uchar*>(data), size);
+    vector<QImage> planes;
+    for (uint32_t i = 0; i < header.planeCount; i++) {
+        const PlaneHeader& plane = header.planes[i];
+        const QImage::Format format = static_cast<QImage::Format>(plane.format);
+        if (format <= QImage::Format_Invalid || format >= QImage::NImageFormats
+                || plane.width <= 0 || plane.height <= 0
+                || plane.stride < plane.width * QImage::toPixelFormat(format).bitsPerPixel() / 8
+                || plane.offset + static_cast<uint64_t>(plane.stride) * plane.height > size) {
+            throw Exception(
+                        Exception::ParseHEICError,
+                        "invalid plane of decode worker");
+        }
+        planes.emplace_back(mapping->data + plane.offset, plane.width, plane.height, plane.stride, format,
+                            [](void* info) { delete static_cast<shared_ptr<Mapping>*>(info); },
+                            new shared_ptr<Mapping>(mapping));
+    }
+    return planes;
+}
+
+// Shared memory of one response. Images are allocated in regions of a
+// memfd, so frames decoded into them are passed to the daemon as they are.
+class FrameArena
+{
+    struct Region
+    {
+        uchar* data;
+        size_t size;
+        uint64_t offset;    // in the memfd
+    };
+
+    int fd;
+    uint64_t size = 0;
+    vector<Region> regions;
+    mutex mtx;
+
+public:
+    FrameArena(): fd(memfd_create("sundesktop-frame", MFD_CLOEXEC))
+    {
+        if (fd < 0) {
+            throw Exception(
+                        Exception::OpenFileError,
+                        string("can't create frame buffer: ") + strerror(errno));
+        }
+    }
+
+    ~FrameArena()
+    {
+        for (const Region& region : regions) {
+            munmap(region.data, region.size);
+        }
+        close(fd);
+    }
+
+    FrameArena(const FrameArena& arena) = delete;
+
+    int GetFd() const { return fd; }
+
+    // Allocate an uninitialized image with aligned rows, valid while the arena lives.
+    QImage Allocate(int width, int height, QImage::Format format)
+    {
+        const size_t stride = Align(static_cast<size_t>(width) * QImage::toPixelFormat(format).bitsPerPixel() / 8);
+        const size_t pageSize = sysconf(_SC_PAGESIZE);
+        const size_t length = (stride * height + pageSize - 1) / pageSize * pageSize;
+        lock_guard<mutex> lock(mtx);
+        void* data = MAP_FAILED;
+        if (ftruncate(fd, size + length) < 0
+                || (data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, size)) == MAP_FAILED) {
+            throw Exception(
+                        Exception::OpenFileError,
+                        string("can't grow frame buffer: ") + strerror(errno));
+        }
+        regions.push_back(Region { static_cast<uchar*>(data), length, size });
+        size += length;
+        return QImage(static_cast<uchar*>(data), width, height, stride, format);
+    }
+
+    // Find the offset of the pixels of an image, false if allocated elsewhere.
+    bool Locate(const QImage& image, uint64_t& offset)
+    {
+        const uchar* bits = image.constBits();
+        lock_guard<mutex> lock(mtx);
+        for (const Region& region : regions) {
+            if (bits >= region.data && bits < region.data + region.size) {
+                offset = region.offset + (bits - region.data);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Describe planes in header by their place in the arena. Planes decoded
+// elsewhere, such as images owned by libheif, are copied into it first.
+void WritePlanes(const vector<QImage>& planes, ResponseHeader& header, FrameArena& arena)
+{
+    header.planeCount = planes.size();
+    for (size_t i = 0; i < planes.size(); i++) {
+        QImage plane = planes[i];
+        uint64_t offset = 0;
+        if (!arena.Locate(plane, offset)) {
+            QImage copy = arena.Allocate(plane.width(), plane.height(), plane.format());
+            const size_t rowSize = static_cast<size_t>(plane.width()) * plane.depth() / 8;
+            for (int y = 0; y < plane.height(); y++) {
+                memcpy(copy.scanLine(y), plane.constScanLine(y), rowSize);
+            }
+            plane = copy;
+            arena.Locate(plane, offset);
+        }
+        header.planes[i] = { plane.format(), plane.width(), plane.height(),
+                             static_cast<int32_t>(plane.bytesPerLine()), offset };
+    }
+}
+
+bool DecodePool::IsEnabled()
+{
+    return QSettings().value("import/decodeWorkers", true).toBool();
+}
+
+DecodePool::~DecodePool()
+{
+    // Workers exit once their socket is closed
+    for (const shared_ptr<Worker>& worker : workers) {
+        close(worker->fd);
+        waitpid(worker->pid, nullptr, 0);
+    }
+}
+
+shared_ptr<DecodePool::Worker> DecodePool::Spawn()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    string("can't create socket of decode worker: ") + strerror(errno));
+    }
+
+    // Prepare everything before fork, the child may only make async-signal-safe calls
+    const int memoryLimit = QSettings().value("import/decodeMemoryLimit", kDefaultMemoryLimit).toInt();
+    rlimit limit;
+    limit.rlim_cur = limit.rlim_max = memoryLimit > 0 ? static_cast<rlim_t>(memoryLimit) << 20 : RLIM_INFINITY;
+    const QByteArray& program = QCoreApplication::applicationName().toUtf8();
+    char* argv[] = { const_cast<char*>(program.constData()), const_cast<char*>(kDecodeWorkerOption), nullptr };
+
+    const pid_t pid = fork();
+    if (pid == 0) {
+        setrlimit(RLIMIT_AS, &limit);
+        if (fds[1] == kWorkerFd) {
+            fcntl(kWorkerFd, F_SETFD, 0);
+        } else {
+            dup2(fds[1], kWorkerFd);
+        }
+        execv("/proc/self/exe", argv);
+        _exit(127);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        throw Exception(
+                    Exception::OpenFileError,
+                    string("can't start decode worker: ") + strerror(errno));
+    }
+
+    auto worker = make_shared<Worker>();
+    worker->pid = pid;
+    worker->fd = fds[0];
+    Metrics::getInstance().Add("decode.worker_spawns", 1);
+    GetLogger(DecodeLog).info("decode worker {} started", pid);
+    return worker;
+}
+
+shared_ptr<DecodePool::Worker> DecodePool::Acquire()
+{
+    unique_lock<mutex> lock(mtx);
+    while (true) {
+        for (const shared_ptr<Worker>& worker : workers) {
+            if (!worker->busy) {
+                worker->busy = true;
+                return worker;
+            }
+        }
+        if (workers.size() < kMaxWorkers) {
+            shared_ptr<Worker> worker = Spawn();
+            worker->busy = true;
+            workers.push_back(worker);
+            Metrics::getInstance().Set("decode.workers", workers.size());
+            return worker;
+        }
+        cond.wait(lock);
+    }
+}
+
+string DecodePool::Release(const shared_ptr<Worker>& worker, bool failed)
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        if (!failed) {
+            worker->busy = false;
+            worker->lastUsed = chrono::steady_clock::now();
+            if (!reapScheduled) {
+                reapScheduled = true;
+                Scheduler::getInstance().PostDelayed(Scheduler::Idle, kIdleTimeout, [this](){ ReapIdle(); });
+            }
+            cond.notify_one();
+            return string();
+        }
+        workers.erase(find(workers.begin(), workers.end(), worker));
+        Metrics::getInstance().Set("decode.workers", workers.size());
+        cond.notify_one();
+    }
+
+    // Kill the worker in case it hangs, it is replaced by the next request
+    kill(worker->pid, SIGKILL);
+    close(worker->fd);
+    int status = 0;
+    waitpid(worker->pid, &status, 0);
+    return GetExitStatus(status);
+}
+
+void DecodePool::ReapIdle()
+{
+    vector<shared_ptr<Worker>> idleWorkers;
+    {
+        lock_guard<mutex> lock(mtx);
+        const auto& now = chrono::steady_clock::now();
+        for (auto it = workers.begin(); it != workers.end();) {
+            if (!(*it)->busy && now - (*it)->lastUsed >= kIdleTimeout) {
+                idleWorkers.push_back(*it);
+                it = workers.erase(it);
+            } else {
+                it++;
+            }
+        }
+        Metrics::getInstance().Set("decode.workers", workers.size());
+        reapScheduled = !workers.empty();
+        if (reapScheduled) {
+            Scheduler::getInstance().PostDelayed(Scheduler::Idle, kIdleTimeout, [this](){ ReapIdle(); });
+        }
+    }
+    for (const shared_ptr<Worker>& worker : idleWorkers) {
+        close(worker->fd);
+        waitpid(worker->pid, nullptr, 0);
+        Metrics::getInstance().Add("decode.worker_exits", 1);
+        GetLogger(DecodeLog).info("decode worker {} stopped after idle", worker->pid);
+    }
+}
+
+vector<QImage> DecodePool::Decode(uint32_t kind, const QString& path, size_t index)
+{
+    QElapsedTimer timer;
+    timer.start();
+    const RequestHeader request { kind, static_cast<uint32_t>(index) };
+    QByteArray message(reinterpret_cast<const char*>(&request), sizeof(request));
+    message.append(path.toUtf8());
+
+    for (int attempt = 0;; attempt++) {
+        const shared_ptr<Worker>& worker = Acquire();
+        if (!SendMessage(worker->fd, message, -1)) {
+            // The worker is gone before taking the request, retry with a new one
+            const string& status = Release(worker, true);
+            if (attempt == 0) {
+                continue;
+            }
+            throw Exception(
+                        Exception::ParseHEICError,
+                        "can't reach decode worker, " + status);
+        }
+
+        // A crashed worker closes the socket, a hanging worker is killed after a timeout
+        QByteArray response(sizeof(ResponseHeader) + kMaxMessageSize, 0);
+        int fd = -1;
+        pollfd ready { worker->fd, POLLIN, 0 };
+        const int timeout = chrono::duration_cast<chrono::milliseconds>(kDecodeTimeout).count();
+        int polled;
+        do {
+            polled = poll(&ready, 1, timeout);
+        } while (polled < 0 && errno == EINTR);
+        if (polled <= 0 || !ReceiveMessage(worker->fd, response, fd)
+                || response.size() < static_cast<int>(sizeof(ResponseHeader))) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            const string& status = Release(worker, true);
+            Metrics::getInstance().Add("decode.worker_crashes", 1);
+            throw Exception(
+                        Exception::ParseHEICError,
+                        "decode worker " + status + " on frame " + to_string(index) + " of " + path.toStdString());
+        }
+        Release(worker, false);
+
+        ResponseHeader header;
+        memcpy(&header, response.constData(), sizeof(header));
+        if (header.failed) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            throw Exception(
+                        Exception::ParseHEICError,
+                        response.mid(sizeof(header)).toStdString());
+        }
+        vector<QImage> planes;
+        if (header.planeCount > 0) {
+            if (fd < 0 || header.planeCount > kMaxPlanes) {
+                throw Exception(
+                            Exception::ParseHEICError,
+                            "invalid response of decode worker");
+            }
+            try {
+                planes = MapPlanes(header, fd);
+            } catch (...) {
+                close(fd);
+                throw;
+            }
+            close(fd);
+        }
+        Metrics& metrics = Metrics::getInstance();
+        metrics.Add("decode.requests", 1);
+        metrics.Add("decode.ms_total", timer.elapsed());
+        return planes;
+    }
+}
+
+DecodedFrame DecodePool::DecodeFrame(const QString& path, size_t index)
+{
+    const vector<QImage>& planes = Decode(FrameRequest, path, index);
+    // YCbCr planes come first, then the RGB image if any
+    DecodedFrame frame;
+    if (planes.size() == 3 || planes.size() == 4) {
+        frame.yuv = YuvImage{ planes[0], planes[1], planes[2] };
+    }
+    if (planes.size() == 1 || planes.size() == 4) {
+        frame.image = planes.back();
+    }
+    if (frame.yuv.IsNull() && frame.image.isNull()) {
+        throw Exception(
+                    Exception::ParseHEICError,
+                    "decode worker returned no frame");
+    }
+    return frame;
+}
+
+QImage DecodePool::DecodeThumbnail(const QString& path, size_t index)
+{
+    const vector<QImage>& planes = Decode(ThumbnailRequest, path, index);
+    return planes.empty() ? QImage() : planes.front();
+}
+
+int RunDecodeWorker(int argc, char *argv[])
+{
+    // Settings and paths resolve like in the daemon, without a display
+    QCoreApplication app(argc, argv);
+
+    // Requests of a file come in a row, keep it open
+    Heic heic;
+    QString openPath;
+    QByteArray request;
+    while (true) {
+        request.resize(sizeof(RequestHeader) + kMaxPathSize);
+        int unused = -1;
+        if (!ReceiveMessage(kWorkerFd, request, unused)) {
+            // Closed by the daemon, the worker is idle or the daemon exited
+            return 0;
+        }
+        if (unused >= 0) {
+            close(unused);
+        }
+
+        ResponseHeader header {};
+        QByteArray error;
+        unique_ptr<FrameArena> arena;
+        BufferPool& pool = BufferPool::getInstance();
+        try {
+            if (request.size() < static_cast<int>(sizeof(RequestHeader))) {
+                throw Exception(
+                            Exception::ParseHEICError,
+                            "invalid decode request");
+            }
+            RequestHeader requestHeader;
+            memcpy(&requestHeader, request.constData(), sizeof(requestHeader));
+            const QString& path = QString::fromUtf8(request.mid(sizeof(requestHeader)));
+            if (path != openPath) {
+                openPath.clear();
+                heic = Heic::Open(path);
+                openPath = path;
+            }
+            // Frames are decoded straight into the memory passed to the daemon
+            arena = make_unique<FrameArena>();
+            pool.SetAllocator([&arena](int width, int height, QImage::Format format) {
+                return arena->Allocate(width, height, format);
+            });
+            if (requestHeader.kind == FrameRequest) {
+                const DecodedFrame& frame = heic.DecodeStoredFrame(requestHeader.index);
+                vector<QImage> planes;
+                if (!frame.yuv.IsNull()) {
+                    planes = { frame.yuv.y, frame.yuv.cb, frame.yuv.cr };
+                }
+                if (!frame.image.isNull()) {
+                    planes.push_back(frame.image);
+                }
+                WritePlanes(planes, header, *arena);
+            } else {
+                const QImage& thumb = heic.DecodeFrameThumbnail(requestHeader.index);
+                WritePlanes(thumb.isNull() ? vector<QImage>() : vector<QImage>{ thumb }, header, *arena);
+            }
+        } catch (const Exception& e) {
+            error = QByteArray::fromStdString(e.what());
+        } catch (const heif::Error& e) {
+            error = QByteArray::fromStdString(e.get_message());
+        } catch (const exception& e) {
+            // Allocations beyond the memory limit end up here
+            error = e.what();
+        }
+        pool.SetAllocator(nullptr);
+
+        header.failed = !error.isEmpty();
+        QByteArray response(reinterpret_cast<const char*>(&header), sizeof(header));
+        response.append(error.left(kMaxMessageSize));
+        const bool passFd = !header.failed && header.planeCount > 0;
+        const bool sent = SendMessage(kWorkerFd, response, passFd ? arena->GetFd() : -1);
+        if (!sent) {
+            return 1;
+        }
+    }
+}
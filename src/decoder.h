@@ -0,0 +1,95 @@
+// Decoder - decode HEIC frames in worker processes. libheif and its HEVC
+// decoder run in children started from the same executable with
+// --decode-worker, so that:
+// 1. A malformed file crashes or hangs a worker, not the daemon. The frame
+//    fails with an exception and the worker is replaced.
+// 2. Workers run under an address space limit (import/decodeMemoryLimit in
+//    MB), and exit once idle, returning decoder memory to the OS.
+// 3. Frames are decoded into memfd buffers, the daemon maps them read-only
+//    instead of copying pixels.
+#ifndef DECODER_H
+#define DECODER_H
+
+#include "jpeg.h"
+
+#include <QImage>
+#include <QString>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+constexpr char kDecodeWorkerOption[] = "--decode-worker";
+
+// A frame decoded for the frame store: 8-bit YCbCr planes, which key the
+// frame, and an RGB image if it can't be stored as JPEG without color
+// conversion. Frames of more than 8 bits only have the RGB image.
+struct DecodedFrame
+{
+    YuvImage yuv;
+    QImage image;
+};
+
+class DecodePool
+{
+    static constexpr size_t kMaxWorkers = 2;
+    static constexpr std::chrono::seconds kIdleTimeout { 30 };
+    static constexpr std::chrono::seconds kDecodeTimeout { 120 };   // a worker is killed after it
+    static constexpr int kDefaultMemoryLimit = 2048;                // MB of address space per worker
+
+    struct Worker
+    {
+        pid_t pid = -1;
+        int fd = -1;            // socket to the worker
+        bool busy = false;
+        std::chrono::steady_clock::time_point lastUsed;
+    };
+
+    std::mutex mtx;
+    std::condition_variable cond;
+    std::vector<std::shared_ptr<Worker>> workers;
+    bool reapScheduled = false;
+
+    std::shared_ptr<Worker> Spawn();
+    std::shared_ptr<Worker> Acquire();
+    // Return a worker to the pool. A failed worker is stopped, return how it exited.
+    std::string Release(const std::shared_ptr<Worker>& worker, bool failed);
+    // Stop workers idle for kIdleTimeout.
+    void ReapIdle();
+    // Send a request to a worker, return decoded planes mapped from its memfd.
+    std::vector<QImage> Decode(uint32_t kind, const QString& path, size_t index);
+
+    DecodePool() = default;
+    ~DecodePool();
+    DecodePool(const DecodePool& pool) = delete;
+    DecodePool(DecodePool&& pool) = delete;
+
+public:
+
+    static DecodePool& getInstance()
+    {
+        static DecodePool instance;
+        return instance;
+    }
+
+    // Whether frames of mapped files are decoded in workers, set by import/decodeWorkers.
+    static bool IsEnabled();
+
+    // Decode a frame for the frame store, like Heic::DecodeStoredFrame.
+    DecodedFrame DecodeFrame(const QString& path, size_t index);
+
+    // Decode the embedded thumbnail of a frame, null if absent.
+    QImage DecodeThumbnail(const QString& path, size_t index);
+};
+
+// Serve decode requests of the daemon until it closes the connection. The
+// entry point of processes started with --decode-worker.
+int RunDecodeWorker(int argc, char *argv[]);
+
+#endif // DECODER_H
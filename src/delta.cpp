@@ -0,0 +1,336 @@
+// Delta Frames - store a frame as a lighting transform of a keyframe.
+#include "bufferpool.h"
+#include "delta.h"
+#include "exception.h"
+#include "scheduler.h"
+#include "store.h"
+
+#include <QDataStream>
+#include <QElapsedTimer>
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+constexpr quint32 kDeltaMagic = 0x53444446;     // "SDDF"
+constexpr quint32 kDeltaVersion = 1;
+constexpr int kChannels = 4;                    // bytes of a RGB32 pixel, the last one is alpha
+constexpr int kResidualQuality = 90;
+constexpr double kMinVariance = 4;              // tiles flatter than this only get an offset
+constexpr float kMaxGain = 8;
+constexpr int kBandRows = 64;                   // rows reconstructed by one task
+
+QByteArray DeltaFrame::Serialize() const
+{
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream.setFloatingPointPrecision(QDataStream::SinglePrecision);
+    stream << kDeltaMagic << kDeltaVersion << key << width << height << gains << offsets << residual;
+    return data;
+}
+
+DeltaFrame DeltaFrame::Parse(const QByteArray& data)
+{
+    DeltaFrame delta;
+    QDataStream stream(data);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream.setFloatingPointPrecision(QDataStream::SinglePrecision);
+    quint32 magic = 0, version = 0;
+    stream >> magic >> version;
+    if (magic != kDeltaMagic || version != kDeltaVersion) {
+        throw Exception(
+                    Exception::ParseDeltaError,
+                    "unsupported delta frame");
+    }
+    stream >> delta.key >> delta.width >> delta.height >> delta.gains >> delta.offsets >> delta.residual;
+    const int params = kDeltaGrid * kDeltaGrid * kChannels;
+    if (stream.status() != QDataStream::Ok || delta.width <= 0 || delta.height <= 0
+            || delta.gains.size() != params || delta.offsets.size() != params) {
+        throw Exception(
+                    Exception::ParseDeltaError,
+                    "corrupt delta frame");
+    }
+    return delta;
+}
+
+// Gains and offsets of a row, interpolated vertically between tile centers.
+// Each tile column holds gain, gain step, offset and offset step to the next
+// column, four channels each, so a pixel interpolates horizontally by one
+// multiply-add per term.
+void InterpolateRow(const DeltaFrame& delta, int y, vector<float>& params)
+{
+    const double fy = clamp((y + 0.5) * kDeltaGrid / delta.height - 0.5, 0.0, kDeltaGrid - 1.0);
+    const int row = min(static_cast<int>(fy), kDeltaGrid - 2);
+    const float weight = static_cast<float>(fy - row);
+    auto at = [&](const QVector<float>& values, int column, int channel) {
+        const float top = values[(row * kDeltaGrid + column) * kChannels + channel];
+        const float bottom = values[((row + 1) * kDeltaGrid + column) * kChannels + channel];
+        return top + (bottom - top) * weight;
+    };
+    for (int column = 0; column < kDeltaGrid - 1; column++) {
+        float* out = &params[column * kChannels * 4];
+        for (int channel = 0; channel < kChannels; channel++) {
+            const float gain = at(delta.gains, column, channel);
+            const float offset = at(delta.offsets, column, channel);
+            out[channel] = gain;
+            out[kChannels + channel] = at(delta.gains, column + 1, channel) - gain;
+            out[kChannels * 2 + channel] = offset;
+            out[kChannels * 3 + channel] = at(delta.offsets, column + 1, channel) - offset;
+        }
+    }
+}
+
+// Compute key * gain + offset + residual - 128 for a row of RGB32 pixels.
+void ApplyRow(const uint32_t* key, const uint32_t* residual, uint32_t* out, int width,
+              const vector<int>& columns, const vector<float>& weights, const vector<float>& params)
+{
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 bias = _mm_set1_ps(-128);
+    auto unpack = [&](uint32_t pixel) {
+        const __m128i bytes = _mm_cvtsi32_si128(static_cast<int>(pixel));
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero));
+    };
+    for (int x = 0; x < width; x++) {
+        const float* p = &params[columns[x] * kChannels * 4];
+        const __m128 weight = _mm_set1_ps(weights[x]);
+        const __m128 gain = _mm_add_ps(_mm_loadu_ps(p), _mm_mul_ps(weight, _mm_loadu_ps(p + 4)));
+        const __m128 offset = _mm_add_ps(_mm_loadu_ps(p + 8), _mm_mul_ps(weight, _mm_loadu_ps(p + 12)));
+        __m128 value = _mm_add_ps(_mm_mul_ps(unpack(key[x]), gain), offset);
+        value = _mm_add_ps(value, _mm_add_ps(unpack(residual[x]), bias));
+        __m128i pixel = _mm_cvtps_epi32(value);
+        pixel = _mm_packs_epi32(pixel, pixel);
+        pixel = _mm_packus_epi16(pixel, pixel);
+        out[x] = static_cast<uint32_t>(_mm_cvtsi128_si32(pixel)) | 0xff000000u;
+    }
+#else
+    for (int x = 0; x < width; x++) {
+        const float* p = &params[columns[x] * kChannels * 4];
+        const float weight = weights[x];
+        uint32_t pixel = 0xff000000u;
+        for (int channel = 0; channel < kChannels - 1; channel++) {
+            const int shift = channel * 8;
+            const float gain = p[channel] + weight * p[kChannels + channel];
+            const float offset = p[kChannels * 2 + channel] + weight * p[kChannels * 3 + channel];
+            // Same order of operations as the SIMD path
+            const float value = (((key[x] >> shift) & 0xff) * gain + offset)
+                    + (static_cast<float>((residual[x] >> shift) & 0xff) - 128);
+            pixel |= static_cast<uint32_t>(clamp(nearbyintf(value), 0.0f, 255.0f)) << shift;
+        }
+        out[x] = pixel;
+    }
+#endif
+}
+
+// Predict a frame from its keyframe and add a decoded residual if not null.
+QImage Reconstruct(const QImage& key, const DeltaFrame& delta, const QImage& residual)
+{
+    const int width = delta.width;
+    const int height = delta.height;
+
+    // Horizontal interpolation is the same for every row
+    vector<int> columns(width);
+    vector<float> weights(width);
+    for (int x = 0; x < width; x++) {
+        const double fx = clamp((x + 0.5) * kDeltaGrid / width - 0.5, 0.0, kDeltaGrid - 1.0);
+        columns[x] = min(static_cast<int>(fx), kDeltaGrid - 2);
+        weights[x] = static_cast<float>(fx - columns[x]);
+    }
+    // Without residual every pixel adds 128 - 128
+    const vector<uint32_t> neutral(residual.isNull() ? width : 0, 0x80808080u);
+
+    QImage output = BufferPool::getInstance().AllocateImage(width, height, QImage::Format_RGB32);
+    const int bands = (height + kBandRows - 1) / kBandRows;
+    Scheduler::getInstance().ParallelFor(Scheduler::Normal, bands, [&](int band) {
+        vector<float> params((kDeltaGrid - 1) * kChannels * 4);
+        for (int y = band * kBandRows; y < min(height, (band + 1) * kBandRows); y++) {
+            InterpolateRow(delta, y, params);
+            const uint32_t* residualRow = residual.isNull() ? neutral.data()
+                    : reinterpret_cast<const uint32_t*>(residual.constScanLine(y));
+            ApplyRow(reinterpret_cast<const uint32_t*>(key.constScanLine(y)), residualRow,
+                     reinterpret_cast<uint32_t*>(output.scanLine(y)), width, columns, weights, params);
+        }
+    });
+    return output;
+}
+
+// Fit gain and offset of each tile and color channel by least squares.
+DeltaFrame FitLighting(const QImage& key, const QImage& frame)
+{
+    struct Moments
+    {
+        double k = 0, f = 0, kk = 0, kf = 0;
+        int64_t count = 0;
+    };
+    const int width = frame.width();
+    const int height = frame.height();
+    vector<Moments> moments(kDeltaGrid * kDeltaGrid * kChannels);
+    vector<int> tileColumns(width);
+    for (int x = 0; x < width; x++) {
+        tileColumns[x] = x * kDeltaGrid / width;
+    }
+    for (int y = 0; y < height; y++) {
+        const int tileRow = y * kDeltaGrid / height;
+        const uchar* keyRow = key.constScanLine(y);
+        const uchar* frameRow = frame.constScanLine(y);
+        for (int x = 0; x < width; x++) {
+            Moments* tile = &moments[(tileRow * kDeltaGrid + tileColumns[x]) * kChannels];
+            for (int channel = 0; channel < kChannels - 1; channel++) {
+                const double k = keyRow[x * kChannels + channel];
+                const double f = frameRow[x * kChannels + channel];
+                tile[channel].k += k;
+                tile[channel].f += f;
+                tile[channel].kk += k * k;
+                tile[channel].kf += k * f;
+                tile[channel].count++;
+            }
+        }
+    }
+
+    DeltaFrame delta;
+    delta.width = width;
+    delta.height = height;
+    delta.gains.resize(moments.size());
+    delta.offsets.resize(moments.size());
+    for (int i = 0; i < static_cast<int>(moments.size()); i++) {
+        const Moments& m = moments[i];
+        if (i % kChannels == kChannels - 1 || m.count == 0) {
+            // Alpha is always opaque
+            delta.gains[i] = 0;
+            delta.offsets[i] = i % kChannels == kChannels - 1 ? 255 : 0;
+            continue;
+        }
+        const double meanKey = m.k / m.count;
+        const double meanFrame = m.f / m.count;
+        const double variance = m.kk / m.count - meanKey * meanKey;
+        const double covariance = m.kf / m.count - meanKey * meanFrame;
+        const double gain = variance < kMinVariance ? 1 : clamp(covariance / variance, 0.0, static_cast<double>(kMaxGain));
+        delta.gains[i] = static_cast<float>(gain);
+        delta.offsets[i] = static_cast<float>(meanFrame - gain * meanKey);
+    }
+    return delta;
+}
+
+double GetFramePsnr(const QImage& reference, const QImage& image)
+{
+    double sum = 0;
+    for (int y = 0; y < reference.height(); y++) {
+        const uchar* a = reference.constScanLine(y);
+        const uchar* b = image.constScanLine(y);
+        int64_t rowSum = 0;
+        for (int x = 0; x < reference.width(); x++) {
+            for (int channel = 0; channel < kChannels - 1; channel++) {
+                const int diff = a[x * kChannels + channel] - b[x * kChannels + channel];
+                rowSum += diff * diff;
+            }
+        }
+        sum += rowSum;
+    }
+    const double mse = sum / (static_cast<double>(reference.width()) * reference.height() * (kChannels - 1));
+    return mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : numeric_limits<double>::infinity();
+}
+
+optional<DeltaFrame> EncodeDelta(const QImage& key, const QImage& frame, const QString& keyHash, qint64 plainSize)
+{
+    if (key.size() != frame.size() || key.format() != QImage::Format_RGB32
+            || frame.format() != QImage::Format_RGB32) {
+        return nullopt;
+    }
+    DeltaFrame delta = FitLighting(key, frame);
+    delta.key = keyHash;
+    const QImage& prediction = Reconstruct(key, delta, QImage());
+    if (GetFramePsnr(frame, prediction) >= kDeltaMinPsnr) {
+        return delta;
+    }
+
+    // Keep the difference to the prediction, clipped to [-128, 127]
+    QImage residual = BufferPool::getInstance().AllocateImage(frame.width(), frame.height(), QImage::Format_RGB32);
+    for (int y = 0; y < frame.height(); y++) {
+        const uchar* frameRow = frame.constScanLine(y);
+        const uchar* predictionRow = prediction.constScanLine(y);
+        uchar* out = residual.scanLine(y);
+        for (int i = 0; i < frame.width() * kChannels; i++) {
+            out[i] = static_cast<uchar>(clamp(frameRow[i] - predictionRow[i] + 128, 0, 255));
+        }
+    }
+    delta.residual = EncodeImage(residual, kResidualQuality);
+    if (delta.residual.size() >= plainSize) {
+        return nullopt;
+    }
+    if (GetFramePsnr(frame, DecodeDelta(key, delta)) < kDeltaMinPsnr) {
+        return nullopt;
+    }
+    return delta;
+}
+
+QImage DecodeDelta(const QImage& key, const DeltaFrame& delta)
+{
+    if (key.width() != delta.width || key.height() != delta.height || key.format() != QImage::Format_RGB32) {
+        throw Exception(
+                    Exception::ParseDeltaError,
+                    "keyframe doesn't match delta frame");
+    }
+    QImage residual;
+    if (!delta.residual.isEmpty()) {
+        residual = QImage::fromData(delta.residual, "JPG").convertToFormat(QImage::Format_RGB32);
+        if (residual.size() != key.size()) {
+            throw Exception(
+                        Exception::ParseDeltaError,
+                        "corrupt residual of delta frame");
+        }
+    }
+    return Reconstruct(key, delta, residual);
+}
+
+void BenchmarkDelta(int count, const function<QImage(int)>& loadFrame)
+{
+    if (count <= 0) {
+        return;
+    }
+    QElapsedTimer timer;
+    // Frames are compared as stored, decoded from JPEG
+    const QByteArray& keyData = EncodeImage(loadFrame(0));
+    timer.start();
+    const QImage& key = QImage::fromData(keyData, "JPG").convertToFormat(QImage::Format_RGB32);
+    const qint64 keyElapsed = timer.nsecsElapsed();
+    qint64 plainBytes = keyData.size(), deltaBytes = keyData.size();
+    spdlog::info("keyframe: {} KB, decode {:.1f} ms", keyData.size() / 1024, keyElapsed / 1e6);
+    for (int i = 1; i < count; i++) {
+        const QByteArray& plain = EncodeImage(loadFrame(i));
+        timer.restart();
+        const QImage& reference = QImage::fromData(plain, "JPG").convertToFormat(QImage::Format_RGB32);
+        const qint64 plainElapsed = timer.nsecsElapsed();
+        plainBytes += plain.size();
+
+        const optional<DeltaFrame>& delta = EncodeDelta(key, reference, QString(), plain.size());
+        if (!delta.has_value()) {
+            deltaBytes += plain.size();
+            spdlog::info("frame {}: plain {} KB, decode {:.1f} ms; kept plain", i,
+                         plain.size() / 1024, plainElapsed / 1e6);
+            continue;
+        }
+        const QByteArray& data = delta->Serialize();
+        timer.restart();
+        const QImage& decoded = DecodeDelta(key, DeltaFrame::Parse(data));
+        const qint64 deltaElapsed = timer.nsecsElapsed();
+        deltaBytes += data.size();
+        spdlog::info("frame {}: plain {} KB, decode {:.1f} ms; delta {} KB{}, reconstruct {:.1f} ms, {:.2f} dB",
+                     i, plain.size() / 1024, plainElapsed / 1e6, data.size() / 1024,
+                     delta->residual.isEmpty() ? " (lighting only)" : "", deltaElapsed / 1e6,
+                     GetFramePsnr(reference, decoded));
+    }
+    spdlog::info("total: plain {} KB, delta {} KB ({:.1f}%)", plainBytes / 1024, deltaBytes / 1024,
+                 100.0 * deltaBytes / plainBytes);
+}
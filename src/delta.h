@@ -0,0 +1,47 @@
+// Delta Frames - store a frame as a lighting transform of a keyframe.
+// Frames of a dynamic wallpaper show one scene under different lighting, so
+// a frame is predicted from its keyframe by a gain and an offset per color
+// channel, fitted on a grid of tiles and interpolated between tile centers.
+// Where lighting alone does not fit, e.g. windows lit at night, the
+// difference to the prediction is kept as a JPEG residual.
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QString>
+#include <QVector>
+
+#include <functional>
+#include <optional>
+
+constexpr int kDeltaGrid = 16;          // tiles per axis
+constexpr double kDeltaMinPsnr = 38;    // the minimum quality against the stored frame, dB
+
+struct DeltaFrame
+{
+    QString key;            // hash of the keyframe, which is stored in full
+    int width = 0;
+    int height = 0;
+    QVector<float> gains;   // per tile and channel, kDeltaGrid x kDeltaGrid x 4 in RGB32 byte order
+    QVector<float> offsets;
+    QByteArray residual;    // JPEG of frame - prediction + 128, empty if lighting fits
+
+    QByteArray Serialize() const;
+
+    static DeltaFrame Parse(const QByteArray& data);
+};
+
+// Fit a frame to its keyframe, both Format_RGB32 of the same size. Return
+// nothing unless the delta reaches kDeltaMinPsnr and is smaller than plainSize.
+std::optional<DeltaFrame> EncodeDelta(const QImage& key, const QImage& frame,
+                                      const QString& keyHash, qint64 plainSize);
+
+// Reconstruct a frame from its Format_RGB32 keyframe into a pooled image.
+QImage DecodeDelta(const QImage& key, const DeltaFrame& delta);
+
+// Encode frames as deltas of the first one, log disk size and
+// reconstruction latency against plain JPEG. Frames are loaded one by one.
+void BenchmarkDelta(int count, const std::function<QImage(int)>& loadFrame);
+
+#endif // DELTA_H
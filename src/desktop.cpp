@@ -1,9 +1,8 @@
 #include "desktop.h"
+#include "log.h"
 
 #include <QProcess>
 
-#include <spdlog/spdlog.h>
-
 void SetDesktop(const QString& path)
 {
 
@@ -16,7 +15,7 @@ void SetDesktop(const QString& path)
 #error("unsupported platform")
 #endif
 
-    spdlog::info("execute {}", command.toStdString());
+    GetLogger(DesktopLog).debug("execute {}", command.toStdString());
     QProcess process;
     process.execute(command);
 }
@@ -0,0 +1,154 @@
+// Download - stream a file from an HTTP(S) URL to disk.
+#include "download.h"
+#include "exception.h"
+#include "log.h"
+
+#include <QFile>
+#include <QUrl>
+
+#include <httplib.h>
+
+#include <chrono>
+
+using namespace std;
+
+Download::Download(const QString& url, const QString& path): url(url), path(path)
+{
+    worker = thread(&Download::Run, this);
+}
+
+Download::~Download()
+{
+    Cancel();
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+void Download::Run()
+{
+    // Hash the partial file of an earlier run
+    QFile partFile(path);
+    if (partFile.open(QFile::ReadOnly)) {
+        while (!partFile.atEnd() && !isCancelled) {
+            const QByteArray& data = partFile.read(1 << 20);
+            hasher.Update(data.constData(), data.size());
+        }
+        lock_guard<mutex> lock(mtx);
+        size = partFile.size();
+        if (size > 0) {
+            GetLogger(CacheLog).info("resume download of {} from {} bytes", url.toStdString(), size);
+        }
+    }
+
+    bool done = false;
+    for (int attempt = 0; attempt < kRetries && !done && !isCancelled; attempt++) {
+        if (attempt > 0) {
+            GetLogger(CacheLog).info("retry download of {} in {} s", url.toStdString(), attempt);
+            this_thread::sleep_for(chrono::seconds(attempt));
+        }
+        done = Fetch();
+    }
+
+    lock_guard<mutex> lock(mtx);
+    if (!done && error.empty()) {
+        error = isCancelled ? "cancelled" : "connection lost";
+    }
+    finished = true;
+    cond.notify_all();
+}
+
+bool Download::Fetch()
+{
+    const QUrl qurl(url);
+    const string origin = (qurl.scheme() + "://" + qurl.host()
+                           + (qurl.port() > 0 ? ":" + QString::number(qurl.port()) : "")).toStdString();
+    string target = qurl.path(QUrl::FullyEncoded).toStdString();
+    if (qurl.hasQuery()) {
+        target += "?" + qurl.query(QUrl::FullyEncoded).toStdString();
+    }
+    QFile file(path);
+    if (!file.open(QIODevice::Append | QIODevice::Unbuffered)) {
+        lock_guard<mutex> lock(mtx);
+        error = "can't open file " + path.toStdString();
+        return true;
+    }
+
+    // Continue after the bytes on disk
+    int64_t offset;
+    {
+        lock_guard<mutex> lock(mtx);
+        offset = size;
+    }
+    httplib::Headers headers;
+    if (offset > 0) {
+        headers.emplace("Range", "bytes=" + to_string(offset) + "-");
+    }
+    httplib::Client client(origin);
+    client.set_follow_location(true);
+    client.set_read_timeout(10, 0);
+    int status = 0;
+    const auto& result = client.Get(target, headers, [&](const httplib::Response& res) {
+        status = res.status;
+        if (res.status == 206) {
+            return res.get_header_value("Content-Range").rfind("bytes " + to_string(offset) + "-", 0) == 0;
+        }
+        if (res.status == 200 && offset > 0) {
+            // Range requests are not supported, start over
+            file.resize(0);
+            lock_guard<mutex> lock(mtx);
+            size = 0;
+            hasher.Reset();
+        }
+        return res.status == 200;
+    }, [&](const char* data, size_t length) {
+        if (isCancelled || file.write(data, length) != static_cast<qint64>(length)) {
+            return false;
+        }
+        lock_guard<mutex> lock(mtx);
+        hasher.Update(data, length);
+        size += length;
+        cond.notify_all();
+        return true;
+    });
+
+    if (result && (status == 200 || status == 206)) {
+        return true;
+    }
+    if (status == 416 && offset > 0) {
+        // The partial file is complete
+        return true;
+    }
+    if (status >= 400) {
+        lock_guard<mutex> lock(mtx);
+        error = "HTTP status " + to_string(status);
+        return true;
+    }
+    return false;
+}
+
+int64_t Download::WaitForSize(int64_t target)
+{
+    unique_lock<mutex> lock(mtx);
+    cond.wait(lock, [&]() { return size >= target || finished; });
+    return size;
+}
+
+QString Download::Finish()
+{
+    if (worker.joinable()) {
+        worker.join();
+    }
+    if (!error.empty()) {
+        throw Exception(
+                    Exception::NetworkError,
+                    "download " + url.toStdString() + " failed: " + error);
+    }
+    GetLogger(CacheLog).info("downloaded {} bytes from {}", size, url.toStdString());
+    return hasher.Finish();
+}
+
+void Download::Cancel()
+{
+    isCancelled = true;
+}
@@ -0,0 +1,66 @@
+// Download - stream a file from an HTTP(S) URL to disk. Readers may consume
+// the file while it grows, the content hash is computed as bytes arrive.
+// Interrupted transfers continue from the partial file by range requests.
+#ifndef DOWNLOAD_H
+#define DOWNLOAD_H
+
+#include "hash.h"
+
+#include <QString>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// A file being written by another thread.
+class GrowingFile
+{
+public:
+    virtual ~GrowingFile() = default;
+
+    virtual QString GetPath() const = 0;
+
+    // Block until the file has at least size bytes or is complete. Return
+    // the number of bytes available.
+    virtual int64_t WaitForSize(int64_t size) = 0;
+};
+
+class Download : public GrowingFile
+{
+    static constexpr int kRetries = 5;
+
+    const QString url;
+    const QString path;
+
+    std::mutex mtx;
+    std::condition_variable cond;
+    int64_t size = 0;
+    bool finished = false;
+    std::string error;      // empty if succeeded
+    ContentHasher hasher;
+    std::atomic<bool> isCancelled = false;
+    std::thread worker;
+
+    void Run();
+    // Request the rest of the file. Return false if the transfer broke off.
+    bool Fetch();
+
+public:
+    // Download url to path, a partial file at path is resumed.
+    Download(const QString& url, const QString& path);
+    ~Download() override;
+
+    QString GetPath() const override { return path; }
+
+    int64_t WaitForSize(int64_t size) override;
+
+    // Wait for the transfer and return the content hash.
+    QString Finish();
+
+    void Cancel();
+};
+
+#endif // DOWNLOAD_H
@@ -7,9 +7,10 @@ class Exception
 {
 public:
     Exception();
-    Exception(int errorCode, const std::string& message): message(message) {}
+    Exception(int errorCode, const std::string& message): code(errorCode), message(message) {}
     std::string what() const { return message; }
 
+    int code = 0;
     std::string message;
 
     enum {
@@ -19,6 +20,9 @@ public:
         NetworkError,
         ParseJSONError,
         PictureNotExistsError,
+        EncodeImageError,
+        ParseDeltaError,
+        ParseBundleError,
     };
 
 };
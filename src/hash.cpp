@@ -0,0 +1,231 @@
+// Content Hash - fast hash of file contents used as cache keys.
+#include "exception.h"
+#include "hash.h"
+#include "scheduler.h"
+
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QFile>
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+using namespace std;
+
+constexpr qint64 kChunkSize = 4 << 20;
+const QString kKeyPrefix = "xxh-";
+
+constexpr uint64_t kPrime1 = 11400714785074694791ULL;
+constexpr uint64_t kPrime2 = 14029467366897019727ULL;
+constexpr uint64_t kPrime3 = 1609587929392839161ULL;
+constexpr uint64_t kPrime4 = 9650029242287828579ULL;
+constexpr uint64_t kPrime5 = 2870177450012600261ULL;
+
+inline uint64_t RotateLeft(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Read little endian, XXH64 is defined on little endian words.
+inline uint64_t Read64(const uint8_t* p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+inline uint32_t Read32(const uint8_t* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    return value;
+}
+
+inline uint64_t Round(uint64_t acc, uint64_t input)
+{
+    acc += input * kPrime2;
+    acc = RotateLeft(acc, 31);
+    return acc * kPrime1;
+}
+
+inline uint64_t Merge(uint64_t acc, uint64_t value)
+{
+    acc ^= Round(0, value);
+    return acc * kPrime1 + kPrime4;
+}
+
+uint64_t Xxh64(const void* data, size_t size, uint64_t seed)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const uint8_t* const end = p + size;
+    uint64_t h;
+    if (size >= 32) {
+        // Four independent lanes keep the multipliers busy
+        uint64_t v1 = seed + kPrime1 + kPrime2;
+        uint64_t v2 = seed + kPrime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - kPrime1;
+        const uint8_t* const limit = end - 32;
+        do {
+            v1 = Round(v1, Read64(p));
+            v2 = Round(v2, Read64(p + 8));
+            v3 = Round(v3, Read64(p + 16));
+            v4 = Round(v4, Read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = RotateLeft(v1, 1) + RotateLeft(v2, 7) + RotateLeft(v3, 12) + RotateLeft(v4, 18);
+        h = Merge(h, v1);
+        h = Merge(h, v2);
+        h = Merge(h, v3);
+        h = Merge(h, v4);
+    } else {
+        h = seed + kPrime5;
+    }
+    h += size;
+
+    // Tail
+    for (; p + 8 <= end; p += 8) {
+        h ^= Round(0, Read64(p));
+        h = RotateLeft(h, 27) * kPrime1 + kPrime4;
+    }
+    if (p + 4 <= end) {
+        h ^= static_cast<uint64_t>(Read32(p)) * kPrime1;
+        h = RotateLeft(h, 23) * kPrime2 + kPrime3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * kPrime5;
+        h = RotateLeft(h, 11) * kPrime1;
+    }
+
+    // Avalanche
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h;
+}
+
+void StoreLittleEndian(uint8_t* out, uint64_t value)
+{
+    for (size_t b = 0; b < sizeof(value); b++) {
+        out[b] = static_cast<uint8_t>(value >> (8 * b));
+    }
+}
+
+QString FormatKey(const vector<uint8_t>& chunkHashes, uint64_t size)
+{
+    const uint64_t hash = Xxh64(chunkHashes.data(), chunkHashes.size(), size);
+    return kKeyPrefix + QString("%1").arg(hash, 16, 16, QChar('0'));
+}
+
+void ContentHasher::Update(const void* data, size_t size)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    this->size += size;
+    while (size > 0) {
+        const size_t length = min(size, static_cast<size_t>(kChunkSize) - chunk.size());
+        chunk.insert(chunk.end(), p, p + length);
+        p += length;
+        size -= length;
+        if (chunk.size() == static_cast<size_t>(kChunkSize)) {
+            chunkHashes.resize(chunkHashes.size() + sizeof(uint64_t));
+            StoreLittleEndian(chunkHashes.data() + chunkHashes.size() - sizeof(uint64_t),
+                               Xxh64(chunk.data(), chunk.size(), 0));
+            chunk.clear();
+        }
+    }
+}
+
+void ContentHasher::Reset()
+{
+    chunk.clear();
+    chunkHashes.clear();
+    size = 0;
+}
+
+QString ContentHasher::Finish() const
+{
+    vector<uint8_t> hashes = chunkHashes;
+    if (!chunk.empty()) {
+        hashes.resize(hashes.size() + sizeof(uint64_t));
+        StoreLittleEndian(hashes.data() + hashes.size() - sizeof(uint64_t), Xxh64(chunk.data(), chunk.size(), 0));
+    }
+    return FormatKey(hashes, size);
+}
+
+QString HashFile(const QString& path)
+{
+    QFile file(path);
+    const uchar* data = nullptr;
+    if (file.open(QFile::ReadOnly) && file.size() > 0) {
+        data = file.map(0, file.size());
+    }
+    if (!file.isOpen() || (file.size() > 0 && data == nullptr)) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "can't open file " + path.toStdString());
+    }
+
+    // Hash chunks in parallel, then the little endian chunk hashes
+    const qint64 size = file.size();
+    const int chunkCount = static_cast<int>((size + kChunkSize - 1) / kChunkSize);
+    vector<uint8_t> chunkHashes(static_cast<size_t>(chunkCount) * sizeof(uint64_t));
+    Scheduler::getInstance().ParallelFor(Scheduler::Normal, chunkCount, [&](int i) {
+        const qint64 offset = i * kChunkSize;
+        StoreLittleEndian(chunkHashes.data() + i * sizeof(uint64_t),
+                           Xxh64(data + offset, min(kChunkSize, size - offset), 0));
+    });
+    return FormatKey(chunkHashes, static_cast<uint64_t>(size));
+}
+
+QString LegacyHashFile(const QString& path)
+{
+    QFile f(path);
+    if (f.open(QFile::ReadOnly)) {
+        QCryptographicHash hash(QCryptographicHash::Md5);
+        if (hash.addData(&f)) {
+            return hash.result().toHex();
+        }
+    }
+    throw Exception(
+                Exception::OpenFileError,
+                "can't open file " + path.toStdString());
+}
+
+bool IsLegacyKey(const QString& key)
+{
+    return key.size() == 32 && !key.startsWith(kKeyPrefix);
+}
+
+void BenchmarkHash(const QString& path)
+{
+    const double gigabytes = QFile(path).size() / 1e9;
+    auto measure = [&](const char* name, QString (*hash)(const QString&)) {
+        // Warm up page cache, then take the best of three runs
+        QString key = hash(path);
+        qint64 best = numeric_limits<qint64>::max();
+        for (int i = 0; i < 3; i++) {
+            QElapsedTimer timer;
+            timer.start();
+            key = hash(path);
+            best = min(best, timer.nsecsElapsed());
+        }
+        spdlog::info("{}: {} in {:.2f} ms, {:.2f} GB/s", name, key.toStdString(),
+                     best / 1e6, gigabytes / (best / 1e9));
+    };
+    spdlog::info("hash {} ({:.1f} MB)", path.toStdString(), gigabytes * 1e3);
+    measure("md5", LegacyHashFile);
+    measure("xxh64 chunks", HashFile);
+}
@@ -0,0 +1,44 @@
+// Content Hash - fast hash of file contents used as cache keys. Files are
+// mapped and split into fixed-size chunks, which are hashed by XXH64 in
+// parallel. Chunk hashes are hashed again with the file size as seed, so
+// the key does not depend on the number of threads.
+#ifndef HASH_H
+#define HASH_H
+
+#include <QString>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// XXH64 of a buffer.
+uint64_t Xxh64(const void* data, size_t size, uint64_t seed);
+
+// Hash file contents. Keys are "xxh-" followed by 16 hex digits.
+QString HashFile(const QString& path);
+
+// Hash data as it arrives, the key equals HashFile of the concatenated data.
+class ContentHasher
+{
+    std::vector<uint8_t> chunk;         // partial chunk
+    std::vector<uint8_t> chunkHashes;   // little endian hashes of complete chunks
+    uint64_t size = 0;
+
+public:
+    void Update(const void* data, size_t size);
+
+    void Reset();
+
+    QString Finish() const;
+};
+
+// MD5 of file contents, the cache key of earlier versions.
+QString LegacyHashFile(const QString& path);
+
+// Whether a cache key is an MD5 of earlier versions.
+bool IsLegacyKey(const QString& key);
+
+// Hash a file by MD5 and content hash, log throughput of both.
+void BenchmarkHash(const QString& path);
+
+#endif // HASH_H
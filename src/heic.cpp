@@ -1,170 +1,673 @@
 // HEIC Reader - fetch data from HEIC file.
+#include "bufferpool.h"
+#include "download.h"
 #include "exception.h"
 #include "heic.h"
+#include "jpeg.h"
+#include "log.h"
 #include "parser.h"
+#include "scale.h"
+#include "scheduler.h"
+#include "schema.h"
+#include "writeback.h"
 
 #include <QByteArray>
+#include <QElapsedTimer>
 #include <QFile>
 #include <QFileInfo>
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QPainter>
-#include <QPixmap>
+#include <QSettings>
 #include <QtXml/QDomDocument>
 
 #include <boost/any.hpp>
-#include <libheif/heif_cxx.h>
 #include <Plist.hpp>
-#include <spdlog/spdlog.h>
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
 
 using namespace std;
 using namespace heif;
 using namespace Plist;
 
-QImage Crop(const QImage& image, int width, int height)
-{
-    // Step 1: Scale image
-    double ratio = static_cast<double>(height) / width;
-    double imgRatio = static_cast<double>(image.height()) / image.width();
-    int scaleHeight = height;
-    int scaleWidth = width;
-    if (imgRatio < ratio) {
-        // +-+------+-+
-        // | |      | |
-        // +-+------+-+
-        scaleWidth = scaleHeight / imgRatio;
-    } else if (imgRatio > ratio) {
-        // +------+
-        // +------+
-        // |      |
-        // +------+
-        // +------+
-        scaleHeight = scaleWidth * imgRatio;
-    }
-    const QImage& scaledImage = image.scaled(scaleWidth, scaleHeight, Qt::KeepAspectRatio);
-    // Step 2: Crop image
-    int left = (static_cast<double>(scaleWidth) - width) / 2;
-    int top = (static_cast<double>(scaleHeight) - height) / 2;
-    QRect rect(left, top, width, height);
-    return scaledImage.copy(rect);
-}
-
-Heic Heic::Load(const QString& path)
+// Read a growing file, blocking libheif until requested bytes arrive.
+class StreamReader : public Context::Reader
 {
-    Heic heic;
-    heic.name = path.toStdString();
+    shared_ptr<GrowingFile> file;
+    QFile handle;
+    int64_t position = 0;
 
-    // Read HEIC file
-    Context context;
-    context.read_from_file(path.toStdString());
+public:
+    explicit StreamReader(shared_ptr<GrowingFile> file): file(file), handle(file->GetPath())
+    {
+        handle.open(QFile::ReadOnly | QFile::Unbuffered);
+    }
 
-    // Load images
-    const vector<heif_item_id>& imageIds = context.get_list_of_top_level_image_IDs();
-    for (const heif_item_id& imageId : imageIds) {
+    int64_t get_position() const override
+    {
+        return position;
+    }
 
-        // Fetch image
-        ImageHandle handle = context.get_image_handle(imageId);
-        Image img = handle.decode_image(heif_colorspace_RGB, heif_chroma_interleaved_RGB);
-        int stride;
-        const uint8_t* data = img.get_plane(heif_channel_interleaved, &stride);
+    int read(void* data, size_t size) override
+    {
+        const int64_t end = position + static_cast<int64_t>(size);
+        if (file->WaitForSize(end) < end
+                || !handle.seek(position)
+                || handle.read(static_cast<char*>(data), size) != static_cast<qint64>(size)) {
+            return -1;
+        }
+        position = end;
+        return 0;
+    }
 
-        // Decode image
-        int height = img.get_height(heif_channel_interleaved);
-        int width = img.get_width(heif_channel_interleaved);
-        heic.images.push_back(QImage(data, width, height, stride, QImage::Format_RGB888).copy());
+    int seek(int64_t position) override
+    {
+        this->position = position;
+        return 0;
+    }
 
-        // Fetch metadata
-        const vector<heif_item_id>& metaIds = handle.get_list_of_metadata_block_IDs();
-        if (metaIds.size() == 1
-                && handle.get_metadata_type(metaIds.front()) == "mime"
-                && handle.get_metadata_content_type(metaIds.front()) == "application/rdf+xml") {
+    heif_reader_grow_status wait_for_file_size(int64_t size) override
+    {
+        return file->WaitForSize(size) >= size
+                ? heif_reader_grow_status_size_reached
+                : heif_reader_grow_status_size_beyond_eof;
+    }
+};
 
+// Append a line to the manifest and flush it to disk before returning.
+void AppendManifest(const QString& path, const QString& line)
+{
+    QFile manifestFile(path + "/manifest");
+    if (!manifestFile.open(QIODevice::Append)) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "can't open file " + manifestFile.fileName().toStdString());
+    }
+    manifestFile.write((line + "\n").toUtf8());
+    manifestFile.flush();
+#ifdef __linux__
+    fsync(manifestFile.handle());
+#endif
+    manifestFile.close();
+}
+
+// Wrap decoded pixels without copying. The QImage holds a reference to the
+// heif image, which is released with the last copy of the QImage.
+QImage WrapImage(Image img)
+{
+    int stride;
+    uint8_t* data = img.get_plane(heif_channel_interleaved, &stride);
+    int height = img.get_height(heif_channel_interleaved);
+    int width = img.get_width(heif_channel_interleaved);
+    return QImage(data, width, height, stride, QImage::Format_RGB888,
+                  [](void* info) { delete static_cast<Image*>(info); }, new Image(img));
+}
+
+QImage WrapPlane(const Image& img, heif_channel channel)
+{
+    int stride;
+    const uint8_t* data = img.get_plane(channel, &stride);
+    return QImage(data, img.get_width(channel), img.get_height(channel), stride, QImage::Format_Grayscale8,
+                  [](void* info) { delete static_cast<Image*>(info); }, new Image(img));
+}
+
+// Copy a channel of a decoded tile into a destination plane. The plane may
+// be subsampled, tile offsets are in full resolution.
+void CopyTile(const Image& tile, heif_channel channel, QImage& plane, int left, int top, int fullWidth)
+{
+    const int shift = plane.width() < fullWidth ? 1 : 0;
+    const int bytesPerPixel = plane.depth() / 8;
+    const int x = left >> shift;
+    const int y = top >> shift;
+    const int width = min(tile.get_width(channel), plane.width() - x);
+    const int height = min(tile.get_height(channel), plane.height() - y);
+    int stride;
+    const uint8_t* data = tile.get_plane(channel, &stride);
+    for (int row = 0; row < height; row++) {
+        memcpy(plane.scanLine(y + row) + x * bytesPerPixel, data + static_cast<size_t>(row) * stride,
+               static_cast<size_t>(width) * bytesPerPixel);
+    }
+}
+
+// Decode tiles of a grid image concurrently on normal workers, assembling
+// channels directly into the destination planes. Return false if the image
+// is not tiled, tile decoding is unsupported or disabled by import/tileDecoding.
+bool DecodeTiles(ImageHandle handle, heif_colorspace colorspace, heif_chroma chroma,
+                 const vector<heif_channel>& channels, vector<QImage>& planes)
+{
+#if LIBHEIF_HAVE_VERSION(1, 19, 0)
+    if (!QSettings().value("import/tileDecoding", true).toBool()) {
+        return false;
+    }
+    const heif_image_handle* rawHandle = handle.get_raw_image_handle();
+    heif_image_tiling tiling;
+    if (heif_image_handle_get_image_tiling(rawHandle, 1, &tiling).code != heif_error_Ok
+            || tiling.num_columns * tiling.num_rows <= 1) {
+        return false;
+    }
+    const int fullWidth = handle.get_width();
+    const int columns = static_cast<int>(tiling.num_columns);
+    Scheduler::getInstance().ParallelFor(Scheduler::Normal, columns * tiling.num_rows, [&](int i) {
+        const uint32_t tileX = i % columns;
+        const uint32_t tileY = i / columns;
+        heif_image* rawTile = nullptr;
+        const heif_error& error = heif_image_handle_decode_image_tile(rawHandle, &rawTile, colorspace, chroma,
+                                                                      nullptr, tileX, tileY);
+        if (error.code != heif_error_Ok) {
+            throw Exception(
+                        Exception::ParseHEICError,
+                        string("can't decode tile: ") + error.message);
+        }
+        const Image tile(rawTile);
+        for (size_t c = 0; c < channels.size(); c++) {
+            CopyTile(tile, channels[c], planes[c], tileX * tiling.tile_width, tileY * tiling.tile_height, fullWidth);
+        }
+    });
+    return true;
+#else
+    (void) handle;
+    (void) colorspace;
+    (void) chroma;
+    (void) channels;
+    (void) planes;
+    return false;
+#endif
+}
+
+// JPEG files are BT.601 full range YCbCr, other matrices need conversion.
+bool IsJfifCompatible(ImageHandle handle)
+{
+#if LIBHEIF_HAVE_VERSION(1, 10, 0)
+    heif_color_profile_nclx* nclx = nullptr;
+    heif_error error = heif_image_handle_get_nclx_color_profile(handle.get_raw_image_handle(), &nclx);
+    if (error.code != heif_error_Ok) {
+        // Without a profile libheif assumes BT.601 full range as well
+        return true;
+    }
+    const bool compatible = (nclx->matrix_coefficients == heif_matrix_coefficients_ITU_R_BT_601_6
+                             || nclx->matrix_coefficients == heif_matrix_coefficients_ITU_R_BT_470_6_System_B_G)
+            && nclx->full_range_flag;
+    heif_nclx_color_profile_free(nclx);
+    return compatible;
+#else
+    (void) handle;
+    return false;
+#endif
+}
+
+// Decode 8-bit YCbCr 4:2:0 planes without copying, null if the frame has
+// more bits per sample. Grid tiles are decoded in parallel if decodeTiles
+// is set.
+YuvImage DecodeYuv(ImageHandle handle, bool decodeTiles)
+{
+    if (decodeTiles && handle.get_luma_bits_per_pixel() == 8) {
+        const int width = handle.get_width();
+        const int height = handle.get_height();
+        BufferPool& pool = BufferPool::getInstance();
+        vector<QImage> planes = {
+            pool.AllocateImage(width, height, QImage::Format_Grayscale8),
+            pool.AllocateImage((width + 1) / 2, (height + 1) / 2, QImage::Format_Grayscale8),
+            pool.AllocateImage((width + 1) / 2, (height + 1) / 2, QImage::Format_Grayscale8),
+        };
+        if (DecodeTiles(handle, heif_colorspace_YCbCr, heif_chroma_420,
+                        { heif_channel_Y, heif_channel_Cb, heif_channel_Cr }, planes)) {
+            return YuvImage{ planes[0], planes[1], planes[2] };
+        }
+    }
+    Image img = handle.decode_image(heif_colorspace_YCbCr, heif_chroma_420);
+    if (img.get_bits_per_pixel(heif_channel_Y) != 8) {
+        return YuvImage();
+    }
+    YuvImage yuv;
+    yuv.y = WrapPlane(img, heif_channel_Y);
+    yuv.cb = WrapPlane(img, heif_channel_Cb);
+    yuv.cr = WrapPlane(img, heif_channel_Cr);
+    return yuv;
+}
+
+// Luma weights of the YCbCr matrix of a frame and whether samples are full
+// range. Return false for matrices other than BT.601, BT.709 and BT.2020.
+bool GetYuvMatrix(ImageHandle handle, double& kr, double& kb, bool& fullRange)
+{
+    // Without a profile libheif assumes BT.601 full range
+    kr = 0.299;
+    kb = 0.114;
+    fullRange = true;
+#if LIBHEIF_HAVE_VERSION(1, 10, 0)
+    heif_color_profile_nclx* nclx = nullptr;
+    heif_error error = heif_image_handle_get_nclx_color_profile(handle.get_raw_image_handle(), &nclx);
+    if (error.code != heif_error_Ok) {
+        return true;
+    }
+    bool supported = true;
+    switch (nclx->matrix_coefficients) {
+    case heif_matrix_coefficients_ITU_R_BT_601_6:
+    case heif_matrix_coefficients_ITU_R_BT_470_6_System_B_G:
+        break;
+    case heif_matrix_coefficients_ITU_R_BT_709_5:
+        kr = 0.2126;
+        kb = 0.0722;
+        break;
+    case heif_matrix_coefficients_ITU_R_BT_2020_2_non_constant_luminance:
+        kr = 0.2627;
+        kb = 0.0593;
+        break;
+    default:
+        supported = false;
+    }
+    fullRange = nclx->full_range_flag;
+    heif_nclx_color_profile_free(nclx);
+    return supported;
+#else
+    (void) handle;
+    return true;
+#endif
+}
+
+// Convert decoded 8-bit YCbCr 4:2:0 planes to RGB, chroma is upsampled by
+// replication. Null if the matrix of the frame is not supported.
+QImage ConvertYuv(const YuvImage& yuv, ImageHandle handle)
+{
+    double kr, kb;
+    bool fullRange;
+    if (!GetYuvMatrix(handle, kr, kb, fullRange)) {
+        return QImage();
+    }
+
+    // Contributions of each sample value in 16.16 fixed point
+    const double kg = 1 - kr - kb;
+    const double lumaScale = fullRange ? 1 : 255.0 / 219;
+    const double chromaScale = fullRange ? 1 : 255.0 / 224;
+    const int lumaOffset = fullRange ? 0 : 16;
+    int luma[256], redCr[256], greenCb[256], greenCr[256], blueCb[256];
+    for (int v = 0; v < 256; v++) {
+        const double c = (v - 128) * chromaScale;
+        luma[v] = lround((v - lumaOffset) * lumaScale * 65536);
+        redCr[v] = lround(2 * (1 - kr) * c * 65536);
+        greenCb[v] = lround(2 * kb * (1 - kb) / kg * c * 65536);
+        greenCr[v] = lround(2 * kr * (1 - kr) / kg * c * 65536);
+        blueCb[v] = lround(2 * (1 - kb) * c * 65536);
+    }
+    const auto& clamp = [](int value) {
+        return static_cast<uchar>(min(max((value + 32768) >> 16, 0), 255));
+    };
+
+    const int width = yuv.GetWidth();
+    const int height = yuv.GetHeight();
+    QImage image = BufferPool::getInstance().AllocateImage(width, height, QImage::Format_RGB888);
+    for (int y = 0; y < height; y++) {
+        const uchar* lumaRow = yuv.y.constScanLine(y);
+        const uchar* cbRow = yuv.cb.constScanLine(y / 2);
+        const uchar* crRow = yuv.cr.constScanLine(y / 2);
+        uchar* out = image.scanLine(y);
+        for (int x = 0; x < width; x++) {
+            const int l = luma[lumaRow[x]];
+            const int cb = cbRow[x / 2];
+            const int cr = crRow[x / 2];
+            out[3 * x] = clamp(l + redCr[cr]);
+            out[3 * x + 1] = clamp(l - greenCb[cb] - greenCr[cr]);
+            out[3 * x + 2] = clamp(l + blueCb[cb]);
+        }
+    }
+    return image;
+}
+
+// Peak signal-to-noise ratio of an image against a reference in dB.
+double GetPsnr(const QImage& reference, const QImage& image)
+{
+    const QImage& a = reference.convertToFormat(QImage::Format_RGB888);
+    const QImage& b = image.convertToFormat(QImage::Format_RGB888);
+    if (a.size() != b.size()) {
+        return 0;
+    }
+    double error = 0;
+    for (int y = 0; y < a.height(); y++) {
+        const uchar* lineA = a.constScanLine(y);
+        const uchar* lineB = b.constScanLine(y);
+        for (int x = 0; x < a.width() * 3; x++) {
+            const int diff = lineA[x] - lineB[x];
+            error += diff * diff;
+        }
+    }
+    const double mse = error / (3.0 * a.width() * a.height());
+    return mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : numeric_limits<double>::infinity();
+}
+
+// Transcode a frame through the RGB and YUV paths, log time, size and
+// quality against the decoded RGB frame. Enabled by debug/compareTranscode.
+void CompareTranscode(ImageHandle handle, size_t index, bool decodeTiles)
+{
+    QElapsedTimer timer;
+    timer.start();
+    const QImage& image = WrapImage(handle.decode_image(heif_colorspace_RGB, heif_chroma_interleaved_RGB));
+    FrameStore::Hash(image);
+    const QByteArray& rgbFrame = EncodeImage(image);
+    EncodeImage(CropImage(image, Heic::kThumbWidth, Heic::kThumbHeight));
+    const qint64 rgbElapsed = timer.restart();
+    const YuvImage& yuv = DecodeYuv(handle, decodeTiles);
+    if (yuv.IsNull() || !IsRawJpegSupported() || !IsJfifCompatible(handle)) {
+        GetLogger(DecodeLog).info("\tframe {} can't be transcoded in YUV", index);
+        return;
+    }
+    FrameStore::Hash({ yuv.y, yuv.cb, yuv.cr });
+    const QByteArray& yuvFrame = EncodeJpeg(yuv, kJpegQuality);
+    EncodeJpeg(CropYuv(yuv, Heic::kThumbWidth, Heic::kThumbHeight), kJpegQuality);
+    const qint64 yuvElapsed = timer.elapsed();
+    GetLogger(DecodeLog).info("\tframe {} RGB path: {} ms, {} KB, {:.2f} dB; YUV path: {} ms, {} KB, {:.2f} dB", index,
+                 rgbElapsed, rgbFrame.size() / 1024, GetPsnr(image, QImage::fromData(rgbFrame, "JPG")),
+                 yuvElapsed, yuvFrame.size() / 1024, GetPsnr(image, QImage::fromData(yuvFrame, "JPG")));
+}
+
+// Extract solar config in plist XML, return empty string if absent.
+string ParseSolarConfig(ImageHandle handle)
+{
+    const vector<heif_item_id>& metaIds = handle.get_list_of_metadata_block_IDs();
+    if (metaIds.size() != 1
+            || handle.get_metadata_type(metaIds.front()) != "mime"
+            || handle.get_metadata_content_type(metaIds.front()) != "application/rdf+xml") {
+        return string();
+    }
+
+    // Parse metadata
+    const vector<uint8_t>& metadata = handle.get_metadata(metaIds.front());
+    string metaText(metadata.begin(), metadata.end());
+    QDomDocument metaDoc;
+    metaDoc.setContent(QString::fromStdString(metaText));
+    const QDomElement& rootElement = metaDoc.documentElement();
+    const QDomElement& rdfElement = rootElement.firstChildElement();
+    const QDomElement& descElement = rdfElement.firstChildElement();
+    const QString& solarConfig = descElement.attribute("apple_desktop:solar");
+
+    // Parse plist
+    const string& plistText = QByteArray::fromBase64(solarConfig.toUtf8()).toStdString();
+    boost::any message;
+    Plist::readPlist(plistText.c_str(), plistText.size(), message);
+    vector<char> buf;
+    Plist::writePlistXML(buf, message);
+    return string(buf.begin(), buf.end());
+}
+
+// Decode an embedded thumbnail cropped to the thumbnail size, null if absent.
+QImage DecodeThumbnail(ImageHandle handle)
+{
+    const vector<heif_item_id>& thumbIds = handle.get_list_of_thumbnail_IDs();
+    if (thumbIds.empty()) {
+        return QImage();
+    }
+    ImageHandle thumbHandle = handle.get_thumbnail(thumbIds.front());
+    const QImage& thumb = WrapImage(thumbHandle.decode_image(heif_colorspace_RGB, heif_chroma_interleaved_RGB));
+    return CropImage(thumb, Heic::kThumbWidth, Heic::kThumbHeight);
+}
+
+// Read solar config, key frames and embedded thumbnails of an opened file.
+void ReadMetadata(Heic& heic)
+{
+    heic.imageIds = heic.context.get_list_of_top_level_image_IDs();
+
+    // Fetch metadata
+    for (const heif_item_id& imageId : heic.imageIds) {
+        const string& config = ParseSolarConfig(heic.context.get_image_handle(imageId));
+        if (!config.empty()) {
             if (!heic.config.empty()) {
                 throw Exception(
                             Exception::ParseHEICError,
                             "duplicate metadata");
             }
-
-            // Parse metadata
-            const vector<uint8_t>& metadata = handle.get_metadata(metaIds.front());
-            string metaText(metadata.begin(), metadata.end());
-            QDomDocument metaDoc;
-            metaDoc.setContent(QString::fromStdString(metaText));
-            const QDomElement& rootElement = metaDoc.documentElement();
-            const QDomElement& rdfElement = rootElement.firstChildElement();
-            const QDomElement& descElement = rdfElement.firstChildElement();
-            const QString& solarConfig = descElement.attribute("apple_desktop:solar");
-
-            // Parse plist
-            const string& plistText = QByteArray::fromBase64(solarConfig.toUtf8()).toStdString();
-            boost::any message;
-            Plist::readPlist(plistText.c_str(), plistText.size(), message);
-            vector<char> buf;
-            Plist::writePlistXML(buf, message);
-            heic.config = string(buf.begin(), buf.end());
+            heic.config = config;
         }
     }
+    if (heic.config.empty()) {
+        throw Exception(
+                    Exception::ParseHEICError,
+                    "solar metadata not found");
+    }
+
+    // Parse dark and light frame
+    QDomDocument dom;
+    dom.setContent(QString::fromStdString(heic.config));
+    const QJsonObject& ap = ParsePlist(dom).object().value("ap").toObject();
+    heic.lightFrameId = ap.value("l").toInt();
+    heic.darkFrameId = ap.value("d").toInt();
+
+    // Fetch embedded thumbnails
+    if (static_cast<size_t>(heic.lightFrameId) < heic.imageIds.size()
+            && static_cast<size_t>(heic.darkFrameId) < heic.imageIds.size()) {
+        heic.lightThumb = heic.DecodeFrameThumbnail(heic.lightFrameId);
+        heic.darkThumb = heic.DecodeFrameThumbnail(heic.darkFrameId);
+    }
+}
+
+Heic Heic::Open(const QString& path)
+{
+    Heic heic;
+    heic.name = path.toStdString();
+
+    // Map HEIC file, images are decoded on demand
+    heic.source = make_shared<QFile>(path);
+    if (heic.source->open(QFile::ReadOnly)) {
+        heic.data = heic.source->map(0, heic.source->size());
+    }
+    if (heic.data == nullptr) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "can't map file " + path.toStdString());
+    }
+    heic.context.read_from_memory_without_copy(heic.data, heic.source->size());
+    heic.imageIds = heic.context.get_list_of_top_level_image_IDs();
+    return heic;
+}
+
+Heic Heic::Probe(const QString& path)
+{
+    try {
+        Heic heic = Open(path);
+        heic.useWorkers = DecodePool::IsEnabled();
+        ReadMetadata(heic);
+        return heic;
+    } catch (const heif::Error& e) {
+        throw Exception(
+                    Exception::ParseHEICError,
+                    path.toStdString() + ": " + e.get_message());
+    }
+}
+
+Heic Heic::Probe(shared_ptr<GrowingFile> file)
+{
+    Heic heic;
+    heic.name = file->GetPath().toStdString();
+    heic.growingFile = file;
+    heic.reader = make_shared<StreamReader>(file);
+    heic.context.read_from_reader(*heic.reader);
+    ReadMetadata(heic);
+    return heic;
+}
 
+Heic Heic::Fork() const
+{
+    Heic heic = *this;
+    heic.context = Context();
+    if (growingFile) {
+        heic.reader = make_shared<StreamReader>(growingFile);
+        heic.context.read_from_reader(*heic.reader);
+    } else {
+        heic.context.read_from_memory_without_copy(data, source->size());
+    }
     return heic;
 }
 
-void Heic::Save(const QString &path) const
+bool Heic::IsTileDecodingSupported() const
+{
+    return LIBHEIF_HAVE_VERSION(1, 19, 0) && !reader;
+}
+
+QImage Heic::DecodeFrame(size_t index) const
+{
+    try {
+        ImageHandle handle = context.get_image_handle(imageIds.at(index));
+        vector<QImage> planes = {
+            BufferPool::getInstance().AllocateImage(handle.get_width(), handle.get_height(), QImage::Format_RGB888)
+        };
+        if (IsTileDecodingSupported()
+                && DecodeTiles(handle, heif_colorspace_RGB, heif_chroma_interleaved_RGB, { heif_channel_interleaved }, planes)) {
+            return planes.front();
+        }
+        return WrapImage(handle.decode_image(heif_colorspace_RGB, heif_chroma_interleaved_RGB));
+    } catch (const heif::Error& e) {
+        throw Exception(
+                    Exception::ParseHEICError,
+                    name + ": " + e.get_message());
+    }
+}
+
+DecodedFrame Heic::DecodeStoredFrame(size_t index) const
+{
+    if (useWorkers) {
+        return DecodePool::getInstance().DecodeFrame(QString::fromStdString(name), index);
+    }
+
+    // Frames are coded in YCbCr 4:2:0 like JPEG, pass planes to the encoder
+    // directly. Convert the planes to RGB if the frame needs color
+    // conversion, the planes still key the frame.
+    try {
+        const ImageHandle& handle = context.get_image_handle(imageIds.at(index));
+        DecodedFrame frame;
+        frame.yuv = DecodeYuv(handle, IsTileDecodingSupported());
+        if (frame.yuv.IsNull()) {
+            // Frames of more than 8 bits are converted by libheif
+            frame.image = DecodeFrame(index);
+        } else if (!IsRawJpegSupported() || !IsJfifCompatible(handle)) {
+            // Convert the planes instead of decoding the frame again, unless
+            // the matrix is one only libheif knows
+            frame.image = ConvertYuv(frame.yuv, handle);
+            if (frame.image.isNull()) {
+                frame.image = DecodeFrame(index);
+            }
+        }
+        return frame;
+    } catch (const heif::Error& e) {
+        throw Exception(
+                    Exception::ParseHEICError,
+                    name + ": " + e.get_message());
+    }
+}
+
+QImage Heic::DecodeFrameThumbnail(size_t index) const
+{
+    if (useWorkers) {
+        return DecodePool::getInstance().DecodeThumbnail(QString::fromStdString(name), index);
+    }
+    try {
+        return DecodeThumbnail(context.get_image_handle(imageIds.at(index)));
+    } catch (const heif::Error& e) {
+        throw Exception(
+                    Exception::ParseHEICError,
+                    name + ": " + e.get_message());
+    }
+}
+
+// Compose the cover of light and dark thumbnails, and queue it with its icon.
+void Heic::WriteCover(WriteBatch& batch, const QString& path, const QImage& lightFrame, const QImage& darkFrame)
+{
+    const auto thumbWidth = darkFrame.width();
+    const auto thumbHeight = lightFrame.height();
+    // QImage instead of QPixmap, covers are generated outside the GUI thread
+    QImage cover = BufferPool::getInstance().AllocateImage(thumbWidth, thumbHeight, QImage::Format_RGB32);
+    {
+        QPainter painter(&cover);
+        QRegion r1(QRect(0, 0, thumbWidth/2, thumbHeight));
+        painter.setClipRegion(r1);
+        painter.drawImage(0, 0, lightFrame);
+        QRegion r2(QRect(thumbWidth/2, 0, thumbWidth/2, thumbHeight));
+        painter.setClipRegion(r2);
+        painter.drawImage(0, 0, darkFrame);
+    }
+    // Write the icon first, the cover marks the pair complete
+    batch.Write(path + "/cover_icon.jpg", EncodeImage(CropImage(cover, Heic::kIconWidth, Heic::kIconHeight)));
+    batch.Write(path + "/cover.jpg", EncodeImage(cover));
+}
+
+void Heic::SaveConfig(const QString &path) const
 {
-    spdlog::info("save cache of {} to {}", name, path.toStdString());
+    GetLogger(DecodeLog).info("save cache of {} to {}", name, path.toStdString());
 
     // Parse config
     QDomDocument dom;
     dom.setContent(QString::fromStdString(config));
     QJsonDocument json = ParsePlist(dom);
-    const QJsonObject& ap = json.object().value("ap").toObject();
-    size_t lightFrameId = ap.value("l").toInt();
-    size_t darkFrameId = ap.value("d").toInt();
 
     // Save name
     const QFileInfo& heicFile(QString::fromStdString(name));
     const QStringList& nameAndExt = heicFile.fileName().split(".");
     const QString& name = nameAndExt.at(0);
-    spdlog::info("\tname: {}", name.toStdString());
+    GetLogger(DecodeLog).info("\tname: {}", name.toStdString());
     QJsonObject object = json.object();
     object.insert("name", name);
     json.setObject(object);
 
-    // Save config
-    QFile configFile(path + "/config.json");
-    configFile.open(QIODevice::WriteOnly);
-    configFile.write(json.toJson());
-    configFile.close();
-
-    QImage darkFrame, lightFrame;
-    spdlog::info("\timages: {}", images.size());
-    for (size_t i = 0; i < images.size(); i++) {
-        const QImage& image = images[i];
-        const QString& fileName = path + "/" + QString::number(i) + ".jpg";
-        image.save(fileName);
-        // Generate thumbnails
-        const QString& thumbName = path + "/thumb_" + QString::number(i) + ".jpg";
-        const QImage& thumb = Crop(image, kThumbWidth, kThumbHeight);
-        thumb.save(thumbName);
-        if (i == darkFrameId) {
-            darkFrame = thumb.copy();
-        }
-        if (i == lightFrameId) {
-            lightFrame = thumb.copy();
+    // Config, cover and schema are written and synced as one batch
+    WriteBatch batch;
+    batch.Write(path + "/config.json", json.toJson());
+    if (!lightThumb.isNull() && !darkThumb.isNull()) {
+        WriteCover(batch, path, lightThumb, darkThumb);
+    }
+    // Record how artifacts are built, so later versions migrate them
+    batch.Write(path + "/schema.json", SerializeSchema(EntrySchema::GetCurrent()));
+    batch.Commit();
+
+    // Create manifest last, its existence marks config, cover and schema complete
+    SaveData(QByteArray(), path + "/manifest");
+}
+
+QString Heic::SaveFrame(const QString &path, size_t index, const FrameStore& store) const
+{
+    if (QSettings().value("debug/compareTranscode", false).toBool()) {
+        try {
+            CompareTranscode(context.get_image_handle(imageIds.at(index)), index, IsTileDecodingSupported());
+        } catch (const heif::Error& e) {
+            throw Exception(
+                        Exception::ParseHEICError,
+                        name + ": " + e.get_message());
         }
     }
 
-    // Generate cover
-    const auto thumbWidth = darkFrame.width();
-    const auto thumbHeight = lightFrame.height();
-    const QString& coverName = path + "/cover.jpg";
-    QPixmap coverPixmap(thumbWidth, thumbHeight);
-    QPainter painter(&coverPixmap);
-    QRegion r1(QRect(0, 0, thumbWidth/2, thumbHeight));
-    painter.setClipRegion(r1);
-    painter.drawImage(0, 0, lightFrame);
-    QRegion r2(QRect(thumbWidth/2, 0, thumbWidth/2, thumbHeight));
-    painter.setClipRegion(r2);
-    painter.drawImage(0, 0, darkFrame);
-    coverPixmap.save(coverName);
+    const DecodedFrame& frame = DecodeStoredFrame(index);
+    const YuvImage& yuv = frame.yuv;
+    const QImage& image = frame.image;
+    // Key by the planes whichever way the frame is encoded, so it does not
+    // depend on libjpeg or tile decoding. Only frames of more than 8 bits
+    // are keyed by RGB.
+    const QString& hash = yuv.IsNull() ? FrameStore::Hash(image) : FrameStore::Hash({ yuv.y, yuv.cb, yuv.cr });
+    if (store.Contains(hash)) {
+        // Shared frame, skip encoding
+        GetLogger(DecodeLog).info("\tframe {} exists as {}", index, hash.toStdString());
+    } else if (!image.isNull()) {
+        // Generate renditions, the full frame is read once for the thumbnail
+        const QImage& thumb = CropImage(image, kThumbWidth, kThumbHeight);
+        const QImage& preview = CropImage(thumb, kPreviewWidth, kPreviewHeight);
+        store.Put(hash, image, thumb, preview);
+        GetLogger(DecodeLog).info("\tframe {} saved as {}", index, hash.toStdString());
+    } else {
+        const YuvImage& thumb = CropYuv(yuv, kThumbWidth, kThumbHeight);
+        const YuvImage& preview = CropYuv(thumb, kPreviewWidth, kPreviewHeight);
+        store.Put(hash, EncodeJpeg(yuv, kJpegQuality), EncodeJpeg(thumb, kJpegQuality),
+                  EncodeJpeg(preview, kJpegQuality));
+        GetLogger(DecodeLog).info("\tframe {} saved as {} from YUV planes", index, hash.toStdString());
+    }
+
+    // Blob is on disk, record it in the manifest
+    AppendManifest(path, QString("%1 %2").arg(index).arg(hash));
+    return hash;
 }
+
+void Heic::FinishManifest(const QString& path)
+{
+    AppendManifest(path, "end");
+}
+
@@ -2,21 +2,92 @@
 #ifndef WALLPAPER_H
 #define WALLPAPER_H
 
+#include "decoder.h"
+#include "store.h"
+
+#include <QFile>
 #include <QImage>
 #include <QString>
 
+#include <libheif/heif_cxx.h>
+
+#include <memory>
+
+class GrowingFile;
+class WriteBatch;
+
 struct Heic
 {
-    std::vector<QImage> images;
+    std::shared_ptr<QFile> source;  // mapped HEIC file, must outlive context
+    const uchar* data = nullptr;    // mapped bytes of source
+    std::shared_ptr<GrowingFile> growingFile;           // file being downloaded, instead of source
+    std::shared_ptr<heif::Context::Reader> reader;      // reader of growingFile, must outlive context
+    heif::Context context;
+    std::vector<heif_item_id> imageIds;
     std::string config;
     std::string name;
+    int lightFrameId = 0;
+    int darkFrameId = 0;
+    QImage lightThumb;  // embedded thumbnail of the light frame, null if absent
+    QImage darkThumb;   // embedded thumbnail of the dark frame, null if absent
+    bool useWorkers = false;    // decode in worker processes, see decoder.h
+
+    size_t GetFrameCount() const { return imageIds.size(); }
+
+    // Decode a frame in full resolution. Grid images are decoded tile by
+    // tile in parallel into a pooled image, otherwise the returned image
+    // shares pixels with the decoded heif image instead of copying them.
+    QImage DecodeFrame(size_t index) const;
+
+    // Decode a frame as it is stored, see DecodedFrame.
+    DecodedFrame DecodeStoredFrame(size_t index) const;
+
+    // Decode the embedded thumbnail of a frame cropped to the thumbnail
+    // size, null if absent.
+    QImage DecodeFrameThumbnail(size_t index) const;
+
+    // Open another context on the mapped file, so frames can be decoded by
+    // several threads without sharing a context.
+    Heic Fork() const;
+
+    // Whether grid tiles can be decoded in parallel. It requires libheif
+    // 1.19 and a mapped file, a reader is not shared between threads.
+    bool IsTileDecodingSupported() const;
+
+    // Save config, cover if thumbnails are embedded, schema, then an empty manifest.
+    // The manifest is a journal of imported frames, one "<index> <hash>" per
+    // line and "end" once every frame is imported.
+    void SaveConfig(const QString& path) const;
+
+    // Decode a frame, save it to the frame store and append it to the manifest.
+    QString SaveFrame(const QString& path, size_t index, const FrameStore& store) const;
+
+    // Mark manifest complete.
+    static void FinishManifest(const QString& path);
+
+    // Read solar metadata and embedded thumbnails without decoding frames.
+    // Frames of the file are decoded in workers if DecodePool::IsEnabled.
+    static Heic Probe(const QString& fileName);
+
+    // Map a file without reading metadata, frames are decoded in this process.
+    static Heic Open(const QString& fileName);
 
-    void Save(const QString& path) const;
+    // Probe a file while it is written. Reads block until the bytes arrive,
+    // so frames are decoded while later parts are still downloading.
+    static Heic Probe(std::shared_ptr<GrowingFile> file);
 
-    static Heic Load(const QString& fileName);
+    // Generate cover and its gallery icon from thumbnails of the light and dark
+    // frame, written by batch with the icon first.
+    static void WriteCover(WriteBatch& batch, const QString& path, const QImage& lightThumb, const QImage& darkThumb);
 
+    // Renditions are generated at import in the exact size they are shown,
+    // so the settings window never resamples images.
     static constexpr int kThumbWidth = 480;     // the width of thumbnails
     static constexpr int kThumbHeight = 270;    // the height of thumbnails
+    static constexpr int kPreviewWidth = 200;   // the width of previews in the settings window
+    static constexpr int kPreviewHeight = 112;  // the height of previews in the settings window
+    static constexpr int kIconWidth = 178;      // the width of gallery icons
+    static constexpr int kIconHeight = 100;     // the height of gallery icons
 };
 
 #endif // WALLPAPER_H
@@ -0,0 +1,159 @@
+// JPEG Writer - encode planar YCbCr 4:2:0 without a round trip through RGB.
+#include "exception.h"
+#include "jpeg.h"
+#include "scale.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#ifdef HAVE_LIBJPEG
+#include <csetjmp>
+#include <cstdio>
+#include <jpeglib.h>
+#endif
+
+using namespace std;
+
+YuvImage CropYuv(const YuvImage& image, int width, int height)
+{
+    const QRectF& source = GetCropRect(image.GetWidth(), image.GetHeight(), width, height);
+    const QRectF chromaSource(source.left() / 2, source.top() / 2, source.width() / 2, source.height() / 2);
+    const int chromaWidth = (width + 1) / 2;
+    const int chromaHeight = (height + 1) / 2;
+    YuvImage cropped;
+    cropped.y = ScaleImage(image.y, source, width, height);
+    cropped.cb = ScaleImage(image.cb, chromaSource, chromaWidth, chromaHeight);
+    cropped.cr = ScaleImage(image.cr, chromaSource, chromaWidth, chromaHeight);
+    return cropped;
+}
+
+#ifdef HAVE_LIBJPEG
+
+bool IsRawJpegSupported()
+{
+    return true;
+}
+
+struct JpegError
+{
+    jpeg_error_mgr manager;
+    jmp_buf jump;
+};
+
+// Rows of a plane for one iMCU row. libjpeg reads whole blocks, rows too
+// narrow for that are copied to scratch rows padded by edge replication.
+// Bytes past the width are never encoded as they are, they are row padding
+// or left over from reused buffers.
+class RowFeeder
+{
+    const uchar* data;
+    int width, height, stride, paddedWidth;
+    vector<vector<uchar>> scratch;
+
+public:
+    RowFeeder(const QImage& plane, int paddedWidth, int rows)
+        : data(plane.constBits()), width(plane.width()), height(plane.height()),
+          stride(plane.bytesPerLine()), paddedWidth(paddedWidth), scratch(rows, vector<uchar>(paddedWidth)) {}
+
+    void Fill(JSAMPROW* rows, int first, int count)
+    {
+        for (int i = 0; i < count; i++) {
+            const uchar* row = data + static_cast<size_t>(min(first + i, height - 1)) * stride;
+            if (width >= paddedWidth) {
+                rows[i] = const_cast<JSAMPROW>(row);
+            } else {
+                memcpy(scratch[i].data(), row, width);
+                fill(scratch[i].begin() + width, scratch[i].end(), row[width - 1]);
+                rows[i] = scratch[i].data();
+            }
+        }
+    }
+};
+
+// Encode without C++ objects alive across setjmp, longjmp skips destructors.
+bool EncodeRaw(jpeg_compress_struct* cinfo, JpegError* error, RowFeeder* feeders,
+               int width, int height, int quality, unsigned char** buffer, unsigned long* size)
+{
+    if (setjmp(error->jump)) {
+        jpeg_destroy_compress(cinfo);
+        return false;
+    }
+    jpeg_create_compress(cinfo);
+    jpeg_mem_dest(cinfo, buffer, size);
+    cinfo->image_width = width;
+    cinfo->image_height = height;
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_colorspace(cinfo, JCS_YCbCr);
+    jpeg_set_quality(cinfo, quality, TRUE);
+    cinfo->raw_data_in = TRUE;
+#if JPEG_LIB_VERSION >= 70
+    cinfo->do_fancy_downsampling = FALSE;
+#endif
+    cinfo->comp_info[0].h_samp_factor = 2;
+    cinfo->comp_info[0].v_samp_factor = 2;
+    for (int i = 1; i < 3; i++) {
+        cinfo->comp_info[i].h_samp_factor = 1;
+        cinfo->comp_info[i].v_samp_factor = 1;
+    }
+    jpeg_start_compress(cinfo, TRUE);
+    JSAMPROW yRows[2 * DCTSIZE], cbRows[DCTSIZE], crRows[DCTSIZE];
+    JSAMPARRAY planes[3] = { yRows, cbRows, crRows };
+    while (cinfo->next_scanline < cinfo->image_height) {
+        const int line = cinfo->next_scanline;
+        feeders[0].Fill(yRows, line, 2 * DCTSIZE);
+        feeders[1].Fill(cbRows, line / 2, DCTSIZE);
+        feeders[2].Fill(crRows, line / 2, DCTSIZE);
+        jpeg_write_raw_data(cinfo, planes, 2 * DCTSIZE);
+    }
+    jpeg_finish_compress(cinfo);
+    jpeg_destroy_compress(cinfo);
+    return true;
+}
+
+QByteArray EncodeJpeg(const YuvImage& image, int quality)
+{
+    const int width = image.GetWidth();
+    const int height = image.GetHeight();
+    const int paddedWidth = (width + 2 * DCTSIZE - 1) / (2 * DCTSIZE) * (2 * DCTSIZE);
+    RowFeeder feeders[3] = {
+        RowFeeder(image.y, paddedWidth, 2 * DCTSIZE),
+        RowFeeder(image.cb, paddedWidth / 2, DCTSIZE),
+        RowFeeder(image.cr, paddedWidth / 2, DCTSIZE),
+    };
+
+    jpeg_compress_struct cinfo;
+    JpegError error;
+    cinfo.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = [](j_common_ptr info) {
+        longjmp(reinterpret_cast<JpegError*>(info->err)->jump, 1);
+    };
+    unsigned char* buffer = nullptr;
+    unsigned long size = 0;
+    const bool success = EncodeRaw(&cinfo, &error, feeders, width, height, quality, &buffer, &size);
+    QByteArray data;
+    if (success) {
+        data = QByteArray(reinterpret_cast<const char*>(buffer), static_cast<int>(size));
+    }
+    free(buffer);
+    if (!success) {
+        throw Exception(Exception::EncodeImageError, "failed to encode JPEG");
+    }
+    return data;
+}
+
+#else
+
+bool IsRawJpegSupported()
+{
+    return false;
+}
+
+QByteArray EncodeJpeg(const YuvImage&, int)
+{
+    throw Exception(Exception::EncodeImageError, "built without libjpeg");
+}
+
+#endif
@@ -0,0 +1,31 @@
+// JPEG Writer - encode planar YCbCr 4:2:0 without a round trip through RGB.
+#ifndef JPEG_H
+#define JPEG_H
+
+#include <QByteArray>
+#include <QImage>
+
+// 8-bit YCbCr 4:2:0 image. Planes are Format_Grayscale8 images, chroma
+// planes have half the width and height of the luma plane, rounded up.
+struct YuvImage
+{
+    QImage y, cb, cr;
+
+    bool IsNull() const { return y.isNull(); }
+    int GetWidth() const { return y.width(); }
+    int GetHeight() const { return y.height(); }
+};
+
+// Scale and crop to width x height with an area-averaging filter in the YUV planes.
+YuvImage CropYuv(const YuvImage& image, int width, int height);
+
+// JPEG quality of imported frames, the default of Qt's JPEG writer.
+constexpr int kJpegQuality = 75;
+
+// Whether EncodeJpeg is available, it requires libjpeg.
+bool IsRawJpegSupported();
+
+// Encode JPEG from YUV planes by jpeg_write_raw_data.
+QByteArray EncodeJpeg(const YuvImage& image, int quality);
+
+#endif // JPEG_H
@@ -0,0 +1,115 @@
+// Log - asynchronous loggers per subsystem.
+#include "log.h"
+
+#include <QSettings>
+
+#include <spdlog/async.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+
+#include <memory>
+#include <mutex>
+
+using namespace std;
+
+constexpr size_t kQueueSize = 8192;     // messages waiting for the writer thread
+constexpr char kDefaultLogger[] = "default";
+const char* const kLoggerNames[kLogSubsystemCount] = { "cache", "decode", "desktop", "gui", "server" };
+
+shared_ptr<spdlog::logger> loggers[kLogSubsystemCount];
+once_flag initFlag;
+
+void InitLogging()
+{
+    call_once(initFlag, [](){
+        spdlog::init_thread_pool(kQueueSize, 1);
+        const auto& sink = make_shared<spdlog::sinks::stdout_color_sink_mt>();
+        const auto& create = [&sink](const string& name) {
+            auto logger = make_shared<spdlog::async_logger>(name, sink, spdlog::thread_pool(),
+                                                            spdlog::async_overflow_policy::overrun_oldest);
+            // Errors may precede a crash, write them right away
+            logger->flush_on(spdlog::level::err);
+            return logger;
+        };
+        for (int i = 0; i < kLogSubsystemCount; i++) {
+            loggers[i] = create(kLoggerNames[i]);
+            spdlog::register_logger(loggers[i]);
+        }
+        spdlog::set_default_logger(create(kDefaultLogger));
+    });
+}
+
+spdlog::logger& GetLogger(LogSubsystem subsystem)
+{
+    InitLogging();
+    return *loggers[subsystem];
+}
+
+void LoadLogLevels()
+{
+    QSettings settings;
+    SetLogLevel("", settings.value("log/level", "info").toString().toStdString(), false);
+    for (const char* name : kLoggerNames) {
+        const QString& key = QString("log/") + name;
+        if (settings.contains(key)) {
+            SetLogLevel(name, settings.value(key).toString().toStdString(), false);
+        }
+    }
+}
+
+bool SetLogLevel(const string& name, const string& level, bool persist)
+{
+    InitLogging();
+    // Unknown levels are parsed as off
+    const spdlog::level::level_enum value = spdlog::level::from_str(level);
+    if (value == spdlog::level::off && level != "off") {
+        return false;
+    }
+    if (name.empty()) {
+        spdlog::set_level(value);
+    } else if (const auto& logger = spdlog::get(name)) {
+        logger->set_level(value);
+    } else {
+        return false;
+    }
+
+    if (persist) {
+        QSettings settings;
+        if (name.empty()) {
+            // Levels of subsystems are overridden
+            settings.setValue("log/level", QString::fromStdString(level));
+            for (const char* subsystem : kLoggerNames) {
+                settings.remove(QString("log/") + subsystem);
+            }
+        } else {
+            settings.setValue(QString("log/") + QString::fromStdString(name), QString::fromStdString(level));
+        }
+    }
+    return true;
+}
+
+map<string, string> GetLogLevels()
+{
+    InitLogging();
+    map<string, string> levels;
+    const auto& add = [&levels](const shared_ptr<spdlog::logger>& logger) {
+        const auto& level = spdlog::level::to_string_view(logger->level());
+        levels[logger->name()] = string(level.data(), level.size());
+    };
+    add(spdlog::default_logger());
+    for (const shared_ptr<spdlog::logger>& logger : loggers) {
+        add(logger);
+    }
+    return levels;
+}
+
+bool LogThrottle::Allow(int& dropped)
+{
+    const auto now = chrono::steady_clock::now().time_since_epoch().count();
+    auto due = next.load();
+    if (now < due || !next.compare_exchange_strong(due, now + interval.count())) {
+        suppressed++;
+        return false;
+    }
+    dropped = suppressed.exchange(0);
+    return true;
+}
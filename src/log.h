@@ -0,0 +1,60 @@
+// Log - asynchronous loggers per subsystem. Messages are formatted by the
+// caller and written by a background thread from a bounded queue. Once the
+// queue is full the oldest messages are dropped, callers never wait for IO.
+// Levels are read from the settings, log/level for all loggers and
+// log/<name> per subsystem, and can be changed at runtime through the
+// control server. Statements below SPDLOG_ACTIVE_LEVEL, set by the build,
+// are compiled out: hot paths log with SPDLOG_LOGGER_TRACE.
+#ifndef LOG_H
+#define LOG_H
+
+#include <spdlog/spdlog.h>
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+
+enum LogSubsystem {
+    CacheLog,       // picture sync, import pipeline and bundles
+    DecodeLog,      // HEIC decoding and decode workers
+    DesktopLog,     // applying wallpapers
+    GuiLog,         // settings window
+    ServerLog,      // control server
+    kLogSubsystemCount
+};
+
+// Create the loggers and the asynchronous default logger. Called at the
+// start of main, later calls do nothing.
+void InitLogging();
+
+// Logger of a subsystem.
+spdlog::logger& GetLogger(LogSubsystem subsystem);
+
+// Apply levels of the settings.
+void LoadLogLevels();
+
+// Set the level of a logger by name, or of all loggers if name is empty.
+// It is kept in the settings if persist is set. Return false if the name
+// or the level is unknown.
+bool SetLogLevel(const std::string& name, const std::string& level, bool persist);
+
+// Levels of loggers by name, "default" for the default logger.
+std::map<std::string, std::string> GetLogLevels();
+
+// Let one message through per interval, for messages repeated on hot paths.
+class LogThrottle
+{
+    const std::chrono::steady_clock::duration interval;
+    std::atomic<std::chrono::steady_clock::rep> next { 0 };
+    std::atomic<int> suppressed { 0 };
+
+public:
+    explicit LogThrottle(std::chrono::steady_clock::duration interval): interval(interval) {}
+
+    // Whether to log this message. If so, dropped is set to the number of
+    // messages suppressed since the last one.
+    bool Allow(int& dropped);
+};
+
+#endif // LOG_H
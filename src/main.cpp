@@ -1,16 +1,244 @@
 #include "mainwindow.h"
+#include "cache.h"
 #include "daemon.h"
+#include "decoder.h"
+#include "delta.h"
+#include "exception.h"
+#include "hash.h"
+#include "log.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "soak.h"
 
 #include <QApplication>
+#include <QCommandLineParser>
 #include <QSystemTrayIcon>
 #include <QMenu>
 #include <QDebug>
+#include <QElapsedTimer>
 #include <QObject>
+#include <QTimer>
 
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <string>
+
+using namespace std;
+
+// Wait until the wallpaper is applied, check startup phases against
+// budgets and quit, with status 1 if a budget is exceeded.
+void ReportStartup(const map<string, double>& budgets)
+{
+    static constexpr int kPollInterval = 100;
+    static constexpr int kTimeout = 30000;
+    QElapsedTimer elapsed;
+    elapsed.start();
+    QTimer* timer = new QTimer(qApp);
+    QObject::connect(timer, &QTimer::timeout, [elapsed, budgets](){
+        Metrics& metrics = Metrics::getInstance();
+        if (!metrics.Contains("startup.wallpaper_ms") && !elapsed.hasExpired(kTimeout)) {
+            return;
+        }
+        map<string, double> phases;
+        for (const auto& [name, value] : metrics.GetValues()) {
+            if (name.rfind("startup.", 0) == 0) {
+                phases.insert({ name, value });
+            }
+        }
+        QApplication::exit(CheckBudgets(phases, budgets) ? 0 : 1);
+    });
+    timer->start(kPollInterval);
+}
+
+// Defaults of startup budgets (ms), replaced per phase by --startup-budget.
+const map<string, double>& GetDefaultStartupBudgets()
+{
+    static const map<string, double> budgets {
+        { "startup.tray_ms", 1000 },
+        { "startup.wallpaper_ms", 3000 },
+    };
+    return budgets;
+}
+
+// Benchmark delta storage on the frames of a cached picture, keyframe first.
+int RunDeltaBenchmark(const QString& name)
+{
+    Cache& cache = Cache::getInstance();
+    for (const CachedPicture& picture : cache.GetCachedPictures(false)) {
+        if (picture.name != name) {
+            continue;
+        }
+        QVector<CachedFrame> frames { picture.lightFrame };
+        for (const CachedFrame& frame : picture.frames) {
+            if (frame.ready && frame.index != picture.lightFrame.index) {
+                frames.push_back(frame);
+            }
+        }
+        try {
+            BenchmarkDelta(frames.size(), [&](int i) {
+                const CachedFrame& frame = frames[i];
+                return frame.hash.isEmpty() ? QImage(frame.path) : cache.GetStore().LoadFrame(frame.hash);
+            });
+        } catch (const Exception& e) {
+            spdlog::error("benchmark failed: {}", e.what());
+            return 1;
+        }
+        return 0;
+    }
+    spdlog::error("picture {} not found", name.toStdString());
+    return 1;
+}
+
+// Measure reading the cached location, which the desktop keeper does on
+// every wake-up and which logs at trace level, with every logger at trace
+// level and with logging off. Trace statements only exist in Debug builds.
+int RunLogBenchmark(int iterations)
+{
+    if (SPDLOG_ACTIVE_LEVEL > SPDLOG_LEVEL_TRACE) {
+        spdlog::error("trace statements are compiled out of this build, benchmark a Debug build");
+        return 1;
+    }
+    const Cache& cache = Cache::getInstance();
+    const auto& measure = [&](const string& level) {
+        SetLogLevel("", level, false);
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < iterations; i++) {
+            cache.GetCachedLocation();
+        }
+        return static_cast<double>(timer.nsecsElapsed()) / iterations;
+    };
+    measure("off");     // warm up
+    const double enabled = measure("trace");
+    const double disabled = measure("off");
+    LoadLogLevels();
+    spdlog::info("GetCachedLocation: {:.0f} ns per call with logging at trace, {:.0f} ns with logging off",
+                 enabled, disabled);
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
+    InitLogging();
+
+    // Decode workers run this executable without a display, see decoder.h
+    if (argc > 1 && strcmp(argv[1], kDecodeWorkerOption) == 0) {
+        return RunDecodeWorker(argc, argv);
+    }
+
+    // Background tasks use singletons constructed after the scheduler, so
+    // they are stopped before static destruction on every return
+    struct SchedulerGuard {
+        ~SchedulerGuard() { Scheduler::getInstance().Shutdown(); }
+    } schedulerGuard;
+
+    Metrics::getInstance().MarkPhase("main");
     QApplication a(argc, argv);
+    LoadLogLevels();
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption hashBenchmarkOption("hash-benchmark", "Measure hash throughput on a file and exit.", "file");
+    parser.addOption(hashBenchmarkOption);
+    QCommandLineOption startupReportOption("startup-report",
+                                           "Check startup phases against budgets once the wallpaper is applied and exit.");
+    parser.addOption(startupReportOption);
+    QCommandLineOption startupBudgetOption("startup-budget", "Budgets of --startup-report, a JSON object of phase "
+                                           "name to maximum in ms.", "file");
+    parser.addOption(startupBudgetOption);
+    QCommandLineOption deltaBenchmarkOption("delta-benchmark",
+                                            "Compare delta and plain JPEG storage of a cached picture and exit.", "name");
+    parser.addOption(deltaBenchmarkOption);
+    QCommandLineOption logBenchmarkOption("log-benchmark",
+                                          "Measure a traced call with logging on and off and exit.", "iterations");
+    parser.addOption(logBenchmarkOption);
+    QCommandLineOption soakOption("soak", "Run the daemon logic on a synthetic library of pictures, "
+                                  "report latencies and resources and exit.", "pictures");
+    parser.addOption(soakOption);
+    QCommandLineOption keeperCheckOption("keeper-check", "Drive the keeper through simulated days, check that no "
+                                         "frame is missed or late and exit.", "days");
+    parser.addOption(keeperCheckOption);
+    QCommandLineOption soakHoursOption("soak-hours", "Simulated period of the soak test, 24 by default.", "hours");
+    parser.addOption(soakHoursOption);
+    QCommandLineOption soakBudgetOption("soak-budget", "Budgets of the soak test, a JSON object of metric "
+                                        "name to maximum.", "file");
+    parser.addOption(soakBudgetOption);
+    QCommandLineOption importUrlOption("import-url", "Download and import a HEIC file, then exit.", "url");
+    parser.addOption(importUrlOption);
+    QCommandLineOption exportBundleOption("export-bundle", "Package complete cache entries into a bundle and exit.",
+                                          "file");
+    parser.addOption(exportBundleOption);
+    QCommandLineOption importBundleOption("import-bundle",
+                                          "Install cache entries of a bundle for local pictures and exit.", "file");
+    parser.addOption(importBundleOption);
+    parser.process(a);
+    if (parser.isSet(hashBenchmarkOption)) {
+        BenchmarkHash(parser.value(hashBenchmarkOption));
+        return 0;
+    }
+
+    if (parser.isSet(deltaBenchmarkOption)) {
+        return RunDeltaBenchmark(parser.value(deltaBenchmarkOption));
+    }
+
+    if (parser.isSet(logBenchmarkOption)) {
+        return RunLogBenchmark(max(1, parser.value(logBenchmarkOption).toInt()));
+    }
+
+    if (parser.isSet(soakOption)) {
+        return RunSoak(max(1, parser.value(soakOption).toInt()),
+                       max(1, parser.value(soakHoursOption).isEmpty() ? 24 : parser.value(soakHoursOption).toInt()),
+                       parser.value(soakBudgetOption));
+    }
+
+    if (parser.isSet(keeperCheckOption)) {
+        return RunKeeperCheck(max(1, parser.value(keeperCheckOption).toInt()));
+    }
+
+    // Command line modes work on the cache alone, without syncs racing them
+    if (parser.isSet(importUrlOption) || parser.isSet(exportBundleOption) || parser.isSet(importBundleOption)) {
+        Cache::DisableSyncs();
+    }
+
+    if (parser.isSet(importUrlOption)) {
+        try {
+            Cache::getInstance().ImportUrl(parser.value(importUrlOption));
+        } catch (const Exception& e) {
+            spdlog::error("import failed: {}", e.what());
+            return 1;
+        }
+        return 0;
+    }
+
+    if (parser.isSet(exportBundleOption) || parser.isSet(importBundleOption)) {
+        try {
+            Cache& cache = Cache::getInstance();
+            if (parser.isSet(exportBundleOption)) {
+                cache.ExportBundle(parser.value(exportBundleOption));
+            } else {
+                cache.ImportBundle(parser.value(importBundleOption));
+            }
+        } catch (const Exception& e) {
+            spdlog::error("bundle failed: {}", e.what());
+            return 1;
+        }
+        return 0;
+    }
+
+    map<string, double> startupBudgets;
+    if (parser.isSet(startupReportOption)) {
+        try {
+            startupBudgets = LoadBudgets(parser.value(startupBudgetOption), GetDefaultStartupBudgets());
+        } catch (const Exception& e) {
+            spdlog::error("startup report failed: {}", e.what());
+            return 1;
+        }
+    }
+
     Daemon daemon;
+    if (parser.isSet(startupReportOption)) {
+        ReportStartup(startupBudgets);
+    }
     return a.exec();
 }
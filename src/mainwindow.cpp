@@ -8,14 +8,24 @@
 #include <QUrl>
 #include <QVBoxLayout>
 #include <QTimer>
-#include <QCloseEvent>
 #include <QSettings>
+#include <QPixmap>
+#include <QPointer>
 #include <chrono>
-#include <spdlog/spdlog.h>
 #include "heic.h"
+#include "log.h"
+#include "metrics.h"
 
 using namespace std;
 
+// Placeholder of pictures being imported, scaled to the gallery icon size once.
+const QIcon& GetLoadingIcon()
+{
+    static const QIcon icon(QPixmap("../assets/loading.jpg").scaled(
+                                Heic::kIconWidth, Heic::kIconHeight, Qt::IgnoreAspectRatio, Qt::SmoothTransformation));
+    return icon;
+}
+
 MainWindow::MainWindow(QWidget *parent)
     : QWidget(parent)
 {
@@ -56,7 +66,7 @@ MainWindow::MainWindow(QWidget *parent)
     // Gallery
     galleryList = new QListWidget();
     galleryList->setViewMode(QListWidget::IconMode);
-    galleryList->setIconSize(QSize(178, 178));
+    galleryList->setIconSize(QSize(Heic::kIconWidth, Heic::kIconHeight));
     galleryList->setSpacing(3);
     galleryList->setVerticalScrollBarPolicy(Qt::ScrollBarAlwaysOn);
     connect(galleryList, &QListWidget::itemClicked, this, &MainWindow::SelectPicture);
@@ -82,15 +92,17 @@ MainWindow::MainWindow(QWidget *parent)
     connect(githubButton, &QPushButton::clicked, this, &MainWindow::OpenGitHub);
     bottomLayout->addWidget(githubButton);
 
-    // Preview timer
-    QTimer *previewTimer = new QTimer(this);
+    // Preview timer, started once a picture is selected
+    previewTimer = new QTimer(this);
     connect(previewTimer, &QTimer::timeout, this, &MainWindow::PlayPreview);
-    previewTimer->start(1000);
 
     // Register callback
     Cache& cache = Cache::getInstance();
     cache.ListenOnCacheChange([this](){
-        LoadGallery();
+        QMetaObject::invokeMethod(this, [this](){ LoadGallery(); }, Qt::QueuedConnection);
+    });
+    cache.ListenOnAddProgress([this](const AddProgress& progress){
+        QMetaObject::invokeMethod(this, [this, progress](){ ShowAddProgress(progress); }, Qt::QueuedConnection);
     });
 
     MoveCenter();
@@ -99,18 +111,34 @@ MainWindow::MainWindow(QWidget *parent)
 
 MainWindow::~MainWindow()
 {
+    Cache::getInstance().ListenOnCacheChange(nullptr);
+    Cache::getInstance().ListenOnAddProgress(nullptr);
 }
 
 void MainWindow::LoadGallery()
 {
-    Cache& cache = Cache::getInstance();
-    pictures = cache.GetCachedPictures();
+    // Covers are decoded in the background, pixmaps are created on the GUI thread
+    QPointer<MainWindow> self(this);
+    Scheduler::getInstance().Post(Scheduler::Interactive, [self](){
+        const QVector<CachedPicture>& pictures = Cache::getInstance().GetCachedPictures();
+        QMetaObject::invokeMethod(qApp, [self, pictures](){
+            if (self) {
+                self->ShowGallery(pictures);
+            }
+        }, Qt::QueuedConnection);
+    });
+}
+
+void MainWindow::ShowGallery(const QVector<CachedPicture>& pictures)
+{
+    this->pictures = pictures;
     galleryList->clear();
-    for(const CachedPicture picture : pictures) {
+    for(const CachedPicture& picture : pictures) {
         QListWidgetItem *item = new QListWidgetItem();
-        item->setIcon(QIcon(picture.cover));
+        item->setIcon(QIcon(QPixmap::fromImage(picture.icon)));
         galleryList->addItem(item);
     }
+    Metrics::getInstance().MarkPhase("catalog");
 }
 
 void MainWindow::MoveCenter()
@@ -132,39 +160,44 @@ void MainWindow::AddWallpaper()
     QSettings settings;
     const QString& dir = settings.value("dir", cache.GetHomeDir()).toString();
     // Open file dialog
-    QString file1Name = QFileDialog::getOpenFileName(this, tr("Open HEIC File"), dir, tr("HEIC Files (*.heic)"));
-    if (!file1Name.isEmpty()) {
-        spdlog::info("add new wallpaper {}", file1Name.toStdString());
+    const QStringList& fileNames = QFileDialog::getOpenFileNames(this, tr("Open HEIC Files"), dir,
+                                                                 tr("HEIC Files (*.heic)"));
+    if (!fileNames.isEmpty()) {
+        GetLogger(GuiLog).info("add {} new wallpapers", fileNames.size());
         // Save default directory
-        QFileInfo fileInfo(file1Name);
-        settings.setValue("dir", fileInfo.dir().path());
-        // Copy
-        const QString& dest = cache.GetPictureDir() + "/" + fileInfo.fileName();
-        if (QFile::copy(file1Name, dest)) {
-            spdlog::info("add new wallpaper success");
-            // Refresh gallery
+        settings.setValue("dir", QFileInfo(fileNames.front()).dir().path());
+        // Copy in the background, the gallery is refreshed once they are imported
+        cache.AddPictures(fileNames);
+        for (int i = 0; i < fileNames.size(); i++) {
             QListWidgetItem *item = new QListWidgetItem();
-            item->setIcon(QIcon(QPixmap("../assets/loading.jpg").scaled(Heic::kThumbWidth, Heic::kThumbHeight)));
+            item->setIcon(GetLoadingIcon());
             galleryList->addItem(item);
-            cache.NotifyCacheSyncer();
-        } else {
-            spdlog::info("add new wallpaper failed");
         }
     }
 }
 
+void MainWindow::ShowAddProgress(const AddProgress& progress)
+{
+    if (progress.files == 0) {
+        hintLabel->setText("");
+        return;
+    }
+    const int percent = progress.bytesTotal > 0 ? static_cast<int>(progress.bytesDone * 100 / progress.bytesTotal) : 0;
+    hintLabel->setText(tr("Adding %n wallpaper(s), %1%", "", progress.files).arg(percent));
+}
+
 void MainWindow::RemoveWallpaper()
 {
     Cache& cache = Cache::getInstance();
     const QString& dest = cache.GetPictureDir() + "/" + pictures[selected].name + ".heic";
     if (QFile::remove(dest)) {
-        spdlog::info("remove wallpaper succed");
+        GetLogger(GuiLog).info("remove wallpaper succed");
         selected = -1;
         QListWidgetItem* item = galleryList->item(selected);
-        item->setIcon(QIcon(QPixmap("../assets/loading.jpg").scaled(Heic::kThumbWidth, Heic::kThumbHeight)));
+        item->setIcon(GetLoadingIcon());
         cache.NotifyCacheSyncer();
     } else {
-        spdlog::info("remove wallpaper failed");
+        GetLogger(GuiLog).info("remove wallpaper failed");
     }
 }
 
@@ -174,14 +207,15 @@ void MainWindow::SelectPicture(QListWidgetItem* item)
     const QModelIndex index = indices.front();
     play = 0;
     selected = index.row();
-    spdlog::info("picture {} selected", selected);
+    GetLogger(GuiLog).info("picture {} selected", selected);
 
     nameLabel->setText(pictures[selected].name);
+    previewTimer->start(1000);
 
     auto currentTime = chrono::system_clock::now();
     time_t tt = chrono::system_clock::to_time_t(currentTime);
     tm local_tm = *gmtime(&tt);
-    spdlog::info("H {}", local_tm.tm_hour);
+    SPDLOG_LOGGER_TRACE(&GetLogger(GuiLog), "H {}", local_tm.tm_hour);
     Time time;
     time.year = local_tm.tm_year + 1900;
     time.month = local_tm.tm_mon + 1;
@@ -191,7 +225,7 @@ void MainWindow::SelectPicture(QListWidgetItem* item)
     time.second = local_tm.tm_sec;
     Cache& cache = Cache::getInstance();
     const CachedFrame& frame = pictures[selected].GetFrame(cache.GetCachedLocation(), time);
-    imageLabel->setPixmap(frame.thumb.scaled(200, 200, Qt::KeepAspectRatio));
+    imageLabel->setPixmap(QPixmap::fromImage(frame.preview));
 
     // Set settings
     cache.SetCurrentDesktop(pictures[selected].name);
@@ -204,7 +238,7 @@ void MainWindow::PlayPreview()
         auto currentTime = chrono::system_clock::now();
         time_t tt = chrono::system_clock::to_time_t(currentTime);
         tm local_tm = *gmtime(&tt);
-        spdlog::info("H {}", local_tm.tm_hour);
+        SPDLOG_LOGGER_TRACE(&GetLogger(GuiLog), "H {}", local_tm.tm_hour);
         Time time;
         time.year = local_tm.tm_year + 1900;
         time.month = local_tm.tm_mon + 1;
@@ -214,12 +248,6 @@ void MainWindow::PlayPreview()
         time.second = local_tm.tm_sec;
         const Cache& cache = Cache::getInstance();
         const CachedFrame& frame = pictures[selected].GetFrame(cache.GetCachedLocation(), time);
-        imageLabel->setPixmap(frame.thumb.scaled(200, 200, Qt::KeepAspectRatio));
+        imageLabel->setPixmap(QPixmap::fromImage(frame.preview));
     }
 }
-
-void MainWindow::closeEvent(QCloseEvent *event)
-{
-    hide();
-    event->ignore();
-}
@@ -7,7 +7,9 @@
 #include <QLabel>
 #include <QListWidget>
 #include <QPushButton>
+#include <QTimer>
 
+// Settings window, created when opened and deleted when closed.
 class MainWindow : public QWidget
 {
     Q_OBJECT
@@ -16,6 +18,7 @@ class MainWindow : public QWidget
     QLabel *imageLabel, *nameLabel, *hintLabel;
     QListWidget *galleryList;
     QPushButton *addButton, *deleteButton, *githubButton;
+    QTimer *previewTimer;
 
     QStringList wallpapers;
 
@@ -27,13 +30,15 @@ public:
     MainWindow(QWidget *parent = nullptr);
     ~MainWindow();
 
+    // Load pictures in the background and show them once loaded.
     void LoadGallery();
+    void ShowGallery(const QVector<CachedPicture>& pictures);
     void MoveCenter();
     void AddWallpaper();
+    void ShowAddProgress(const AddProgress& progress);
     void RemoveWallpaper();
     void OpenGitHub();
     void SelectPicture(QListWidgetItem* item);
     void PlayPreview();
-    void closeEvent(QCloseEvent *event) override;
 };
 #endif // MAINWINDOW_H
@@ -0,0 +1,88 @@
+// Metrics - process-wide registry of named values.
+#include "exception.h"
+#include "metrics.h"
+
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include <spdlog/spdlog.h>
+
+using namespace std;
+
+void Metrics::Set(const string& name, double value)
+{
+    lock_guard<mutex> lock(mtx);
+    values[name] = value;
+}
+
+void Metrics::Add(const string& name, double delta)
+{
+    lock_guard<mutex> lock(mtx);
+    values[name] += delta;
+}
+
+bool Metrics::Contains(const string& name)
+{
+    lock_guard<mutex> lock(mtx);
+    return values.count(name) > 0;
+}
+
+map<string, double> Metrics::GetValues()
+{
+    lock_guard<mutex> lock(mtx);
+    return values;
+}
+
+void Metrics::MarkPhase(const string& phase)
+{
+    const double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    {
+        lock_guard<mutex> lock(mtx);
+        if (!values.emplace("startup." + phase + "_ms", elapsed).second) {
+            return;
+        }
+    }
+    spdlog::info("startup phase {} reached at {:.1f} ms", phase, elapsed);
+}
+
+map<string, double> LoadBudgets(const QString& path, map<string, double> defaults)
+{
+    if (path.isEmpty()) {
+        return defaults;
+    }
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly)) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "can't open file " + path.toStdString());
+    }
+    const QJsonObject& object = QJsonDocument::fromJson(file.readAll()).object();
+    for (auto it = object.begin(); it != object.end(); ++it) {
+        defaults[it.key().toStdString()] = it.value().toDouble();
+    }
+    return defaults;
+}
+
+bool CheckBudgets(const map<string, double>& values, const map<string, double>& budgets)
+{
+    bool passed = true;
+    for (const auto& [name, value] : values) {
+        const auto& budget = budgets.find(name);
+        if (budget == budgets.end()) {
+            spdlog::info("{} {:.1f}", name, value);
+        } else if (value <= budget->second) {
+            spdlog::info("{} {:.1f} (budget {:.1f})", name, value, budget->second);
+        } else {
+            spdlog::error("{} {:.1f} exceeds budget {:.1f}", name, value, budget->second);
+            passed = false;
+        }
+    }
+    for (const auto& [name, budget] : budgets) {
+        if (!values.count(name)) {
+            spdlog::error("{} not reached, budget {:.1f}", name, budget);
+            passed = false;
+        }
+    }
+    return passed;
+}
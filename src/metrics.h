@@ -0,0 +1,54 @@
+// Metrics - process-wide registry of named values, such as counters and
+// the time of startup phases.
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QString>
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+
+class Metrics
+{
+    std::mutex mtx;
+    std::map<std::string, double> values;
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    Metrics() = default;
+    Metrics(const Metrics& metrics) = delete;
+    Metrics(Metrics&& metrics) = delete;
+
+public:
+
+    // The first call happens at the start of main, startup phases are
+    // measured from there.
+    static Metrics& getInstance()
+    {
+        static Metrics instance;
+        return instance;
+    }
+
+    void Set(const std::string& name, double value);
+
+    void Add(const std::string& name, double delta);
+
+    bool Contains(const std::string& name);
+
+    std::map<std::string, double> GetValues();
+
+    // Record milliseconds since start as "startup.<phase>_ms". Only the
+    // first time a phase is reached is recorded.
+    void MarkPhase(const std::string& phase);
+};
+
+// Budgets of metrics, the maximum of each value by name. A JSON object of
+// name to maximum in the file at path replaces defaults per name, no file
+// is read if path is empty. Throws if the file can't be read.
+std::map<std::string, double> LoadBudgets(const QString& path, std::map<std::string, double> defaults);
+
+// Log values against budgets, return whether all budgets are met.
+bool CheckBudgets(const std::map<std::string, double>& values, const std::map<std::string, double>& budgets);
+
+#endif // METRICS_H
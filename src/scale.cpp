@@ -0,0 +1,102 @@
+// Scale - downscale images with an area-averaging filter into pooled images.
+#include "bufferpool.h"
+#include "scale.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+
+QRectF GetCropRect(int srcWidth, int srcHeight, int width, int height)
+{
+    double ratio = static_cast<double>(height) / width;
+    double imgRatio = static_cast<double>(srcHeight) / srcWidth;
+    if (imgRatio < ratio) {
+        // Crop left and right
+        double cropWidth = srcHeight / ratio;
+        return QRectF((srcWidth - cropWidth) / 2, 0, cropWidth, srcHeight);
+    }
+    // Crop top and bottom
+    double cropHeight = srcWidth * ratio;
+    return QRectF(0, (srcHeight - cropHeight) / 2, srcWidth, cropHeight);
+}
+
+// Source pixels covered by an output pixel and their normalized weights.
+struct Taps
+{
+    int first;
+    vector<float> weights;
+};
+
+vector<Taps> GetTaps(double begin, double length, int count, int limit)
+{
+    const double scale = length / count;
+    vector<Taps> taps(count);
+    for (int i = 0; i < count; i++) {
+        const double low = clamp(begin + i * scale, 0.0, static_cast<double>(limit));
+        const double high = clamp(begin + (i + 1) * scale, low, static_cast<double>(limit));
+        const int first = min(static_cast<int>(floor(low)), limit - 1);
+        const int last = max(first, min(static_cast<int>(ceil(high)) - 1, limit - 1));
+        taps[i].first = first;
+        double total = 0;
+        for (int s = first; s <= last; s++) {
+            const double weight = max(min(high, s + 1.0) - max(low, static_cast<double>(s)), 0.0);
+            taps[i].weights.push_back(weight);
+            total += weight;
+        }
+        for (float& weight : taps[i].weights) {
+            // Sources narrower than a pixel take the nearest pixel
+            weight = total > 0 ? weight / total : 1.0f / taps[i].weights.size();
+        }
+    }
+    return taps;
+}
+
+QImage ScaleImage(const QImage& image, const QRectF& source, int width, int height)
+{
+    const QImage::Format format = image.format();
+    if (format != QImage::Format_Grayscale8 && format != QImage::Format_RGB888
+            && format != QImage::Format_RGB32 && format != QImage::Format_ARGB32) {
+        return ScaleImage(image.convertToFormat(QImage::Format_RGB32), source, width, height);
+    }
+    const int channels = image.depth() / 8;
+    const vector<Taps>& xTaps = GetTaps(source.left(), source.width(), width, image.width());
+    const vector<Taps>& yTaps = GetTaps(source.top(), source.height(), height, image.height());
+
+    // Filter source rows horizontally, then accumulate them vertically
+    QImage scaled = BufferPool::getInstance().AllocateImage(width, height, format);
+    vector<float> row(static_cast<size_t>(width) * channels);
+    vector<float> sums(row.size());
+    for (int y = 0; y < height; y++) {
+        fill(sums.begin(), sums.end(), 0.0f);
+        for (size_t ty = 0; ty < yTaps[y].weights.size(); ty++) {
+            const uchar* line = image.constScanLine(yTaps[y].first + static_cast<int>(ty));
+            for (int x = 0; x < width; x++) {
+                float* pixel = &row[static_cast<size_t>(x) * channels];
+                fill(pixel, pixel + channels, 0.0f);
+                const uchar* in = line + static_cast<size_t>(xTaps[x].first) * channels;
+                for (float weight : xTaps[x].weights) {
+                    for (int c = 0; c < channels; c++) {
+                        pixel[c] += weight * in[c];
+                    }
+                    in += channels;
+                }
+            }
+            const float weight = yTaps[y].weights[ty];
+            for (size_t i = 0; i < sums.size(); i++) {
+                sums[i] += weight * row[i];
+            }
+        }
+        uchar* out = scaled.scanLine(y);
+        for (size_t i = 0; i < sums.size(); i++) {
+            out[i] = static_cast<uchar>(clamp(sums[i] + 0.5f, 0.0f, 255.0f));
+        }
+    }
+    return scaled;
+}
+
+QImage CropImage(const QImage& image, int width, int height)
+{
+    return ScaleImage(image, GetCropRect(image.width(), image.height(), width, height), width, height);
+}
@@ -0,0 +1,20 @@
+// Scale - downscale images with an area-averaging filter into pooled images.
+#ifndef SCALE_H
+#define SCALE_H
+
+#include <QImage>
+#include <QRectF>
+
+// Source region of an image of size srcWidth x srcHeight, which scaled to
+// width x height fills it while keeping the aspect ratio.
+QRectF GetCropRect(int srcWidth, int srcHeight, int width, int height);
+
+// Scale a source region to width x height. Each output pixel averages the
+// source area it covers, weighting partly covered pixels. Grayscale8,
+// RGB888 and 32-bit images keep their format, others are converted to RGB32.
+QImage ScaleImage(const QImage& image, const QRectF& source, int width, int height);
+
+// Scale and crop to width x height, keeping the aspect ratio.
+QImage CropImage(const QImage& image, int width, int height);
+
+#endif // SCALE_H
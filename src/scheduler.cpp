@@ -0,0 +1,210 @@
+// Scheduler - run background tasks on a bounded set of workers.
+#include "exception.h"
+#include "scheduler.h"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <exception>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#ifdef __linux__
+// ioprio_set(2) has no glibc wrapper.
+constexpr int kIoprioWhoProcess = 1;
+constexpr int kIoprioClassShift = 13;
+constexpr int kIoprioClassBestEffort = 2;
+constexpr int kIoprioClassIdle = 3;
+#endif
+
+// Lower CPU and IO priority of the calling worker thread.
+void SetWorkerPriority(Scheduler::Priority priority)
+{
+#ifdef __linux__
+    const pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+    if (priority == Scheduler::Normal) {
+        setpriority(PRIO_PROCESS, tid, 10);
+        syscall(SYS_ioprio_set, kIoprioWhoProcess, tid, (kIoprioClassBestEffort << kIoprioClassShift) | 7);
+    } else if (priority == Scheduler::Idle) {
+        sched_param param {};
+        if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+            setpriority(PRIO_PROCESS, tid, 19);
+        }
+        syscall(SYS_ioprio_set, kIoprioWhoProcess, tid, kIoprioClassIdle << kIoprioClassShift);
+    }
+#else
+    (void) priority;
+#endif
+}
+
+Scheduler::Scheduler()
+{
+    const int normalWorkers = clamp(static_cast<int>(thread::hardware_concurrency()) / 2, 1, kMaxNormalWorkers);
+    workerCounts[Interactive] = kInteractiveWorkers;
+    workerCounts[Normal] = normalWorkers;
+    workerCounts[Idle] = kIdleWorkers;
+    for (int i = 0; i < kInteractiveWorkers; i++) {
+        workers.emplace_back(&Scheduler::Work, this, Interactive);
+    }
+    for (int i = 0; i < normalWorkers; i++) {
+        workers.emplace_back(&Scheduler::Work, this, Normal);
+    }
+    for (int i = 0; i < kIdleWorkers; i++) {
+        workers.emplace_back(&Scheduler::Work, this, Idle);
+    }
+    spdlog::info("scheduler started with {} workers", workers.size());
+}
+
+Scheduler::~Scheduler()
+{
+    Shutdown();
+}
+
+void Scheduler::Work(Priority priority)
+{
+    SetWorkerPriority(priority);
+    unique_lock<mutex> lock(mtx);
+    while (!isTerminated) {
+        // Move due timers to queues
+        const auto now = chrono::steady_clock::now();
+        bool promoted = false;
+        while (!timers.empty() && timers.begin()->first <= now) {
+            queues[timers.begin()->second.priority].push_back(move(timers.begin()->second));
+            timers.erase(timers.begin());
+            promoted = true;
+        }
+        if (promoted) {
+            cond.notify_all();
+        }
+
+        // Wait for jobs
+        deque<Job>& queue = queues[priority];
+        if (queue.empty()) {
+            if (timers.empty()) {
+                cond.wait(lock);
+            } else {
+                cond.wait_until(lock, timers.begin()->first);
+            }
+            continue;
+        }
+
+        // Run job
+        Job job = move(queue.front());
+        queue.pop_front();
+        if (job.token.IsCancelled()) {
+            continue;
+        }
+        lock.unlock();
+        try {
+            job.task();
+        } catch (const Exception& e) {
+            spdlog::error("background task failed: {}", e.what());
+        } catch (const exception& e) {
+            spdlog::error("background task failed: {}", e.what());
+        } catch (...) {
+            // An exception escaping here would terminate the process
+            spdlog::error("background task failed with an unknown exception");
+        }
+        lock.lock();
+    }
+}
+
+void Scheduler::Post(Priority priority, Task task, CancellationToken token)
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        if (isTerminated) {
+            return;
+        }
+        queues[priority].push_back(Job{priority, move(task), token});
+    }
+    cond.notify_all();
+}
+
+void Scheduler::PostDelayed(Priority priority, chrono::milliseconds delay, Task task, CancellationToken token)
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        if (isTerminated) {
+            return;
+        }
+        timers.emplace(chrono::steady_clock::now() + delay, Job{priority, move(task), token});
+    }
+    cond.notify_all();
+}
+
+void Scheduler::ParallelFor(Priority priority, int count, const function<void(int)>& body, int maxHelpers)
+{
+    if (count <= 0) {
+        return;
+    }
+    struct State
+    {
+        atomic<int> next = 0;
+        mutex mtx;
+        condition_variable cond;
+        int done = 0;
+        exception_ptr error;
+    };
+    auto state = make_shared<State>();
+
+    // Claim indices until none is left. A helper starting after the caller
+    // returned claims nothing, so body is never called after it is gone.
+    const function<void(int)>* bodyPtr = &body;
+    auto run = [state, bodyPtr, count]() {
+        for (int i = state->next++; i < count; i = state->next++) {
+            exception_ptr error;
+            try {
+                (*bodyPtr)(i);
+            } catch (...) {
+                error = current_exception();
+            }
+            lock_guard<mutex> lock(state->mtx);
+            if (error && !state->error) {
+                state->error = error;
+            }
+            if (++state->done == count) {
+                state->cond.notify_all();
+            }
+        }
+    };
+    const int helpers = min({ count - 1, workerCounts[priority], maxHelpers });
+    for (int i = 0; i < helpers; i++) {
+        Post(priority, run);
+    }
+    run();
+
+    unique_lock<mutex> lock(state->mtx);
+    state->cond.wait(lock, [&]() { return state->done == count; });
+    if (state->error) {
+        rethrow_exception(state->error);
+    }
+}
+
+void Scheduler::Shutdown()
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        if (isTerminated) {
+            return;
+        }
+        isTerminated = true;
+        for (deque<Job>& queue : queues) {
+            queue.clear();
+        }
+        timers.clear();
+    }
+    cond.notify_all();
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    spdlog::info("scheduler exit");
+}
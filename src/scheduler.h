@@ -0,0 +1,96 @@
+// Scheduler - run background tasks on a bounded set of workers. Tasks are
+// posted with a priority class:
+// 1. Interactive: apply wallpaper, preview.
+// 2. Normal: import, sync.
+// 3. Idle: integrity checks, eviction. Workers run with the lowest CPU and
+//    IO priority, so they never compete with foreground work.
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class CancellationToken
+{
+    std::shared_ptr<std::atomic<bool>> cancelled = std::make_shared<std::atomic<bool>>(false);
+
+public:
+    void Cancel() const { *cancelled = true; }
+    bool IsCancelled() const { return *cancelled; }
+};
+
+class Scheduler
+{
+public:
+    enum Priority {
+        Interactive,
+        Normal,
+        Idle,
+        kPriorityCount
+    };
+
+    using Task = std::function<void(void)>;
+
+private:
+    static constexpr int kInteractiveWorkers = 1;
+    static constexpr int kMaxNormalWorkers = 4;
+    static constexpr int kIdleWorkers = 1;
+
+    struct Job
+    {
+        Priority priority;
+        Task task;
+        CancellationToken token;
+    };
+
+    std::mutex mtx;
+    std::condition_variable cond;
+    bool isTerminated = false;
+    std::deque<Job> queues[kPriorityCount];
+    std::multimap<std::chrono::steady_clock::time_point, Job> timers;
+    std::vector<std::thread> workers;
+    int workerCounts[kPriorityCount] = {};
+
+    void Work(Priority priority);
+
+    Scheduler();
+    ~Scheduler();
+    Scheduler(const Scheduler& scheduler) = delete;
+    Scheduler(Scheduler&& scheduler) = delete;
+
+public:
+
+    static Scheduler& getInstance()
+    {
+        static Scheduler instance;
+        return instance;
+    }
+
+    // Post a task. It is skipped if the token is cancelled before it starts.
+    void Post(Priority priority, Task task, CancellationToken token = CancellationToken());
+
+    // Post a task after a delay.
+    void PostDelayed(Priority priority, std::chrono::milliseconds delay, Task task,
+                     CancellationToken token = CancellationToken());
+
+    // Run body(0) ... body(count - 1) on the calling thread and at most
+    // maxHelpers workers of a priority class, return once all are done. The
+    // caller takes part, so it never waits for busy workers. The first
+    // exception thrown by body is rethrown.
+    void ParallelFor(Priority priority, int count, const std::function<void(int)>& body,
+                     int maxHelpers = INT_MAX);
+
+    // Drop pending tasks and wait for running tasks to finish.
+    void Shutdown();
+};
+
+#endif // SCHEDULER_H
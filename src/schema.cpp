@@ -0,0 +1,94 @@
+// Schema - version of the cache layout and build parameters of artifacts.
+#include "heic.h"
+#include "jpeg.h"
+#include "schema.h"
+
+#include <QFile>
+#include <QJsonDocument>
+
+using namespace std;
+
+// Renditions are scaled by an area-averaging filter from their source.
+QJsonObject GetRenditionParams(int width, int height, const QString& source)
+{
+    return QJsonObject {
+        { "width", width },
+        { "height", height },
+        { "quality", kJpegQuality },
+        { "filter", "area" },
+        { "source", source },
+    };
+}
+
+QJsonObject GetBuildParams()
+{
+    return QJsonObject {
+        { kFrameArtifact, QJsonObject { { "quality", kJpegQuality }, { "key", "yuv420" } } },
+        { kConfigArtifact, QJsonObject { { "version", kConfigVersion } } },
+        { kThumbArtifact, GetRenditionParams(Heic::kThumbWidth, Heic::kThumbHeight, kFrameArtifact) },
+        { kPreviewArtifact, GetRenditionParams(Heic::kPreviewWidth, Heic::kPreviewHeight, kThumbArtifact) },
+        { kCoverArtifact, GetRenditionParams(Heic::kThumbWidth, Heic::kThumbHeight, kThumbArtifact) },
+        { kIconArtifact, GetRenditionParams(Heic::kIconWidth, Heic::kIconHeight, kCoverArtifact) },
+    };
+}
+
+EntrySchema EntrySchema::GetCurrent()
+{
+    EntrySchema schema;
+    schema.version = kSchemaVersion;
+    schema.artifacts = GetBuildParams();
+    return schema;
+}
+
+QStringList EntrySchema::GetStaleArtifacts() const
+{
+    QStringList stale;
+    const QJsonObject& current = GetBuildParams();
+    for (auto it = current.begin(); it != current.end(); ++it) {
+        if (artifacts.value(it.key()) != it.value()) {
+            stale.append(it.key());
+        }
+    }
+    return stale;
+}
+
+void EntrySchema::Update(const QString& artifact)
+{
+    artifacts.insert(artifact, GetBuildParams().value(artifact));
+}
+
+EntrySchema ParseSchema(const QByteArray& data)
+{
+    EntrySchema schema;
+    const QJsonObject& object = QJsonDocument::fromJson(data).object();
+    schema.version = object.value("version").toInt();
+    schema.artifacts = object.value("artifacts").toObject();
+    return schema;
+}
+
+EntrySchema LoadSchema(const QString& path)
+{
+    QFile schemaFile(path + "/schema.json");
+    if (schemaFile.open(QFile::ReadOnly)) {
+        const EntrySchema& schema = ParseSchema(schemaFile.readAll());
+        if (schema.version > 0) {
+            return schema;
+        }
+    }
+    EntrySchema schema;
+    // Config has not changed since manifests were introduced, frames were
+    // keyed by RGB pixels then
+    if (QFile::exists(path + "/manifest")) {
+        schema.Update(kConfigArtifact);
+    }
+    return schema;
+}
+
+QByteArray SerializeSchema(const EntrySchema& schema)
+{
+    const QJsonObject object {
+        { "version", schema.version },
+        { "artifacts", schema.artifacts },
+    };
+    return QJsonDocument(object).toJson();
+}
@@ -0,0 +1,55 @@
+// Schema - version of the cache layout and build parameters of artifacts.
+// Each cache entry records them in schema.json:
+//   {"version": 1, "artifacts": {"thumb": {"width": 480, ...}, ...}}
+// Parameters of an artifact are compared as a whole, so any change of its
+// size, filter or encoder settings marks it stale. Stale renditions are
+// regenerated from cached files, stale frames and configs need the HEIC.
+#ifndef SCHEMA_H
+#define SCHEMA_H
+
+#include <QJsonObject>
+#include <QString>
+#include <QStringList>
+
+constexpr int kSchemaVersion = 2;   // layout of cache entries, 2 keys frames by YCbCr planes
+constexpr int kConfigVersion = 1;   // format of config.json
+
+// Artifacts of a cache entry. Frames, thumbnails and previews are blobs
+// in the frame store, the others are files of the entry.
+constexpr char kFrameArtifact[] = "frame";
+constexpr char kConfigArtifact[] = "config";
+constexpr char kThumbArtifact[] = "thumb";
+constexpr char kPreviewArtifact[] = "preview";
+constexpr char kCoverArtifact[] = "cover";
+constexpr char kIconArtifact[] = "icon";
+
+// Build parameters of artifacts written by this version.
+QJsonObject GetBuildParams();
+
+struct EntrySchema
+{
+    int version = 0;        // 0 if written before schemas were recorded
+    QJsonObject artifacts;  // build parameters of each artifact
+
+    // Schema of entries written by this version.
+    static EntrySchema GetCurrent();
+
+    // Artifacts whose build parameters differ from the current ones.
+    QStringList GetStaleArtifacts() const;
+
+    // Record current build parameters of an artifact.
+    void Update(const QString& artifact);
+};
+
+// Parse the content of schema.json, the version is 0 if it is invalid.
+EntrySchema ParseSchema(const QByteArray& data);
+
+// Load the schema of an entry. Entries without one are inferred: frames
+// and config of entries with a manifest are current, other artifacts are
+// unknown, so they are regenerated.
+EntrySchema LoadSchema(const QString& path);
+
+// Encode a schema as the content of schema.json.
+QByteArray SerializeSchema(const EntrySchema& schema);
+
+#endif // SCHEMA_H
@@ -0,0 +1,276 @@
+// Control Server - opt-in HTTP API on localhost for local agents.
+#include "cache.h"
+#include "clock.h"
+#include "exception.h"
+#include "log.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "server.h"
+
+#include <QCryptographicHash>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSettings>
+
+#include <httplib.h>
+
+using namespace std;
+
+void SetJson(httplib::Response& res, const QJsonDocument& document)
+{
+    res.set_content(document.toJson(QJsonDocument::Compact).toStdString(), "application/json");
+}
+
+void SetError(httplib::Response& res, int status, const string& message)
+{
+    res.status = status;
+    SetJson(res, QJsonDocument(QJsonObject{ { "error", QString::fromStdString(message) } }));
+}
+
+// Set ETag, return true if the client has the same version.
+bool CheckTag(const httplib::Request& req, httplib::Response& res, const string& tag)
+{
+    const string quoted = "\"" + tag + "\"";
+    res.set_header("ETag", quoted);
+    const string& match = req.get_header_value("If-None-Match");
+    if (match == "*" || match.find(quoted) != string::npos) {
+        res.status = 304;
+        return true;
+    }
+    return false;
+}
+
+// Serve a blob of the frame store. Blobs never change, the file is mapped
+// and written to the socket from the mapping.
+void ServeBlob(const httplib::Request& req, httplib::Response& res, const QString& path, const string& hash)
+{
+    res.set_header("Cache-Control", "max-age=31536000, immutable");
+    if (CheckTag(req, res, hash)) {
+        return;
+    }
+    auto file = make_shared<QFile>(path);
+    const uchar* data = nullptr;
+    if (file->open(QFile::ReadOnly) && file->size() > 0) {
+        data = file->map(0, file->size());
+    }
+    if (data == nullptr) {
+        SetError(res, 404, "blob not found");
+        return;
+    }
+    res.set_content_provider(static_cast<size_t>(file->size()), "image/jpeg",
+                             [file, data](size_t offset, size_t length, httplib::DataSink& sink) {
+        return sink.write(reinterpret_cast<const char*>(data) + offset, length);
+    });
+}
+
+QJsonObject ToJson(const CachedFrame& frame)
+{
+    return QJsonObject {
+        { "index", frame.index },
+        { "ready", frame.ready },
+        { "altitude", frame.altitude },
+        { "azimuth", frame.azimuth },
+        { "hash", frame.ready ? frame.hash : QString() },
+    };
+}
+
+ControlServer::ControlServer(): server(make_unique<httplib::Server>())
+{
+    server->new_task_queue = []() { return new httplib::ThreadPool(kThreads); };
+
+    // Only browsers send other hosts to localhost, reject them to prevent
+    // pages from driving the API by DNS rebinding
+    server->set_pre_routing_handler([](const httplib::Request& req, httplib::Response& res) {
+        const string& host = req.get_header_value("Host");
+        const string& name = host.substr(0, host.rfind(':'));
+        if (name != "127.0.0.1" && name != "localhost") {
+            SetError(res, 403, "forbidden host");
+            return httplib::Server::HandlerResponse::Handled;
+        }
+        return httplib::Server::HandlerResponse::Unhandled;
+    });
+    server->set_logger([](const httplib::Request&, const httplib::Response& res) {
+        Metrics& metrics = Metrics::getInstance();
+        metrics.Add("server.requests", 1);
+        if (res.status == 304) {
+            metrics.Add("server.not_modified", 1);
+        } else if (res.status >= 400) {
+            metrics.Add("server.errors", 1);
+        }
+    });
+
+    server->Get("/catalog", [this](const httplib::Request& req, httplib::Response& res) {
+        try {
+            QByteArray json;
+            string tag;
+            GetCatalog(json, tag);
+            if (!CheckTag(req, res, tag)) {
+                res.set_content(json.toStdString(), "application/json");
+            }
+        } catch (const Exception& e) {
+            SetError(res, 500, e.what());
+        }
+    });
+
+    server->Get("/current", [](const httplib::Request&, httplib::Response& res) {
+        try {
+            Cache& cache = Cache::getInstance();
+            const optional<CachedPicture>& picture = cache.GetCurrentDesktop();
+            if (!picture.has_value()) {
+                SetJson(res, QJsonDocument(QJsonObject{ { "name", QJsonValue::Null } }));
+                return;
+            }
+            const CachedFrame& frame = picture.value().GetFrame(cache.GetCachedLocation(),
+                                                                ToTime(SystemClock::getInstance().Now()));
+            SetJson(res, QJsonDocument(QJsonObject{ { "name", picture.value().name }, { "frame", ToJson(frame) } }));
+        } catch (const Exception& e) {
+            SetError(res, 500, e.what());
+        }
+    });
+
+    server->Get("/state", [](const httplib::Request&, httplib::Response& res) {
+        QSettings settings;
+        const CachedLocation& location = Cache::getInstance().GetCachedLocation();
+        SetJson(res, QJsonDocument(QJsonObject {
+            { "wallpaper", settings.value("wallpaper", "").toString() },
+            { "applied", settings.value("lastWallpaper", "").toString() },
+            { "latitude", location.latitude },
+            { "longitude", location.longitude },
+        }));
+    });
+
+    server->Get("/metrics", [](const httplib::Request&, httplib::Response& res) {
+        QJsonObject object;
+        for (const auto& [name, value] : Metrics::getInstance().GetValues()) {
+            object.insert(QString::fromStdString(name), value);
+        }
+        SetJson(res, QJsonDocument(object));
+    });
+
+    server->Get("/log", [](const httplib::Request&, httplib::Response& res) {
+        QJsonObject object;
+        for (const auto& [name, level] : GetLogLevels()) {
+            object.insert(QString::fromStdString(name), QString::fromStdString(level));
+        }
+        SetJson(res, QJsonDocument(object));
+    });
+
+    server->Get(R"(/(frames|thumbs|previews)/([0-9a-f]{40}))", [](const httplib::Request& req, httplib::Response& res) {
+        const Cache& cache = Cache::getInstance();
+        const FrameStore& store = cache.GetStore();
+        const QString& hash = QString::fromStdString(req.matches[2]);
+        QString path;
+        try {
+            // Frames stored as deltas are reconstructed first
+            path = req.matches[1] == "frames" ? cache.MaterializeFrame(hash)
+                    : req.matches[1] == "thumbs" ? store.GetThumbPath(hash) : store.GetPreviewPath(hash);
+        } catch (const Exception& e) {
+            SetError(res, 500, e.what());
+            return;
+        }
+        ServeBlob(req, res, path, req.matches[1].str() + "-" + req.matches[2].str());
+    });
+
+    server->Post("/wallpaper", [](const httplib::Request& req, httplib::Response& res) {
+        const QString& name = QJsonDocument::fromJson(QByteArray::fromStdString(req.body))
+                .object().value("name").toString();
+        try {
+            Cache::getInstance().SetCurrentDesktop(name);
+            SetJson(res, QJsonDocument(QJsonObject{ { "name", name } }));
+        } catch (const Exception& e) {
+            SetError(res, 404, e.what());
+        }
+    });
+
+    server->Post("/log", [](const httplib::Request& req, httplib::Response& res) {
+        const QJsonObject& body = QJsonDocument::fromJson(QByteArray::fromStdString(req.body)).object();
+        const string& name = body.value("logger").toString().toStdString();
+        const string& level = body.value("level").toString().toStdString();
+        if (!SetLogLevel(name, level, true)) {
+            SetError(res, 400, "unknown logger or level");
+            return;
+        }
+        GetLogger(ServerLog).info("log level of {} set to {}", name.empty() ? "all loggers" : name, level);
+        SetJson(res, QJsonDocument(QJsonObject{ { "logger", QString::fromStdString(name) },
+                                                { "level", QString::fromStdString(level) } }));
+    });
+
+    server->Post("/import", [](const httplib::Request& req, httplib::Response& res) {
+        Cache& cache = Cache::getInstance();
+        const QJsonObject& body = QJsonDocument::fromJson(QByteArray::fromStdString(req.body)).object();
+        if (body.contains("url")) {
+            const QString& url = body.value("url").toString();
+            Scheduler::getInstance().Post(Scheduler::Normal, [url]() {
+                Cache::getInstance().ImportUrl(url);
+            });
+            GetLogger(ServerLog).info("import {} requested", url.toStdString());
+            res.status = 202;
+            SetJson(res, QJsonDocument(QJsonObject{ { "accepted", true } }));
+            return;
+        }
+        if (!req.body.empty()) {
+            const QString& path = body.value("path").toString();
+            const QFileInfo fileInfo(path);
+            if (!fileInfo.isFile() || fileInfo.suffix().toLower() != "heic") {
+                SetError(res, 400, "path is not a HEIC file");
+                return;
+            }
+            // Copied in the background like files added in the settings
+            // window, the cache syncs once the copy completes
+            if (!QFile::exists(cache.GetPictureDir() + "/" + fileInfo.fileName())) {
+                cache.AddPictures({ path });
+            }
+            GetLogger(ServerLog).info("import {} requested", path.toStdString());
+        }
+        cache.NotifyCacheSyncer();
+        res.status = 202;
+        SetJson(res, QJsonDocument(QJsonObject{ { "accepted", true } }));
+    });
+}
+
+ControlServer::~ControlServer()
+{
+    Stop();
+}
+
+void ControlServer::GetCatalog(QByteArray& json, string& tag)
+{
+    lock_guard<mutex> lock(catalogMutex);
+    const auto now = chrono::steady_clock::now();
+    if (catalog.isEmpty() || now - catalogTime > kCatalogLifetime) {
+        QJsonArray pictures;
+        for (const CachedPicture& picture : Cache::getInstance().GetCachedPictures(false)) {
+            QJsonArray frames;
+            for (const CachedFrame& frame : picture.frames) {
+                frames.append(ToJson(frame));
+            }
+            pictures.append(QJsonObject{ { "name", picture.name }, { "frames", frames } });
+        }
+        catalog = QJsonDocument(pictures).toJson(QJsonDocument::Compact);
+        catalogTag = QCryptographicHash::hash(catalog, QCryptographicHash::Sha1).toHex().toStdString();
+        catalogTime = now;
+    }
+    json = catalog;
+    tag = catalogTag;
+}
+
+void ControlServer::Start(int port)
+{
+    if (!server->bind_to_port("127.0.0.1", port)) {
+        GetLogger(ServerLog).error("control server can't bind to port {}", port);
+        return;
+    }
+    thread = std::thread([this]() { server->listen_after_bind(); });
+    GetLogger(ServerLog).info("control server listening on 127.0.0.1:{}", port);
+}
+
+void ControlServer::Stop()
+{
+    server->stop();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
@@ -0,0 +1,60 @@
+// Control Server - opt-in HTTP API on localhost for local agents. Enabled
+// by server/enabled, listening on server/port.
+//   GET  /catalog          pictures and their frames
+//   GET  /current          current picture and frame
+//   GET  /state            selected and applied wallpaper, location
+//   GET  /metrics          values of the metrics registry
+//   GET  /log              levels of loggers
+//   GET  /frames/<hash>    frame from the store
+//   GET  /thumbs/<hash>    thumbnail from the store
+//   GET  /previews/<hash>  preview from the store
+//   POST /wallpaper        select a picture, body {"name": ...}
+//   POST /log              set a log level, body {"logger": ..., "level": ...},
+//                          all loggers if logger is omitted
+//   POST /import           add a HEIC file and sync, body {"path": ...},
+//                          download and import, body {"url": ...},
+//                          sync only if the body is empty
+// Responses of blobs and the catalog carry ETags, so polling clients get
+// 304 Not Modified without a body.
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <QByteArray>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace httplib {
+class Server;
+}
+
+class ControlServer
+{
+    static constexpr int kThreads = 8;
+    static constexpr std::chrono::seconds kCatalogLifetime { 2 };
+
+    std::unique_ptr<httplib::Server> server;
+    std::thread thread;
+
+    // Serialized catalog, rebuilt once expired.
+    std::mutex catalogMutex;
+    QByteArray catalog;
+    std::string catalogTag;
+    std::chrono::steady_clock::time_point catalogTime;
+
+    void GetCatalog(QByteArray& json, std::string& tag);
+
+public:
+    ControlServer();
+    ~ControlServer();
+
+    // Listen on 127.0.0.1 in a background thread.
+    void Start(int port);
+
+    void Stop();
+};
+
+#endif // SERVER_H
@@ -0,0 +1,358 @@
+// Soak - headless tests of the daemon logic on synthetic pictures.
+#include "soak.h"
+#include "cache.h"
+#include "clock.h"
+#include "daemon.h"
+#include "exception.h"
+#include "hash.h"
+#include "heic.h"
+#include "log.h"
+#include "metrics.h"
+#include "scale.h"
+#include "schema.h"
+#include "solar.h"
+#include "store.h"
+
+#include <QColor>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSettings>
+#include <QTemporaryDir>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+constexpr int kFramesPerPicture = 16;
+constexpr int kPictureSize = 4096;                  // bytes of each synthetic source file
+constexpr chrono::minutes kSyncInterval { 10 };
+constexpr chrono::hours kGalleryInterval { 1 };     // the settings window is opened and the picture switched
+constexpr int kSelectStride = 997;                  // pictures skipped between switches
+constexpr double kPercentiles[] = { 50, 95, 99 };
+constexpr time_t kCheckStart = 1609459200;          // 2021-01-01 00:00 UTC
+constexpr chrono::seconds kCheckTolerance = 2 * kKeeperStep;
+
+// Defaults, replaced per metric by the budget file.
+const map<string, double>& GetDefaultBudgets()
+{
+    static const map<string, double> budgets {
+        { "startup_ms", 5000 },
+        { "keeper.p99_ms", 250 },
+        { "sync.p99_ms", 5000 },
+        { "gallery.p99_ms", 20000 },
+        { "select.p99_ms", 1000 },
+        { "rss.peak_mb", 1024 },
+        { "rss.growth_mb", 64 },
+    };
+    return budgets;
+}
+
+void WriteFile(const QString& path, const QByteArray& data)
+{
+    QFile file(path);
+    if (!file.open(QFile::WriteOnly) || file.write(data) != data.size()) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "can't write file " + path.toStdString());
+    }
+}
+
+// Sun position of a synthetic frame, frames cover a day.
+SolarSample GetFramePosition(int index)
+{
+    return SolarSample {
+        -60 * cos(2 * M_PI * index / kFramesPerPicture),
+        360.0 * index / kFramesPerPicture,
+    };
+}
+
+QString GetPictureName(int index)
+{
+    return QString("soak-%1").arg(index, 5, 10, QChar('0'));
+}
+
+// Store frames shared by all pictures, the store keeps one copy of each as
+// it does for wallpapers sharing frames. Sun positions cover a day.
+QJsonArray GenerateFrames(const FrameStore& store, QStringList& hashes)
+{
+    QJsonArray frames;
+    for (int i = 0; i < kFramesPerPicture; i++) {
+        QImage image(Heic::kThumbWidth, Heic::kThumbHeight, QImage::Format_RGB32);
+        image.fill(QColor::fromHsv(i * 360 / kFramesPerPicture, 128, 192));
+        const QString& hash = FrameStore::Hash(image);
+        store.Put(hash, image, image, CropImage(image, Heic::kPreviewWidth, Heic::kPreviewHeight));
+        hashes.push_back(hash);
+        const SolarSample& position = GetFramePosition(i);
+        frames.push_back(QJsonObject {
+            { "i", i },
+            { "z", position.azimuth },
+            { "a", position.altitude },
+        });
+    }
+    return frames;
+}
+
+// Write pictures and their complete cache entries. Sources are small files
+// of unique content, sync hashes them but never decodes them.
+void GenerateLibrary(const QString& homePath, int pictures)
+{
+    const QString& rootPath = homePath + "/ddesktop";
+    const QDir& rootDir = QDir::root();
+    rootDir.mkpath(rootPath + "/pictures");
+    rootDir.mkpath(rootPath + "/cache");
+    rootDir.mkpath(rootPath + "/store");
+
+    const FrameStore store(rootPath + "/store");
+    QStringList hashes;
+    const QJsonArray& frames = GenerateFrames(store, hashes);
+    QByteArray manifest;
+    for (int i = 0; i < hashes.size(); i++) {
+        manifest += QString("%1 %2\n").arg(i).arg(hashes.at(i)).toUtf8();
+    }
+    manifest += "end\n";
+    const QByteArray& schema = SerializeSchema(EntrySchema::GetCurrent());
+    QImage cover(Heic::kThumbWidth, Heic::kThumbHeight, QImage::Format_RGB32);
+    cover.fill(Qt::darkBlue);
+    const QByteArray& coverData = EncodeImage(cover);
+    const QByteArray& iconData = EncodeImage(CropImage(cover, Heic::kIconWidth, Heic::kIconHeight));
+
+    for (int i = 0; i < pictures; i++) {
+        const QString& name = GetPictureName(i);
+        const QString& picturePath = rootPath + "/pictures/" + name + ".heic";
+        WriteFile(picturePath, name.toUtf8().leftJustified(kPictureSize, '\0'));
+        const QString& entryPath = rootPath + "/cache/" + HashFile(picturePath);
+        rootDir.mkpath(entryPath);
+        const QJsonObject config {
+            { "name", name },
+            { "ap", QJsonObject { { "l", kFramesPerPicture / 2 }, { "d", 0 } } },
+            { "si", frames },
+        };
+        WriteFile(entryPath + "/config.json", QJsonDocument(config).toJson());
+        WriteFile(entryPath + "/cover_icon.jpg", iconData);
+        WriteFile(entryPath + "/cover.jpg", coverData);
+        WriteFile(entryPath + "/schema.json", schema);
+        WriteFile(entryPath + "/manifest", manifest);
+    }
+}
+
+// Value of a field of a /proc file, such as VmRSS of status (kB) or syscr of io.
+double ReadProcField(const char* path, const string& field)
+{
+    ifstream file(path);
+    string line;
+    while (getline(file, line)) {
+        if (line.compare(0, field.size() + 1, field + ":") == 0) {
+            return stod(line.substr(field.size() + 1));
+        }
+    }
+    return 0;
+}
+
+double Measure(const function<void()>& operation)
+{
+    QElapsedTimer timer;
+    timer.start();
+    operation();
+    return timer.nsecsElapsed() / 1e6;
+}
+
+void AddPercentiles(map<string, double>& report, const string& operation, vector<double> samples)
+{
+    if (samples.empty()) {
+        return;
+    }
+    sort(samples.begin(), samples.end());
+    for (double percentile : kPercentiles) {
+        const size_t rank = static_cast<size_t>(ceil(percentile / 100 * samples.size()));
+        report[operation + ".p" + to_string(static_cast<int>(percentile)) + "_ms"] = samples[rank - 1];
+    }
+    report[operation + ".max_ms"] = samples.back();
+    report[operation + ".count"] = samples.size();
+}
+
+int RunSoak(int pictures, int hours, const QString& budgetPath)
+{
+    map<string, double> budgets;
+    try {
+        budgets = LoadBudgets(budgetPath, GetDefaultBudgets());
+    } catch (const Exception& e) {
+        spdlog::error("soak failed: {}", e.what());
+        return 1;
+    }
+
+    // Scratch home and settings, the cache finds its directories there
+    QTemporaryDir home;
+    if (!home.isValid()) {
+        spdlog::error("soak failed: can't create scratch directory");
+        return 1;
+    }
+    qputenv("HOME", home.path().toLocal8Bit());
+    QSettings::setPath(QSettings::NativeFormat, QSettings::UserScope, home.path() + "/config");
+    // A fixed location, the soak makes no network requests
+    QSettings settings;
+    settings.setValue("location/auto", false);
+    settings.setValue("longitude", 120.94);
+    settings.setValue("latitude", 28.14);
+    spdlog::info("generating {} pictures in {}", pictures, home.path().toStdString());
+    try {
+        const double elapsed = Measure([&]() { GenerateLibrary(home.path(), pictures); });
+        spdlog::info("generated in {:.1f} s", elapsed / 1000);
+    } catch (const Exception& e) {
+        spdlog::error("soak failed: {}", e.what());
+        return 1;
+    }
+    settings.setValue("wallpaper", GetPictureName(0));
+
+    map<string, double> report;
+    map<string, vector<double>> samples;
+    map<string, double> syncIo;
+    SimulatedClock clock(chrono::system_clock::now());
+    try {
+        // Startup lasts until the first keeper tick selected a frame
+        QString path;
+        report["startup_ms"] = Measure([&]() { Daemon::SelectWallpaper(Cache::getInstance(), clock.Now(), path); });
+        Cache& cache = Cache::getInstance();
+
+        const auto end = clock.Now() + chrono::hours(hours);
+        auto nextSync = clock.Now();
+        auto nextGallery = clock.Now();
+        int selected = 0;
+        double firstRss = 0;
+        while (clock.Now() < end) {
+            const auto now = clock.Now();
+            int delay = Daemon::kKeeperInterval;
+            samples["keeper"].push_back(Measure([&]() { delay = Daemon::SelectWallpaper(cache, now, path); }));
+
+            if (now >= nextSync) {
+                // Counted on this thread only, background jobs are not part of the cycle
+                const double reads = ReadProcField("/proc/thread-self/io", "syscr");
+                const double writes = ReadProcField("/proc/thread-self/io", "syscw");
+                const double bytes = ReadProcField("/proc/thread-self/io", "rchar");
+                samples["sync"].push_back(Measure([&]() { cache.SyncPictures(); }));
+                syncIo["sync.read_calls"] += ReadProcField("/proc/thread-self/io", "syscr") - reads;
+                syncIo["sync.write_calls"] += ReadProcField("/proc/thread-self/io", "syscw") - writes;
+                syncIo["sync.read_kb"] += (ReadProcField("/proc/thread-self/io", "rchar") - bytes) / 1024;
+
+                const double rss = ReadProcField("/proc/self/status", "VmRSS") / 1024;
+                if (firstRss == 0) {
+                    firstRss = rss;
+                }
+                report["rss.steady_mb"] = rss;
+                report["rss.growth_mb"] = rss - firstRss;
+                nextSync += kSyncInterval;
+            }
+
+            if (now >= nextGallery) {
+                samples["gallery"].push_back(Measure([&]() { cache.GetCachedPictures(); }));
+                selected = (selected + kSelectStride) % pictures;
+                samples["select"].push_back(Measure([&]() { cache.SetCurrentDesktop(GetPictureName(selected)); }));
+                nextGallery += kGalleryInterval;
+            }
+
+            clock.Advance(chrono::milliseconds(delay));
+        }
+    } catch (const Exception& e) {
+        spdlog::error("soak failed: {}", e.what());
+        return 1;
+    }
+
+    for (const auto& [operation, values] : samples) {
+        AddPercentiles(report, operation, values);
+    }
+    for (const auto& [name, total] : syncIo) {
+        report[name] = total / samples["sync"].size();
+    }
+    report["rss.peak_mb"] = ReadProcField("/proc/self/status", "VmHWM") / 1024;
+
+    return CheckBudgets(report, budgets) ? 0 : 1;
+}
+
+int RunKeeperCheck(int days)
+{
+    CachedPicture picture;
+    picture.name = "check";
+    for (int i = 0; i < kFramesPerPicture; i++) {
+        const SolarSample& position = GetFramePosition(i);
+        CachedFrame frame;
+        frame.index = i;
+        frame.altitude = position.altitude;
+        frame.azimuth = position.azimuth;
+        picture.frames.push_back(frame);
+        picture.selector.Add(frame.altitude, frame.azimuth, frame.ready);
+    }
+
+    // Mid latitude, above the arctic circle, southern hemisphere
+    const vector<CachedLocation> locations { { 120.94, 28.14 }, { 18.96, 69.65 }, { 151.21, -33.87 } };
+    bool passed = true;
+    for (const CachedLocation& location : locations) {
+        SimulatedClock clock(chrono::system_clock::from_time_t(kCheckStart));
+        const auto begin = clock.Now();
+        const auto end = begin + chrono::hours(24) * days;
+
+        // Wake-ups of the keeper and the frame shown at each
+        vector<ScheduleEntry> wakes;
+        int longestDelay = 0, lateWakes = 0;
+        QElapsedTimer timer;
+        timer.start();
+        while (clock.Now() < end) {
+            const auto now = clock.Now();
+            wakes.push_back(ScheduleEntry { now, picture.GetFrame(location, ToTime(now)).index });
+            const int delay = GetNextChange(picture, location, now, Daemon::kKeeperInterval);
+            longestDelay = max(longestDelay, delay);
+            if (delay <= 0 || delay > Daemon::kKeeperInterval) {
+                lateWakes++;
+            }
+            clock.Advance(chrono::milliseconds(max(delay, 1)));
+        }
+        const qint64 elapsed = timer.elapsed();
+
+        // Frames shown shorter than two steps may fall between samples
+        const auto& reference = SimulateSchedule(picture.selector, location.latitude, location.longitude,
+                                                 begin, end, kKeeperStep);
+        int changes = 0, missed = 0, late = 0;
+        chrono::system_clock::duration maxLag(0);
+        for (size_t i = 0; i < reference.size(); i++) {
+            const auto from = reference[i].time;
+            const auto to = i + 1 < reference.size() ? reference[i + 1].time : end;
+            if (to - from < 2 * kKeeperStep) {
+                continue;
+            }
+            changes++;
+            auto wake = lower_bound(wakes.begin(), wakes.end(), from - kCheckTolerance,
+                                    [](const ScheduleEntry& entry, chrono::system_clock::time_point time) {
+                return entry.time < time;
+            });
+            while (wake != wakes.end() && wake->time < to && wake->frame != reference[i].frame) {
+                ++wake;
+            }
+            if (wake == wakes.end() || wake->time >= to) {
+                missed++;
+            } else if (wake->time > from + kCheckTolerance) {
+                late++;
+            } else {
+                maxLag = max(maxLag, wake->time - from);
+            }
+        }
+
+        spdlog::info("lat {:.2f} lon {:.2f}: {} wake-ups in {} ms, longest interval {} s, {} changes at most {} s late",
+                     location.latitude, location.longitude, wakes.size(), elapsed, longestDelay / 1000, changes,
+                     chrono::duration_cast<chrono::seconds>(maxLag).count());
+        if (lateWakes > 0 || missed > 0 || late > 0) {
+            spdlog::error("lat {:.2f} lon {:.2f}: {} wake-ups later than {} s, {} frames missed, {} shown late",
+                          location.latitude, location.longitude, lateWakes, Daemon::kKeeperInterval / 1000,
+                          missed, late);
+            passed = false;
+        }
+    }
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,27 @@
+// Soak - headless tests of the daemon logic on synthetic pictures.
+// A scratch home with pictures, complete cache entries and a frame store is
+// generated, then the operations of the daemon run against it for a
+// simulated period:
+//   keeper    frame of the current picture and the next change, per tick
+//   sync      picture sync cycle, every kSyncInterval of simulated time
+//   gallery   catalog with icons and previews as the settings window loads it
+//   select    switch the current picture by name
+// Latency percentiles, startup time, resident memory and file reads and
+// writes per sync cycle are reported, and compared against budgets.
+#ifndef SOAK_H
+#define SOAK_H
+
+#include <QString>
+
+// Run the soak test with a library of pictures for hours of simulated time.
+// Budgets are read from a JSON object of metric name to maximum, they
+// replace the defaults. Return 0 if all budgets are met, 1 otherwise.
+int RunSoak(int pictures, int hours, const QString& budgetPath);
+
+// Drive the keeper through days of simulated time at a few locations. It
+// fails if a wake-up comes later than Daemon::kKeeperInterval, or if a
+// frame shown for two sampling steps or more is missed or shown later
+// than two steps after its change. Return 0 if it passes, 1 otherwise.
+int RunKeeperCheck(int days);
+
+#endif // SOAK_H
@@ -0,0 +1,287 @@
+// Solar - sun position and frame selection.
+#include "solar.h"
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <unordered_map>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+constexpr float kPadding = -1e30f;
+constexpr int64_t kSecondsPerDay = 24 * 60 * 60;
+
+Time ToTime(chrono::system_clock::time_point timePoint)
+{
+    time_t tt = chrono::system_clock::to_time_t(timePoint);
+    tm local_tm = *gmtime(&tt);
+    Time time;
+    time.year = local_tm.tm_year + 1900;
+    time.month = local_tm.tm_mon + 1;
+    time.day = local_tm.tm_mday;
+    time.hour = local_tm.tm_hour;
+    time.minute = local_tm.tm_min;
+    time.second = local_tm.tm_sec;
+    return time;
+}
+
+Position GetSolarPosition(double lat, double lon, const Time& tm)
+{
+    // Create location
+    Location loc;
+    loc.longitude = lon;
+    loc.latitude = lat;
+    loc.pressure = 101.325;
+    loc.temperature = 288;
+
+    // Compute positions
+    Position pos;
+    SolTrack(tm, loc, &pos, 1, 1, 0, 0);
+    return pos;
+}
+
+// Terms shared by all timestamps and locations at a UTC midnight.
+struct SolarTerms
+{
+    double declination;     // degrees
+    double equation;        // equation of time, degrees
+};
+
+SolarTerms GetSolarTerms(int64_t day)
+{
+    // On the equator at longitude 0 the sun direction gives declination and
+    // Greenwich hour angle directly, since the local frame is the equatorial one.
+    const auto midnight = chrono::system_clock::time_point(chrono::seconds(day * kSecondsPerDay));
+    const Position& position = GetSolarPosition(0, 0, ToTime(midnight));
+    const double altitude = position.altitude*PI/180;
+    const double azimuth = position.azimuthRefract*PI/180;
+    SolarTerms terms;
+    terms.declination = asin(cos(altitude) * cos(azimuth)) * 180/PI;
+    const double hourAngle = atan2(-cos(altitude) * sin(azimuth), sin(altitude)) * 180/PI;
+    // At midnight the mean sun is at hour angle 180
+    terms.equation = remainder(hourAngle - 180, 360.0);
+    return terms;
+}
+
+vector<SolarSample> GetSolarPositions(double lat, double lon, const vector<chrono::system_clock::time_point>& times)
+{
+    return GetSolarPositions(vector<pair<double, double>>{{lat, lon}}, times).front();
+}
+
+vector<vector<SolarSample>> GetSolarPositions(const vector<pair<double, double>>& locations,
+                                              const vector<chrono::system_clock::time_point>& times)
+{
+    // Interpolate per-day terms, SolTrack runs twice per distinct day at most
+    unordered_map<int64_t, SolarTerms> termsCache;
+    auto getTerms = [&](int64_t day) -> const SolarTerms& {
+        auto it = termsCache.find(day);
+        if (it == termsCache.end()) {
+            it = termsCache.emplace(day, GetSolarTerms(day)).first;
+        }
+        return it->second;
+    };
+    const size_t n = times.size();
+    vector<double> sinDeclinations(n), cosDeclinations(n), sinGreenwichHourAngles(n), cosGreenwichHourAngles(n);
+    for (size_t i = 0; i < n; i++) {
+        const int64_t seconds = chrono::duration_cast<chrono::seconds>(times[i].time_since_epoch()).count();
+        const int64_t day = seconds >= 0 ? seconds / kSecondsPerDay : (seconds - kSecondsPerDay + 1) / kSecondsPerDay;
+        const double fraction = static_cast<double>(seconds - day * kSecondsPerDay) / kSecondsPerDay;
+        const SolarTerms& begin = getTerms(day);
+        const SolarTerms& end = getTerms(day + 1);
+        const double declination = (begin.declination + (end.declination - begin.declination) * fraction) * PI/180;
+        const double equation = begin.equation + remainder(end.equation - begin.equation, 360.0) * fraction;
+        const double greenwichHourAngle = (180 + 360 * fraction + equation) * PI/180;
+        sinDeclinations[i] = sin(declination);
+        cosDeclinations[i] = cos(declination);
+        sinGreenwichHourAngles[i] = sin(greenwichHourAngle);
+        cosGreenwichHourAngles[i] = cos(greenwichHourAngle);
+    }
+
+    // Convert to horizontal coordinates. The local hour angle is the Greenwich
+    // one plus the longitude, so angle addition turns the per-location trig into
+    // multiply-adds over the shared per-time terms.
+    vector<vector<SolarSample>> positions(locations.size(), vector<SolarSample>(n));
+    vector<double> easts(n), norths(n), ups(n);
+    for (size_t j = 0; j < locations.size(); j++) {
+        const double latitude = locations[j].first*PI/180;
+        const double longitude = locations[j].second*PI/180;
+        const double sinLatitude = sin(latitude), cosLatitude = cos(latitude);
+        const double sinLongitude = sin(longitude), cosLongitude = cos(longitude);
+        size_t i = 0;
+#ifdef __SSE2__
+        const __m128d sinLat = _mm_set1_pd(sinLatitude), cosLat = _mm_set1_pd(cosLatitude);
+        const __m128d sinLon = _mm_set1_pd(sinLongitude), cosLon = _mm_set1_pd(cosLongitude);
+        const __m128d zero = _mm_setzero_pd();
+        for (; i + 2 <= n; i += 2) {
+            const __m128d sinGha = _mm_loadu_pd(&sinGreenwichHourAngles[i]);
+            const __m128d cosGha = _mm_loadu_pd(&cosGreenwichHourAngles[i]);
+            const __m128d sinDec = _mm_loadu_pd(&sinDeclinations[i]);
+            const __m128d cosDec = _mm_loadu_pd(&cosDeclinations[i]);
+            const __m128d sinHa = _mm_add_pd(_mm_mul_pd(sinGha, cosLon), _mm_mul_pd(cosGha, sinLon));
+            const __m128d cosHa = _mm_sub_pd(_mm_mul_pd(cosGha, cosLon), _mm_mul_pd(sinGha, sinLon));
+            const __m128d cosDecCosHa = _mm_mul_pd(cosDec, cosHa);
+            _mm_storeu_pd(&easts[i], _mm_sub_pd(zero, _mm_mul_pd(cosDec, sinHa)));
+            _mm_storeu_pd(&norths[i], _mm_sub_pd(_mm_mul_pd(sinDec, cosLat), _mm_mul_pd(cosDecCosHa, sinLat)));
+            _mm_storeu_pd(&ups[i], _mm_add_pd(_mm_mul_pd(sinDec, sinLat), _mm_mul_pd(cosDecCosHa, cosLat)));
+        }
+#endif
+        for (; i < n; i++) {
+            const double sinHourAngle = sinGreenwichHourAngles[i] * cosLongitude + cosGreenwichHourAngles[i] * sinLongitude;
+            const double cosHourAngle = cosGreenwichHourAngles[i] * cosLongitude - sinGreenwichHourAngles[i] * sinLongitude;
+            easts[i] = -cosDeclinations[i] * sinHourAngle;
+            norths[i] = sinDeclinations[i] * cosLatitude - cosDeclinations[i] * cosHourAngle * sinLatitude;
+            ups[i] = sinDeclinations[i] * sinLatitude + cosDeclinations[i] * cosHourAngle * cosLatitude;
+        }
+
+        // Inverse trig stays in libm, a polynomial would move frame switch times
+        SolarSample* samples = positions[j].data();
+        for (i = 0; i < n; i++) {
+            samples[i].altitude = asin(clamp(ups[i], -1.0, 1.0)) * 180/PI;
+            samples[i].azimuth = atan2(easts[i], norths[i]) * 180/PI;
+        }
+    }
+    return positions;
+}
+
+void FrameSelector::Add(double altitude, double azimuth, bool ready)
+{
+    if (size == static_cast<int>(xs.size())) {
+        xs.resize(size + kLanes, 0);
+        ys.resize(size + kLanes, 0);
+        zs.resize(size + kLanes, 0);
+        biases.resize(size + kLanes, kPadding);
+    }
+    xs[size] = cos(altitude*PI/180) * sin(azimuth*PI/180);
+    ys[size] = cos(altitude*PI/180) * cos(azimuth*PI/180);
+    zs[size] = sin(altitude*PI/180);
+    biases[size] = ready ? 0 : -4;
+    size++;
+}
+
+FrameSelection FrameSelector::Select(const Position& position) const
+{
+    return Select(position.altitude, position.azimuthRefract);
+}
+
+FrameSelection FrameSelector::Select(double altitude, double azimuth) const
+{
+    const float sunX = cos(altitude*PI/180) * sin(azimuth*PI/180);
+    const float sunY = cos(altitude*PI/180) * cos(azimuth*PI/180);
+    const float sunZ = sin(altitude*PI/180);
+
+    // Best and runner-up score and index of each lane
+    alignas(16) float bestScores[kLanes], secondScores[kLanes];
+    alignas(16) float bestIds[kLanes], secondIds[kLanes];
+#ifdef __SSE2__
+    const __m128 sx = _mm_set1_ps(sunX), sy = _mm_set1_ps(sunY), sz = _mm_set1_ps(sunZ);
+    __m128 best = _mm_set1_ps(kPadding), second = _mm_set1_ps(kPadding);
+    __m128 bestId = _mm_set1_ps(-1), secondId = _mm_set1_ps(-1);
+    __m128 id = _mm_setr_ps(0, 1, 2, 3);
+    const __m128 step = _mm_set1_ps(kLanes);
+    auto select = [](__m128 mask, __m128 a, __m128 b) {
+        return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+    };
+    for (size_t i = 0; i < xs.size(); i += kLanes) {
+        __m128 score = _mm_mul_ps(_mm_loadu_ps(&xs[i]), sx);
+        score = _mm_add_ps(score, _mm_mul_ps(_mm_loadu_ps(&ys[i]), sy));
+        score = _mm_add_ps(score, _mm_mul_ps(_mm_loadu_ps(&zs[i]), sz));
+        score = _mm_add_ps(score, _mm_loadu_ps(&biases[i]));
+        const __m128 gtBest = _mm_cmpgt_ps(score, best);
+        const __m128 gtSecond = _mm_cmpgt_ps(score, second);
+        second = select(gtBest, best, select(gtSecond, score, second));
+        secondId = select(gtBest, bestId, select(gtSecond, id, secondId));
+        best = select(gtBest, score, best);
+        bestId = select(gtBest, id, bestId);
+        id = _mm_add_ps(id, step);
+    }
+    _mm_store_ps(bestScores, best);
+    _mm_store_ps(secondScores, second);
+    _mm_store_ps(bestIds, bestId);
+    _mm_store_ps(secondIds, secondId);
+#else
+    fill(begin(bestScores), end(bestScores), kPadding);
+    fill(begin(secondScores), end(secondScores), kPadding);
+    fill(begin(bestIds), end(bestIds), -1);
+    fill(begin(secondIds), end(secondIds), -1);
+    for (size_t i = 0; i < xs.size(); i++) {
+        const int lane = i % kLanes;
+        const float score = xs[i] * sunX + ys[i] * sunY + zs[i] * sunZ + biases[i];
+        if (score > bestScores[lane]) {
+            secondScores[lane] = bestScores[lane];
+            secondIds[lane] = bestIds[lane];
+            bestScores[lane] = score;
+            bestIds[lane] = i;
+        } else if (score > secondScores[lane]) {
+            secondScores[lane] = score;
+            secondIds[lane] = i;
+        }
+    }
+#endif
+
+    // Reduce lanes
+    FrameSelection selection;
+    float bestScore = kPadding, secondScore = kPadding;
+    auto consider = [&](float score, float id) {
+        const int index = static_cast<int>(id);
+        if (index < 0 || index >= size) {
+            return;
+        }
+        if (score > bestScore || (score == bestScore && index < selection.best)) {
+            secondScore = bestScore;
+            selection.runnerUp = selection.best;
+            bestScore = score;
+            selection.best = index;
+        } else if (score > secondScore || (score == secondScore && index < selection.runnerUp)) {
+            secondScore = score;
+            selection.runnerUp = index;
+        }
+    };
+    for (int lane = 0; lane < kLanes; lane++) {
+        consider(bestScores[lane], bestIds[lane]);
+        consider(secondScores[lane], secondIds[lane]);
+    }
+
+    // Blend weight from angular distances, never blend towards a frame not ready
+    if (selection.runnerUp >= 0 && biases[selection.runnerUp] == biases[selection.best]) {
+        auto distance = [&](int index) {
+            const float dot = xs[index] * sunX + ys[index] * sunY + zs[index] * sunZ;
+            return acos(clamp(dot, -1.0f, 1.0f));
+        };
+        const double bestDistance = distance(selection.best);
+        const double secondDistance = distance(selection.runnerUp);
+        if (bestDistance + secondDistance > 0) {
+            selection.weight = bestDistance / (bestDistance + secondDistance);
+        }
+    }
+    return selection;
+}
+
+vector<ScheduleEntry> SimulateSchedule(const FrameSelector& selector, double lat, double lon,
+                                       chrono::system_clock::time_point begin,
+                                       chrono::system_clock::time_point end,
+                                       chrono::seconds step)
+{
+    // Evaluate a day at a time to bound memory
+    static constexpr int kBatchSize = 24 * 60;
+    vector<ScheduleEntry> schedule;
+    vector<chrono::system_clock::time_point> times;
+    times.reserve(kBatchSize);
+    for (auto batchBegin = begin; batchBegin < end; batchBegin += step * kBatchSize) {
+        times.clear();
+        for (auto tp = batchBegin; tp < end && times.size() < kBatchSize; tp += step) {
+            times.push_back(tp);
+        }
+        const vector<SolarSample>& samples = GetSolarPositions(lat, lon, times);
+        for (size_t i = 0; i < times.size(); i++) {
+            const int frame = selector.Select(samples[i].altitude, samples[i].azimuth).best;
+            if (schedule.empty() || schedule.back().frame != frame) {
+                schedule.push_back(ScheduleEntry{times[i], frame});
+            }
+        }
+    }
+    return schedule;
+}
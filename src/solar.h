@@ -0,0 +1,73 @@
+// Solar - sun position and frame selection.
+#ifndef SOLAR_H
+#define SOLAR_H
+
+#include <SolTrack.h>
+
+#include <chrono>
+#include <utility>
+#include <vector>
+
+// Convert a time point to UTC time used by SolTrack.
+Time ToTime(std::chrono::system_clock::time_point timePoint);
+
+Position GetSolarPosition(double lat, double lon, const Time& tm);
+
+struct SolarSample
+{
+    double altitude;    // degrees, without refraction
+    double azimuth;     // degrees, north is zero, east is positive
+};
+
+// Evaluate sun positions for many timestamps. Declination and equation of
+// time change slowly, so they are computed by SolTrack once per UTC day and
+// interpolated. Only the hour angle depends on the timestamp and location.
+std::vector<SolarSample> GetSolarPositions(double lat, double lon,
+                                           const std::vector<std::chrono::system_clock::time_point>& times);
+
+// Evaluate sun positions for many locations (latitude, longitude) sharing per-day terms.
+std::vector<std::vector<SolarSample>> GetSolarPositions(const std::vector<std::pair<double, double>>& locations,
+                                                        const std::vector<std::chrono::system_clock::time_point>& times);
+
+struct FrameSelection
+{
+    int best = -1;          // index of the nearest frame, -1 if there is no frame
+    int runnerUp = -1;      // index of the second nearest frame, -1 if there is one frame
+    double weight = 0;      // blend weight of the runner-up, in [0, 0.5]
+};
+
+// Select the frame nearest to the sun. Frame directions are stored as unit
+// vectors in structure-of-arrays layout, so a query is one dot product per
+// frame. Frames not ready are only selected if no frame is ready.
+class FrameSelector
+{
+    static constexpr int kLanes = 4;
+
+    std::vector<float> xs, ys, zs;
+    std::vector<float> biases;  // 0 for ready frames, below -2 otherwise
+    int size = 0;
+
+public:
+    void Add(double altitude, double azimuth, bool ready);
+
+    int GetSize() const { return size; }
+
+    FrameSelection Select(const Position& position) const;
+
+    FrameSelection Select(double altitude, double azimuth) const;
+};
+
+struct ScheduleEntry
+{
+    std::chrono::system_clock::time_point time;
+    int frame;
+};
+
+// Simulate which frame is shown between begin and end, sampled every step.
+// Only changes are returned, the first entry is the frame shown at begin.
+std::vector<ScheduleEntry> SimulateSchedule(const FrameSelector& selector, double lat, double lon,
+                                            std::chrono::system_clock::time_point begin,
+                                            std::chrono::system_clock::time_point end,
+                                            std::chrono::seconds step);
+
+#endif // SOLAR_H
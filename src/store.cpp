@@ -0,0 +1,287 @@
+// Frame Store - content-addressed storage of decoded frames.
+#include "delta.h"
+#include "exception.h"
+#include "log.h"
+#include "store.h"
+#include "writeback.h"
+
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QRegularExpression>
+
+using namespace std;
+
+QByteArray EncodeImage(const QImage& image, int quality)
+{
+    QByteArray data;
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::WriteOnly);
+    if (!image.save(&buffer, "JPG", quality)) {
+        throw Exception(
+                    Exception::EncodeImageError,
+                    "can't encode image");
+    }
+    return data;
+}
+
+void SaveImage(const QImage& image, const QString& path)
+{
+    SaveData(EncodeImage(image), path);
+}
+
+void SaveData(const QByteArray& data, const QString& path)
+{
+    WriteBatch batch;
+    batch.Write(path, data);
+    batch.Commit();
+}
+
+FrameStore::FrameStore(const QString& rootPath): rootPath(rootPath)
+{
+}
+
+bool FrameStore::IsHash(const QString& hash)
+{
+    static const QRegularExpression pattern("^[0-9a-f]{40}$");
+    return pattern.match(hash).hasMatch();
+}
+
+QString FrameStore::Hash(const QImage& image)
+{
+    return Hash(QVector<QImage>{ image });
+}
+
+QString FrameStore::Hash(const QVector<QImage>& planes)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    for (const QImage& image : planes) {
+        const int header[] = { image.width(), image.height(), static_cast<int>(image.format()) };
+        hash.addData(reinterpret_cast<const char*>(header), sizeof(header));
+        // Only hash visible bytes, padding at the end of scanlines is undefined.
+        const int lineBytes = image.width() * image.depth() / 8;
+        for (int y = 0; y < image.height(); y++) {
+            hash.addData(reinterpret_cast<const char*>(image.constScanLine(y)), lineBytes);
+        }
+    }
+    return hash.result().toHex();
+}
+
+QString FrameStore::GetBlobDir(const QString& hash) const
+{
+    return rootPath + "/" + hash.left(2);
+}
+
+QString FrameStore::GetPath(const QString& hash) const
+{
+    return GetBlobDir(hash) + "/" + hash + ".jpg";
+}
+
+QString FrameStore::GetThumbPath(const QString& hash) const
+{
+    return GetBlobDir(hash) + "/" + hash + "_thumb.jpg";
+}
+
+QString FrameStore::GetPreviewPath(const QString& hash) const
+{
+    return GetBlobDir(hash) + "/" + hash + "_preview.jpg";
+}
+
+QString FrameStore::GetDeltaPath(const QString& hash) const
+{
+    return GetBlobDir(hash) + "/" + hash + ".delta";
+}
+
+QString FrameStore::GetMaterializedPath(const QString& hash) const
+{
+    return rootPath + "/materialized/" + hash + ".jpg";
+}
+
+bool FrameStore::Contains(const QString& hash) const
+{
+    // Blobs stored before previews existed are completed on the next import
+    return (QFile::exists(GetPath(hash)) || QFile::exists(GetDeltaPath(hash)))
+            && QFile::exists(GetThumbPath(hash)) && QFile::exists(GetPreviewPath(hash));
+}
+
+bool FrameStore::IsDelta(const QString& hash) const
+{
+    // The full frame is removed once the delta is committed
+    return !QFile::exists(GetPath(hash)) && QFile::exists(GetDeltaPath(hash));
+}
+
+bool FrameStore::IsKey(const QString& hash) const
+{
+    return QFile::exists(GetBlobDir(hash) + "/" + hash + ".key");
+}
+
+void FrameStore::MarkKey(const QString& hash) const
+{
+    SaveData(QByteArray(), GetBlobDir(hash) + "/" + hash + ".key");
+}
+
+QImage FrameStore::LoadFrame(const QString& hash) const
+{
+    if (!IsDelta(hash)) {
+        return QImage(GetPath(hash));
+    }
+    QFile deltaFile(GetDeltaPath(hash));
+    if (!deltaFile.open(QFile::ReadOnly)) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "can't open file " + deltaFile.fileName().toStdString());
+    }
+    const DeltaFrame& delta = DeltaFrame::Parse(deltaFile.readAll());
+    const QImage& key = QImage(GetPath(delta.key)).convertToFormat(QImage::Format_RGB32);
+    if (key.isNull()) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "can't read keyframe " + delta.key.toStdString());
+    }
+    return DecodeDelta(key, delta);
+}
+
+QString FrameStore::Materialize(const QString& hash, const QString& keep) const
+{
+    if (!IsDelta(hash)) {
+        return GetPath(hash);
+    }
+    const QString& path = GetMaterializedPath(hash);
+    if (QFile::exists(path)) {
+        return path;
+    }
+    QElapsedTimer timer;
+    timer.start();
+    QDir dir(rootPath + "/materialized");
+    dir.mkpath(".");
+    SaveData(EncodeImage(LoadFrame(hash), kMaterializedQuality), path);
+    GetLogger(CacheLog).info("materialize {} in {} ms", hash.toStdString(), timer.elapsed());
+
+    // Keep the latest frames, the one just written is the newest
+    const QString& keepPath = keep.isEmpty() ? keep : QFileInfo(keep).absoluteFilePath();
+    int kept = 0;
+    for (const QFileInfo& file : dir.entryInfoList(QDir::Files, QDir::Time)) {
+        if (file.absoluteFilePath() != keepPath && ++kept > kMaterializedFrames) {
+            QFile::remove(file.filePath());
+        }
+    }
+    return path;
+}
+
+void FrameStore::PutRenditions(const QString& hash, const QImage& thumb, const QImage& preview) const
+{
+    QDir(GetBlobDir(hash)).mkpath(".");
+    WriteBatch batch;
+    batch.Write(GetPreviewPath(hash), EncodeImage(preview));
+    batch.Write(GetThumbPath(hash), EncodeImage(thumb));
+    batch.Commit();
+}
+
+void FrameStore::Put(const QString& hash, const QImage& image, const QImage& thumb, const QImage& preview) const
+{
+    Put(hash, EncodeImage(image), EncodeImage(thumb), EncodeImage(preview));
+}
+
+void FrameStore::Put(const QString& hash, const QByteArray& frame, const QByteArray& thumb, const QByteArray& preview) const
+{
+    // Files are renamed in order, the full frame marks the blob complete.
+    QDir(GetBlobDir(hash)).mkpath(".");
+    WriteBatch batch;
+    batch.Write(GetPreviewPath(hash), preview);
+    batch.Write(GetThumbPath(hash), thumb);
+    batch.Write(GetPath(hash), frame);
+    batch.Commit();
+}
+
+void FrameStore::PutDelta(const QString& hash, const QByteArray& delta) const
+{
+    SaveData(delta, GetDeltaPath(hash));
+    QFile::remove(GetPath(hash));
+}
+
+QMap<QString, QByteArray> FrameStore::Export(const QString& hash) const
+{
+    QStringList paths { GetThumbPath(hash), GetPreviewPath(hash), IsDelta(hash) ? GetDeltaPath(hash) : GetPath(hash) };
+    if (IsKey(hash)) {
+        paths.append(GetBlobDir(hash) + "/" + hash + ".key");
+    }
+    QMap<QString, QByteArray> files;
+    for (const QString& path : paths) {
+        QFile file(path);
+        if (!file.open(QFile::ReadOnly)) {
+            throw Exception(
+                        Exception::OpenFileError,
+                        "can't open file " + path.toStdString());
+        }
+        files.insert(QFileInfo(path).fileName(), file.readAll());
+    }
+    return files;
+}
+
+void FrameStore::Import(const QString& hash, const QMap<QString, QByteArray>& files) const
+{
+    const QString& frameName = hash + ".jpg";
+    const QString& deltaName = hash + ".delta";
+    const QStringList& names { hash + "_thumb.jpg", hash + "_preview.jpg", hash + ".key", frameName, deltaName };
+    if (!IsHash(hash) || !files.contains(hash + "_thumb.jpg") || !files.contains(hash + "_preview.jpg")
+            || files.contains(frameName) == files.contains(deltaName)) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "incomplete blob " + hash.toStdString());
+    }
+    for (const QString& name : files.keys()) {
+        if (!names.contains(name)) {
+            throw Exception(
+                        Exception::OpenFileError,
+                        "unexpected file " + name.toStdString() + " of blob " + hash.toStdString());
+        }
+    }
+
+    // Names are in commit order, the full frame or delta marks the blob complete
+    QDir(GetBlobDir(hash)).mkpath(".");
+    WriteBatch batch;
+    for (const QString& name : names) {
+        if (files.contains(name)) {
+            batch.Write(GetBlobDir(hash) + "/" + name, files.value(name));
+        }
+    }
+    batch.Commit();
+}
+
+int FrameStore::Collect(const QSet<QString>& referenced) const
+{
+    // Keyframes of referenced deltas are referenced too
+    QSet<QString> kept = referenced;
+    for (const QString& hash : referenced) {
+        QFile deltaFile(GetDeltaPath(hash));
+        if (IsDelta(hash) && deltaFile.open(QFile::ReadOnly)) {
+            try {
+                kept.insert(DeltaFrame::Parse(deltaFile.readAll()).key);
+            } catch (const Exception& e) {
+                GetLogger(CacheLog).error("read delta {} failed: {}", hash.toStdString(), e.what());
+            }
+        }
+    }
+
+    int removed = 0;
+    const QDateTime& staleTime = QDateTime::currentDateTime().addSecs(-kStaleTemporaryAge);
+    QDirIterator it(rootPath, QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        const QString& path = it.next();
+        const QString& hash = it.fileName().section('.', 0, 0).section('_', 0, 0);
+        // Temporary files of write batches are left behind by crashes
+        const bool isStale = it.fileName().contains(".tmp-") && it.fileInfo().lastModified() < staleTime;
+        if (!kept.contains(hash) || isStale) {
+            if (QFile::remove(path)) {
+                removed++;
+            } else {
+                GetLogger(CacheLog).info("remove blob {} failed", path.toStdString());
+            }
+        }
+    }
+    return removed;
+}
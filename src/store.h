@@ -0,0 +1,107 @@
+// Frame Store - content-addressed storage of decoded frames.
+// Layout:
+//   store/<first two hex digits>/<hash>.jpg        full frame
+//   store/<first two hex digits>/<hash>_thumb.jpg  thumbnail
+//   store/<first two hex digits>/<hash>_preview.jpg  preview of the settings window
+//   store/<first two hex digits>/<hash>.delta      frame stored as a delta, instead of .jpg
+//   store/<first two hex digits>/<hash>.key        marks a keyframe of deltas, never a delta itself
+//   store/materialized/<hash>.jpg                  recently shown delta frames
+// The hash is computed over decoded pixels, so identical frames shared
+// by several wallpapers (or re-exported files) are stored only once.
+#ifndef STORE_H
+#define STORE_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QMap>
+#include <QSet>
+#include <QString>
+#include <QVector>
+
+// Encode image as JPEG, quality -1 is the default of Qt.
+QByteArray EncodeImage(const QImage& image, int quality = -1);
+
+// Encode image as JPEG and commit the file atomically.
+void SaveImage(const QImage& image, const QString& path);
+
+// Commit encoded data to a file atomically, as a write batch of one file.
+void SaveData(const QByteArray& data, const QString& path);
+
+class FrameStore
+{
+    static constexpr int kMaterializedFrames = 4;
+    static constexpr int kMaterializedQuality = 95;
+    static constexpr int kStaleTemporaryAge = 60 * 60;  // seconds
+
+    QString rootPath;
+
+    QString GetBlobDir(const QString& hash) const;
+
+public:
+    FrameStore() = default;
+    explicit FrameStore(const QString& rootPath);
+
+    // Whether a string is a blob hash, the file names of a blob derive from it.
+    static bool IsHash(const QString& hash);
+
+    // Hash decoded pixels of an image.
+    static QString Hash(const QImage& image);
+
+    // Hash decoded pixels of a planar image, planes in order.
+    static QString Hash(const QVector<QImage>& planes);
+
+    QString GetPath(const QString& hash) const;
+
+    QString GetThumbPath(const QString& hash) const;
+
+    QString GetPreviewPath(const QString& hash) const;
+
+    QString GetDeltaPath(const QString& hash) const;
+
+    QString GetMaterializedPath(const QString& hash) const;
+
+    bool Contains(const QString& hash) const;
+
+    // Whether a frame is stored as a delta of a keyframe.
+    bool IsDelta(const QString& hash) const;
+
+    // Whether a frame is the keyframe of deltas.
+    bool IsKey(const QString& hash) const;
+
+    // Mark a frame as keyframe before deltas of it are stored.
+    void MarkKey(const QString& hash) const;
+
+    // Decode a full frame, reconstructing it if stored as a delta.
+    QImage LoadFrame(const QString& hash) const;
+
+    // Return the path of a JPEG file of a frame. Deltas are reconstructed
+    // into the materialized directory, which keeps the latest few and the
+    // file at keep, if any.
+    QString Materialize(const QString& hash, const QString& keep = QString()) const;
+
+    // Replace renditions of a stored frame.
+    void PutRenditions(const QString& hash, const QImage& thumb, const QImage& preview) const;
+
+    // Store a frame and its renditions. Each file is committed atomically.
+    void Put(const QString& hash, const QImage& image, const QImage& thumb, const QImage& preview) const;
+
+    // Store an encoded frame and its encoded renditions.
+    void Put(const QString& hash, const QByteArray& frame, const QByteArray& thumb, const QByteArray& preview) const;
+
+    // Replace a stored frame by a delta.
+    void PutDelta(const QString& hash, const QByteArray& delta) const;
+
+    // Read files of a blob by name: renditions, the full frame or its delta
+    // and the keyframe mark.
+    QMap<QString, QByteArray> Export(const QString& hash) const;
+
+    // Store files of a blob read by Export, in one batch with the full frame
+    // or delta last. Throws if a file does not belong to the blob.
+    void Import(const QString& hash, const QMap<QString, QByteArray>& files) const;
+
+    // Remove blobs not referenced by any manifest, keyframes of referenced
+    // deltas are kept. Return the number of removed blobs.
+    int Collect(const QSet<QString>& referenced) const;
+};
+
+#endif // STORE_H
@@ -0,0 +1,193 @@
+// Transfer - add a file to a directory moving as little data as possible.
+#include "transfer.h"
+#include "exception.h"
+#include "hash.h"
+
+#include <QFile>
+#include <QFileInfo>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+constexpr int64_t kChunkSize = 8 << 20;     // bytes copied and hashed between progress reports
+
+struct FileDescriptor
+{
+    const int fd;
+
+    explicit FileDescriptor(int fd): fd(fd) {}
+    FileDescriptor(const FileDescriptor&) = delete;
+
+    ~FileDescriptor()
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+// Read-only mapping of a whole file, read once from start to end.
+struct SourceMapping
+{
+    const uint8_t* data = nullptr;
+    const size_t size;
+
+    SourceMapping(int fd, size_t size): size(size)
+    {
+        if (size == 0) {
+            return;
+        }
+        void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address != MAP_FAILED) {
+            madvise(address, size, MADV_SEQUENTIAL);
+            data = static_cast<const uint8_t*>(address);
+        }
+    }
+    SourceMapping(const SourceMapping&) = delete;
+
+    ~SourceMapping()
+    {
+        if (data) {
+            munmap(const_cast<uint8_t*>(data), size);
+        }
+    }
+};
+
+LinkMode ParseLinkMode(const QString& mode)
+{
+    if (mode == "hardlink") {
+        return LinkMode::HardLink;
+    }
+    if (mode == "symlink") {
+        return LinkMode::SymbolicLink;
+    }
+    return LinkMode::None;
+}
+
+// Copy a chunk in the kernel, or from the mapped source once copy_file_range
+// turns out unsupported between these files.
+void CopyChunk(int in, int out, const uint8_t* data, int64_t offset, int64_t length, bool& inKernel)
+{
+    while (length > 0) {
+        ssize_t copied;
+        if (inKernel) {
+            loff_t inOffset = offset, outOffset = offset;
+            copied = copy_file_range(in, &inOffset, out, &outOffset, length, 0);
+            if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+                inKernel = false;
+                continue;
+            }
+        } else {
+            copied = pwrite(out, data + offset, length, offset);
+        }
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied <= 0) {
+            throw Exception(
+                        Exception::OpenFileError,
+                        string("can't copy file: ") + (copied < 0 ? strerror(errno) : "source truncated"));
+        }
+        offset += copied;
+        length -= copied;
+    }
+}
+
+TransferResult TransferFile(const QString& source, const QString& dest, LinkMode linkMode,
+                            const TransferProgress& progress, const TransferReady& ready)
+{
+    if (QFileInfo::exists(dest)) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "file " + dest.toStdString() + " exists");
+    }
+    const QByteArray& sourceName = QFile::encodeName(QFileInfo(source).absoluteFilePath());
+    const QByteArray& destName = QFile::encodeName(dest);
+    const QByteArray& partName = destName + ".part";
+    const QByteArray& linkName = destName + ".link";
+
+    const FileDescriptor in(open(sourceName.constData(), O_RDONLY | O_CLOEXEC));
+    struct stat info;
+    if (in.fd < 0 || fstat(in.fd, &info) != 0) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "can't open file " + source.toStdString());
+    }
+    const int64_t size = info.st_size;
+    const SourceMapping mapping(in.fd, size);
+    if (size > 0 && !mapping.data) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "can't map file " + source.toStdString());
+    }
+    const FileDescriptor out(open(partName.constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+    if (out.fd < 0) {
+        throw Exception(
+                    Exception::OpenFileError,
+                    "can't write file " + partName.toStdString());
+    }
+
+    TransferResult result;
+    bool linked = false;
+    try {
+        if (ioctl(out.fd, FICLONE, in.fd) == 0) {
+            result.method = "reflink";
+        } else if (linkMode == LinkMode::HardLink && link(sourceName.constData(), linkName.constData()) == 0) {
+            result.method = "hardlink";
+            linked = true;
+        } else if (linkMode == LinkMode::SymbolicLink && symlink(sourceName.constData(), linkName.constData()) == 0) {
+            result.method = "symlink";
+            linked = true;
+        }
+
+        // Hash each chunk right after copying it, while its pages are cached
+        const bool copy = result.method.isEmpty();
+        bool inKernel = true;
+        ContentHasher hasher;
+        for (int64_t offset = 0; offset < size; offset += kChunkSize) {
+            const int64_t length = min(kChunkSize, size - offset);
+            if (copy) {
+                CopyChunk(in.fd, out.fd, mapping.data, offset, length, inKernel);
+            }
+            hasher.Update(mapping.data + offset, length);
+            if (!progress(offset + length, size)) {
+                throw Exception(
+                            Exception::OpenFileError,
+                            "transfer of " + source.toStdString() + " cancelled");
+            }
+        }
+        if (copy) {
+            result.method = inKernel ? "copy_file_range" : "write";
+        }
+        result.checksum = hasher.Finish();
+        if (linked) {
+            unlink(partName.constData());
+        }
+        const QString& staged = QFile::decodeName(linked ? linkName : partName);
+        if (ready) {
+            ready(result, staged);
+        }
+        if (!QFile::rename(staged, dest)) {
+            throw Exception(
+                        Exception::OpenFileError,
+                        "can't move file to " + dest.toStdString());
+        }
+    } catch (...) {
+        unlink(partName.constData());
+        if (linked) {
+            unlink(linkName.constData());
+        }
+        throw;
+    }
+    return result;
+}
@@ -0,0 +1,45 @@
+// Transfer - add a file to a directory moving as little data as the file
+// system allows. Methods are tried in order:
+// 1. Reflink (FICLONE), the copy shares extents with the source.
+// 2. Hard link or symbolic link, if requested.
+// 3. copy_file_range, the kernel copies without a round trip to user space.
+// 4. Write from the mapped source.
+// The content hash is computed in the same pass, chunk by chunk as each is
+// copied, so the importer does not read the file again. Copies and links
+// are made next to the destination and renamed once complete.
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <QString>
+
+#include <cstdint>
+#include <functional>
+
+enum class LinkMode {
+    None,
+    HardLink,
+    SymbolicLink,
+};
+
+struct TransferResult
+{
+    QString checksum;   // see HashFile
+    QString method;     // "reflink", "hardlink", "symlink", "copy_file_range" or "write"
+};
+
+// Called with bytes done and total after each chunk, return false to cancel.
+using TransferProgress = std::function<bool(int64_t done, int64_t total)>;
+
+// Called with the result once the content is complete, right before the
+// staged file is renamed to the destination.
+using TransferReady = std::function<void(const TransferResult& result, const QString& staged)>;
+
+// Parse the import/linkMode setting: "hardlink", "symlink" or "copy".
+LinkMode ParseLinkMode(const QString& mode);
+
+// Add source as dest, which must not exist. Throws if it fails or is
+// cancelled, nothing is left at dest then.
+TransferResult TransferFile(const QString& source, const QString& dest, LinkMode linkMode,
+                            const TransferProgress& progress, const TransferReady& ready = nullptr);
+
+#endif // TRANSFER_H
@@ -0,0 +1,487 @@
+// Write Back - batched asynchronous writes of cache files.
+#include "exception.h"
+#include "log.h"
+#include "metrics.h"
+#include "writeback.h"
+
+#include <QFile>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+using namespace std;
+
+constexpr int kFileMode = 0644;
+constexpr size_t kMaxWriteSize = 1 << 30;   // bytes per write call
+
+struct BatchState
+{
+    mutex mtx;
+    condition_variable cond;
+    int pending = 0;
+    string error;           // the first failure
+    vector<shared_ptr<WriteRequest>> files;
+};
+
+struct WriteRequest
+{
+    enum Stage {
+        Open,
+        Write,
+        Sync,
+    };
+
+    Stage stage;
+    shared_ptr<BatchState> batch;
+    string path;            // temporary file, or directory to sync
+    string target;          // path once committed, empty for directories
+    QByteArray data;
+    int fd = -1;
+    size_t written = 0;
+    bool renamed = false;
+    chrono::steady_clock::time_point submitted;
+};
+
+// Requests in flight, for queue depth metrics.
+atomic<int> inflight = 0;
+atomic<int> inflightPeak = 0;
+
+void UpdateQueueDepth(int delta)
+{
+    const int depth = inflight += delta;
+    int peak = inflightPeak;
+    while (depth > peak && !inflightPeak.compare_exchange_weak(peak, depth)) {
+    }
+    Metrics& metrics = Metrics::getInstance();
+    metrics.Set("writeback.queue_depth", depth);
+    metrics.Set("writeback.queue_depth_peak", max(depth, peak));
+}
+
+// Finish a request, error is an errno value or 0.
+void Complete(WriteRequest* request, int error)
+{
+    const double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - request->submitted).count();
+    UpdateQueueDepth(-1);
+    Metrics& metrics = Metrics::getInstance();
+    if (request->stage != WriteRequest::Sync) {
+        metrics.Add("writeback.writes", 1);
+        metrics.Add("writeback.write_bytes", request->written);
+        metrics.Add("writeback.write_ms_total", elapsed);
+        metrics.Set("writeback.write_ms", elapsed);
+    } else {
+        metrics.Add("writeback.syncs", 1);
+        metrics.Add("writeback.sync_ms_total", elapsed);
+    }
+    BatchState& batch = *request->batch;
+    lock_guard<mutex> lock(batch.mtx);
+    if (error != 0 && batch.error.empty()) {
+        batch.error = "can't write file " + (request->target.empty() ? request->path : request->target)
+                + ": " + strerror(error);
+    }
+    if (--batch.pending == 0) {
+        batch.cond.notify_all();
+    }
+}
+
+class WriteEngine
+{
+public:
+    virtual ~WriteEngine() = default;
+
+    // Start requests in their current stage.
+    virtual void Submit(const vector<WriteRequest*>& requests) = 0;
+};
+
+// Run each request to completion with blocking calls on IO threads.
+class ThreadPoolEngine : public WriteEngine
+{
+    mutex mtx;
+    condition_variable cond;
+    bool isTerminated = false;
+    deque<WriteRequest*> queue;
+    vector<thread> threads;
+
+    static void Run(WriteRequest* request)
+    {
+        if (request->stage == WriteRequest::Sync) {
+            // Directories need their entries synced, files only their data
+            const int result = request->target.empty() ? fsync(request->fd) : fdatasync(request->fd);
+            const int error = result < 0 ? errno : 0;
+            close(request->fd);
+            request->fd = -1;
+            Complete(request, error);
+            return;
+        }
+        request->fd = open(request->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, kFileMode);
+        if (request->fd < 0) {
+            Complete(request, errno);
+            return;
+        }
+        request->stage = WriteRequest::Write;
+        while (request->written < static_cast<size_t>(request->data.size())) {
+            const size_t size = min(request->data.size() - request->written, kMaxWriteSize);
+            const ssize_t result = write(request->fd, request->data.constData() + request->written, size);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                Complete(request, result < 0 ? errno : EIO);
+                return;
+            }
+            request->written += result;
+        }
+        Complete(request, 0);
+    }
+
+    void Work()
+    {
+        unique_lock<mutex> lock(mtx);
+        while (true) {
+            cond.wait(lock, [this]() { return isTerminated || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            WriteRequest* request = queue.front();
+            queue.pop_front();
+            lock.unlock();
+            Run(request);
+            lock.lock();
+        }
+    }
+
+public:
+    explicit ThreadPoolEngine(int threadCount)
+    {
+        for (int i = 0; i < threadCount; i++) {
+            threads.emplace_back(&ThreadPoolEngine::Work, this);
+        }
+    }
+
+    ~ThreadPoolEngine() override
+    {
+        {
+            lock_guard<mutex> lock(mtx);
+            isTerminated = true;
+        }
+        cond.notify_all();
+        for (thread& worker : threads) {
+            worker.join();
+        }
+    }
+
+    void Submit(const vector<WriteRequest*>& requests) override
+    {
+        {
+            lock_guard<mutex> lock(mtx);
+            queue.insert(queue.end(), requests.begin(), requests.end());
+        }
+        cond.notify_all();
+    }
+};
+
+#ifdef HAVE_LIBURING
+
+// Submit each stage as an SQE, a reaper thread advances requests as their
+// completions arrive. Requests submitted together share one system call.
+class UringEngine : public WriteEngine
+{
+    io_uring ring;
+    mutex submitMutex;      // the submission queue is not thread safe
+    atomic<bool> isTerminated = false;
+    thread reaper;
+
+    void Prepare(WriteRequest* request)
+    {
+        io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        while (sqe == nullptr) {
+            // Queue full, hand entries to the kernel to free slots
+            io_uring_submit(&ring);
+            sqe = io_uring_get_sqe(&ring);
+        }
+        switch (request->stage) {
+        case WriteRequest::Open:
+            io_uring_prep_openat(sqe, AT_FDCWD, request->path.c_str(),
+                                 O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, kFileMode);
+            break;
+        case WriteRequest::Write:
+            io_uring_prep_write(sqe, request->fd, request->data.constData() + request->written,
+                                min(request->data.size() - request->written, kMaxWriteSize), request->written);
+            break;
+        case WriteRequest::Sync:
+            io_uring_prep_fsync(sqe, request->fd, request->target.empty() ? 0 : IORING_FSYNC_DATASYNC);
+            break;
+        }
+        io_uring_sqe_set_data(sqe, request);
+    }
+
+    void Advance(WriteRequest* request, int result)
+    {
+        switch (request->stage) {
+        case WriteRequest::Open:
+            if (result < 0) {
+                Complete(request, -result);
+                return;
+            }
+            request->fd = result;
+            request->stage = WriteRequest::Write;
+            break;
+        case WriteRequest::Write:
+            if (result <= 0) {
+                Complete(request, result < 0 ? -result : EIO);
+                return;
+            }
+            request->written += result;
+            break;
+        case WriteRequest::Sync:
+            close(request->fd);
+            request->fd = -1;
+            Complete(request, result < 0 ? -result : 0);
+            return;
+        }
+        if (request->written < static_cast<size_t>(request->data.size())) {
+            // Write the rest, short writes are resubmitted
+            lock_guard<mutex> lock(submitMutex);
+            Prepare(request);
+            io_uring_submit(&ring);
+        } else {
+            Complete(request, 0);
+        }
+    }
+
+    void Reap()
+    {
+        while (true) {
+            io_uring_cqe* cqe = nullptr;
+            const int ret = io_uring_wait_cqe(&ring, &cqe);
+            if (ret == -EINTR) {
+                continue;
+            }
+            if (ret < 0) {
+                GetLogger(CacheLog).error("io_uring wait failed: {}", strerror(-ret));
+                return;
+            }
+            WriteRequest* request = static_cast<WriteRequest*>(io_uring_cqe_get_data(cqe));
+            const int result = cqe->res;
+            io_uring_cqe_seen(&ring, cqe);
+            if (request == nullptr) {
+                // Wake-up for shutdown
+                if (isTerminated) {
+                    return;
+                }
+                continue;
+            }
+            Advance(request, result);
+        }
+    }
+
+    UringEngine() = default;
+
+    bool Init(int queueDepth)
+    {
+        if (io_uring_queue_init(queueDepth, &ring, 0) < 0) {
+            return false;
+        }
+        io_uring_probe* probe = io_uring_get_probe_ring(&ring);
+        const bool supported = probe != nullptr
+                && io_uring_opcode_supported(probe, IORING_OP_OPENAT)
+                && io_uring_opcode_supported(probe, IORING_OP_WRITE)
+                && io_uring_opcode_supported(probe, IORING_OP_FSYNC);
+        if (probe != nullptr) {
+            io_uring_free_probe(probe);
+        }
+        if (!supported) {
+            io_uring_queue_exit(&ring);
+            return false;
+        }
+        reaper = thread(&UringEngine::Reap, this);
+        return true;
+    }
+
+public:
+    ~UringEngine() override
+    {
+        if (!reaper.joinable()) {
+            return;
+        }
+        isTerminated = true;
+        {
+            lock_guard<mutex> lock(submitMutex);
+            io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+            while (sqe == nullptr) {
+                io_uring_submit(&ring);
+                sqe = io_uring_get_sqe(&ring);
+            }
+            io_uring_prep_nop(sqe);
+            io_uring_sqe_set_data(sqe, nullptr);
+            io_uring_submit(&ring);
+        }
+        reaper.join();
+        io_uring_queue_exit(&ring);
+    }
+
+    // Create an engine if the kernel supports every operation used.
+    static unique_ptr<WriteEngine> Create(int queueDepth)
+    {
+        unique_ptr<UringEngine> engine(new UringEngine());
+        if (!engine->Init(queueDepth)) {
+            return nullptr;
+        }
+        return engine;
+    }
+
+    void Submit(const vector<WriteRequest*>& requests) override
+    {
+        lock_guard<mutex> lock(submitMutex);
+        for (WriteRequest* request : requests) {
+            Prepare(request);
+        }
+        io_uring_submit(&ring);
+    }
+};
+
+#endif
+
+WriteBack::WriteBack()
+{
+#ifdef HAVE_LIBURING
+    engine = UringEngine::Create(kQueueDepth);
+    if (engine) {
+        GetLogger(CacheLog).info("write back uses io_uring");
+        return;
+    }
+#endif
+    engine = make_unique<ThreadPoolEngine>(kThreads);
+    GetLogger(CacheLog).info("write back uses {} threads", kThreads);
+}
+
+WriteBack::~WriteBack() = default;
+
+// Temporary names are unique within the process, like those of QSaveFile.
+atomic<uint64_t> temporarySequence = 0;
+
+WriteBatch::WriteBatch(): state(make_shared<BatchState>())
+{
+}
+
+WriteBatch::~WriteBatch()
+{
+    Wait();
+    for (const shared_ptr<WriteRequest>& file : state->files) {
+        if (file->fd >= 0) {
+            close(file->fd);
+        }
+        if (!file->renamed) {
+            unlink(file->path.c_str());
+        }
+    }
+}
+
+void WriteBatch::Wait()
+{
+    unique_lock<mutex> lock(state->mtx);
+    state->cond.wait(lock, [this]() { return state->pending == 0; });
+}
+
+void WriteBatch::Submit(const vector<shared_ptr<WriteRequest>>& requests)
+{
+    vector<WriteRequest*> pointers;
+    const auto now = chrono::steady_clock::now();
+    for (const shared_ptr<WriteRequest>& request : requests) {
+        request->submitted = now;
+        pointers.push_back(request.get());
+    }
+    {
+        lock_guard<mutex> lock(state->mtx);
+        state->pending += static_cast<int>(requests.size());
+    }
+    UpdateQueueDepth(static_cast<int>(requests.size()));
+    WriteBack::getInstance().engine->Submit(pointers);
+}
+
+void WriteBatch::Write(const QString& path, const QByteArray& data)
+{
+    auto request = make_shared<WriteRequest>();
+    request->stage = WriteRequest::Open;
+    request->batch = state;
+    request->target = QFile::encodeName(path).toStdString();
+    request->path = request->target + ".tmp-" + to_string(temporarySequence++);
+    request->data = data;
+    state->files.push_back(request);
+    Submit({ request });
+}
+
+void WriteBatch::Commit()
+{
+    const auto begin = chrono::steady_clock::now();
+    auto check = [this]() {
+        Wait();
+        if (!state->error.empty()) {
+            throw Exception(
+                        Exception::OpenFileError,
+                        state->error);
+        }
+    };
+
+    // Sync written files together
+    check();
+    vector<shared_ptr<WriteRequest>> syncs;
+    for (const shared_ptr<WriteRequest>& file : state->files) {
+        file->stage = WriteRequest::Sync;
+        syncs.push_back(file);
+    }
+    Submit(syncs);
+    check();
+
+    // Rename into place, then make the renames durable
+    set<string> directories;
+    for (const shared_ptr<WriteRequest>& file : state->files) {
+        if (rename(file->path.c_str(), file->target.c_str()) < 0) {
+            throw Exception(
+                        Exception::OpenFileError,
+                        "can't rename file " + file->target + ": " + strerror(errno));
+        }
+        file->renamed = true;
+        const size_t slash = file->target.rfind('/');
+        directories.insert(slash == string::npos ? "." : file->target.substr(0, max<size_t>(slash, 1)));
+    }
+    syncs.clear();
+    for (const string& directory : directories) {
+        auto request = make_shared<WriteRequest>();
+        request->stage = WriteRequest::Sync;
+        request->batch = state;
+        request->path = directory;
+        request->fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (request->fd < 0) {
+            const string message = "can't open directory " + directory + ": " + strerror(errno);
+            for (const shared_ptr<WriteRequest>& sync : syncs) {
+                close(sync->fd);
+            }
+            throw Exception(
+                        Exception::OpenFileError,
+                        message);
+        }
+        syncs.push_back(request);
+    }
+    Submit(syncs);
+    check();
+
+    Metrics& metrics = Metrics::getInstance();
+    metrics.Add("writeback.commits", 1);
+    metrics.Set("writeback.commit_ms", chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count());
+}
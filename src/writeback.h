@@ -0,0 +1,65 @@
+// Write Back - batched asynchronous writes of cache files. Files are
+// created and written through io_uring where available, otherwise by a
+// small pool of IO threads. A batch becomes durable at once: its files are
+// synced together, renamed into place, then each directory is synced once.
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <QByteArray>
+#include <QString>
+
+#include <memory>
+#include <vector>
+
+struct BatchState;
+struct WriteRequest;
+class WriteEngine;
+
+// Files committed together, each replaced atomically like by QSaveFile.
+// Writes start at once and overlap with those of other batches.
+class WriteBatch
+{
+    std::shared_ptr<BatchState> state;
+
+    void Wait();
+    void Submit(const std::vector<std::shared_ptr<WriteRequest>>& requests);
+
+public:
+    WriteBatch();
+    // Wait for writes in flight, files not committed are discarded.
+    ~WriteBatch();
+    WriteBatch(const WriteBatch& batch) = delete;
+    WriteBatch(WriteBatch&& batch) = delete;
+
+    // Start writing data to a temporary file next to path.
+    void Write(const QString& path, const QByteArray& data);
+
+    // Wait for writes, sync files, rename them into place in the order they
+    // were written, then sync their directories. Throws if any step fails.
+    void Commit();
+};
+
+class WriteBack
+{
+    static constexpr int kQueueDepth = 256;     // io_uring submission queue entries
+    static constexpr int kThreads = 4;          // IO threads without io_uring
+
+    std::unique_ptr<WriteEngine> engine;
+
+    WriteBack();
+    ~WriteBack();
+    WriteBack(const WriteBack& writeBack) = delete;
+    WriteBack(WriteBack&& writeBack) = delete;
+
+    friend class WriteBatch;
+
+public:
+
+    static WriteBack& getInstance()
+    {
+        static WriteBack instance;
+        return instance;
+    }
+};
+
+#endif // WRITEBACK_H